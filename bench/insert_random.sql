@@ -0,0 +1,3 @@
+-- Insert with random key
+\set k random(1, 1000000000)
+insert into bench(k, val) values (:k, :client_id);
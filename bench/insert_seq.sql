@@ -0,0 +1,2 @@
+-- Insert with sequentially increasing key
+insert into bench(k, val) values (nextval('bench_seq'), :client_id);
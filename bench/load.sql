@@ -0,0 +1,2 @@
+-- Load keys first..last (shared by B-Tree and Lsm3 runs, so that both index the same dataset)
+insert into bench(k, val) select i, i from generate_series(:first, :last) i;
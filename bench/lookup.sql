@@ -0,0 +1,3 @@
+-- Point lookup of preloaded key
+\set k random(1, :nkeys)
+select val from bench where k = :k;
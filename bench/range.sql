@@ -0,0 +1,3 @@
+-- Ordered scan of range of 100 keys
+\set k random(1, :nkeys - 100)
+select sum(val) from (select val from bench where k >= :k order by k limit 100) r;
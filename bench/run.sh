@@ -0,0 +1,155 @@
+#!/bin/bash
+#
+# Benchmark of Lsm3 index compared with B-Tree.
+# Provisions temporary Postgres instance configured by lsm3.conf, runs pgbench workloads
+# for B-Tree and for Lsm3 with different top index sizes, and appends results to CSV report.
+# Lsm3 should be installed (make install) before running benchmark.
+#
+# Parameters (environment variables):
+#   PG_BINDIR          directory with Postgres binaries (default: pg_config --bindir)
+#   BENCH_PORT         port of temporary instance (default 54329)
+#   BENCH_DURATION     duration of each pgbench run in seconds (default 30)
+#   BENCH_CLIENTS      number of pgbench clients (default 8)
+#   BENCH_JOBS         number of pgbench threads (default 4)
+#   BENCH_KEYS         number of preloaded keys (default 1000000)
+#   BENCH_TOP_SIZES    sizes of Lsm3 top index in kb (default "4096 65536")
+#   BENCH_WORKLOADS    workloads to run (default "insert_random insert_seq lookup_merge range mixed")
+#   BENCH_REPORT       CSV report file (default bench/results/bench-<timestamp>.csv)
+#
+set -eu
+
+BENCH_DIR=$(cd "$(dirname "$0")" && pwd)
+SRC_DIR=$(dirname "$BENCH_DIR")
+PG_BINDIR=${PG_BINDIR:-$(pg_config --bindir)}
+PORT=${BENCH_PORT:-54329}
+DURATION=${BENCH_DURATION:-30}
+CLIENTS=${BENCH_CLIENTS:-8}
+JOBS=${BENCH_JOBS:-4}
+NKEYS=${BENCH_KEYS:-1000000}
+TOP_SIZES=${BENCH_TOP_SIZES:-"4096 65536"}
+WORKLOADS=${BENCH_WORKLOADS:-"insert_random insert_seq lookup_merge range mixed"}
+REPORT=${BENCH_REPORT:-$BENCH_DIR/results/bench-$(date +%Y%m%d-%H%M%S).csv}
+DB=lsm3_bench
+
+WORK_DIR=$(mktemp -d)
+DATA_DIR=$WORK_DIR/data
+LOG_DIR=$WORK_DIR/log
+export PGHOST=$WORK_DIR PGPORT=$PORT
+
+PSQL="$PG_BINDIR/psql -X -q -A -t -v ON_ERROR_STOP=1 -d $DB"
+
+cleanup()
+{
+	"$PG_BINDIR/pg_ctl" -D "$DATA_DIR" -m immediate stop >/dev/null 2>&1 || true
+	rm -rf "$WORK_DIR"
+}
+trap cleanup EXIT
+
+# Provision temporary instance
+"$PG_BINDIR/initdb" -D "$DATA_DIR" -A trust >/dev/null
+cat "$SRC_DIR/lsm3.conf" >> "$DATA_DIR/postgresql.conf"
+cat >> "$DATA_DIR/postgresql.conf" <<EOF
+port = $PORT
+listen_addresses = ''
+unix_socket_directories = '$WORK_DIR'
+max_connections = $((CLIENTS + 20))
+max_worker_processes = 32
+EOF
+"$PG_BINDIR/pg_ctl" -D "$DATA_DIR" -l "$WORK_DIR/postgres.log" -w start >/dev/null
+"$PG_BINDIR/createdb" $DB
+$PSQL -c "create extension lsm3"
+
+mkdir -p "$(dirname "$REPORT")"
+if [ ! -s "$REPORT" ]; then
+	echo "index,top_index_size,workload,clients,duration,tps,latency_avg_ms,latency_p50_ms,latency_p95_ms,latency_p99_ms,wal_bytes,merges" > "$REPORT"
+fi
+
+# Create table with index of specified type and preload keys 1..NKEYS
+setup_table()
+{
+	local index=$1 top_size=$2
+	$PSQL <<EOF
+drop table if exists bench;
+drop sequence if exists bench_seq;
+create table bench(k bigint, val bigint);
+create sequence bench_seq start $((NKEYS + NKEYS / 10 + 1));
+EOF
+	if [ "$index" = lsm3 ]; then
+		$PSQL -c "create index bench_idx on bench using lsm3(k) with (top_index_size=$top_size)"
+	else
+		$PSQL -c "create index bench_idx on bench using btree(k)"
+	fi
+	$PSQL -v first=1 -v last=$NKEYS -f "$BENCH_DIR/load.sql"
+	if [ "$index" = lsm3 ]; then
+		$PSQL -c "select lsm3_wait_merge_completion('bench_idx')" >/dev/null
+	fi
+	$PSQL -c "vacuum analyze bench"
+	$PSQL -c "checkpoint"
+}
+
+merge_count()
+{
+	if [ "$1" = lsm3 ]; then
+		$PSQL -c "select lsm3_get_merge_count('bench_idx')"
+	else
+		echo 0
+	fi
+}
+
+# Run workload and append line to report
+run_workload()
+{
+	local index=$1 top_size=$2 workload=$3
+	local scripts wal_start merges_start tps latency percentiles wal_bytes merges
+
+	case $workload in
+		insert_random) scripts="-f $BENCH_DIR/insert_random.sql" ;;
+		insert_seq)    scripts="-f $BENCH_DIR/insert_seq.sql" ;;
+		lookup_merge)  scripts="-f $BENCH_DIR/lookup.sql" ;;
+		range)         scripts="-f $BENCH_DIR/range.sql" ;;
+		mixed)         scripts="-f $BENCH_DIR/lookup.sql@80 -f $BENCH_DIR/insert_random.sql@20" ;;
+		*) echo "Unknown workload $workload" >&2; exit 1 ;;
+	esac
+
+	setup_table "$index" "$top_size"
+	if [ "$workload" = lookup_merge ]; then
+		# Load the same additional keys for both indexes: for Lsm3 they fill top index, which merge is started,
+		# so that lookups are performed concurrently with merge
+		$PSQL -v first=$((NKEYS + 1)) -v last=$((NKEYS + NKEYS / 10)) -f "$BENCH_DIR/load.sql"
+		if [ "$index" = lsm3 ]; then
+			$PSQL -c "select lsm3_start_merge('bench_idx')" >/dev/null
+		fi
+	fi
+
+	wal_start=$($PSQL -c "select pg_current_wal_lsn()")
+	merges_start=$(merge_count "$index")
+
+	rm -rf "$LOG_DIR"
+	mkdir -p "$LOG_DIR"
+	"$PG_BINDIR/pgbench" -n -c "$CLIENTS" -j "$JOBS" -T "$DURATION" -D nkeys="$NKEYS" \
+		-l --log-prefix="$LOG_DIR/tx" $scripts $DB > "$WORK_DIR/pgbench.out"
+
+	# Older versions report tps including and excluding connection time: take the last one
+	tps=$(sed -n 's/^tps = \([0-9.]*\).*/\1/p' "$WORK_DIR/pgbench.out" | tail -1)
+	latency=$(sed -n 's/^latency average = \([0-9.]*\) ms.*/\1/p' "$WORK_DIR/pgbench.out")
+	# Third field of transaction log is latency in microseconds
+	percentiles=$(cat "$LOG_DIR"/tx.* | awk '{print $3}' | sort -n | awk '
+		{ lat[NR] = $1 }
+		END {
+			if (NR == 0) { print ",,"; exit }
+			printf "%.3f,%.3f,%.3f", lat[int((NR - 1) * 0.50) + 1] / 1000, lat[int((NR - 1) * 0.95) + 1] / 1000, lat[int((NR - 1) * 0.99) + 1] / 1000
+		}')
+	wal_bytes=$($PSQL -c "select pg_wal_lsn_diff(pg_current_wal_lsn(), '$wal_start')")
+	merges=$(( $(merge_count "$index") - merges_start ))
+
+	echo "$index,$top_size,$workload,$CLIENTS,$DURATION,$tps,$latency,$percentiles,$wal_bytes,$merges" | tee -a "$REPORT"
+}
+
+for workload in $WORKLOADS; do
+	run_workload btree "" "$workload"
+	for top_size in $TOP_SIZES; do
+		run_workload lsm3 "$top_size" "$workload"
+	done
+done
+
+echo "Report: $REPORT"
@@ -0,0 +1,32 @@
+-- Equal numeric values can have different binary representation (for example 1.0 and 1.00), so numeric_ops
+-- do not support deduplication and Bloom filters, as in B-Tree. Existing numeric indexes should be reindexed.
+ALTER OPERATOR FAMILY numeric_ops USING lsm3 DROP FUNCTION 4 (numeric, numeric);
+ALTER OPERATOR FAMILY numeric_ops USING lsm3_btree_wrapper DROP FUNCTION 4 (numeric, numeric);
+
+-- Non-blocking merge status: whether merge is in progress and number of completed merges (generation)
+CREATE FUNCTION lsm3_merge_status(index regclass, out merge_in_progress boolean, out generation bigint) returns record
+AS 'MODULE_PATHNAME' LANGUAGE C STRICT PARALLEL RESTRICTED;
+
+-- Statistic of Bloom filters usage: number of sub-index probes passed filter, skipped probes and false positives
+CREATE FUNCTION lsm3_get_bloom_stat(index regclass, out hits bigint, out skips bigint, out false_positives bigint) returns record
+AS 'MODULE_PATHNAME' LANGUAGE C STRICT PARALLEL RESTRICTED;
+
+-- Statistic of merges: number of merges, number of tuples propagated to the next level and number of dead tuples dropped by merges
+CREATE FUNCTION lsm3_get_merge_stat(index regclass, out merges bigint, out merged_tuples bigint, out dropped_tuples bigint) returns record
+AS 'MODULE_PATHNAME' LANGUAGE C STRICT PARALLEL RESTRICTED;
+
+-- Persistent state of Lsm3 indexes maintained by merges: recovery horizon of unlogged top indexes (kind 1)
+-- position of interrupted chunked merge (kind 2) and old storage of recycled sub-indexes (kind 3).
+-- Rows refer to storage and transaction IDs of this cluster, so content of the table is not dumped.
+CREATE TABLE lsm3_state(relid oid, kind integer, relfilenode oid, value bigint);
+
+-- Statistic of Lsm3 indexes of current database: inserts, merges, sizes of top indexes, delays of inserters, probes of sub-indexes
+-- (top indexes, intermediate levels and base index) and write/read amplification. Times are in milliseconds.
+CREATE FUNCTION lsm3_get_index_stats(out index regclass, out inserts bigint, out inserted_bytes bigint,
+	out merges bigint, out merged_tuples bigint, out merged_bytes bigint, out dropped_tuples bigint,
+	out merge_time float8, out merge_durations bigint[], out active_top_bytes bigint, out merging_top_bytes bigint,
+	out throttled bigint, out waits bigint, out wait_time float8, out scans bigint, out probes bigint[],
+	out early_exits bigint, out write_amplification float8, out read_amplification float8) returns setof record
+AS 'MODULE_PATHNAME' LANGUAGE C STRICT PARALLEL RESTRICTED;
+
+CREATE VIEW lsm3_stat_indexes AS SELECT * FROM lsm3_get_index_stats();
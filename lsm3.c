@@ -1,38 +1,71 @@
 #include "postgres.h"
+#include <math.h>
 #include "access/attnum.h"
+#include "access/generic_xlog.h"
+#include "access/heapam.h"
+#include "access/htup_details.h"
 #include "utils/relcache.h"
 #include "access/reloptions.h"
 #include "access/nbtree.h"
+#include "access/parallel.h"
 #include "access/table.h"
+#include "access/tableam.h"
+#include "access/transam.h"
 #include "access/relation.h"
 #include "access/relscan.h"
 #include "access/xact.h"
+#include "access/xlog.h"
 #include "access/xloginsert.h"
+#include "commands/async.h"
 #include "commands/defrem.h"
+#include "common/hashfn.h"
 #include "funcapi.h"
 #include "utils/rel.h"
 #include "nodes/makefuncs.h"
+#include "nodes/pathnodes.h"
+#include "optimizer/cost.h"
+#include "optimizer/plancat.h"
+#include "catalog/catalog.h"
 #include "catalog/dependency.h"
+#include "catalog/indexing.h"
+#include "catalog/pg_am.h"
+#include "catalog/pg_class.h"
 #include "catalog/pg_operator.h"
+#include "catalog/pg_type.h"
 #include "catalog/index.h"
 #include "catalog/namespace.h"
+#include "catalog/objectaccess.h"
 #include "catalog/storage.h"
 #include "utils/lsyscache.h"
 #include "utils/typcache.h"
 #include "utils/builtins.h"
+#include "utils/datum.h"
+#include "utils/fmgroids.h"
 #include "utils/index_selfuncs.h"
+#include "utils/inval.h"
+#include "utils/memutils.h"
 #include "utils/rel.h"
+#include "utils/snapmgr.h"
+#include "utils/syscache.h"
+#include "utils/timestamp.h"
 #include "miscadmin.h"
 #include "tcop/utility.h"
 #include "postmaster/bgworker.h"
+#include "postmaster/interrupt.h"
+#include "postmaster/postmaster.h"
 #include "pgstat.h"
+#include "port/pg_bitutils.h"
 #include "executor/executor.h"
+#include "storage/bufmgr.h"
+#include "storage/condition_variable.h"
 #include "storage/ipc.h"
 #include "storage/latch.h"
 #include "storage/lock.h"
 #include "storage/lmgr.h"
 #include "storage/proc.h"
+#include "storage/shm_mq.h"
 #include "storage/procarray.h"
+#include "storage/smgr.h"
 
 #include "lsm3.h"
 
@@ -45,19 +78,37 @@ PG_FUNCTION_INFO_V1(lsm3_btree_wrapper);
 PG_FUNCTION_INFO_V1(lsm3_get_merge_count);
 PG_FUNCTION_INFO_V1(lsm3_start_merge);
 PG_FUNCTION_INFO_V1(lsm3_wait_merge_completion);
+PG_FUNCTION_INFO_V1(lsm3_merge_status);
 PG_FUNCTION_INFO_V1(lsm3_top_index_size);
+PG_FUNCTION_INFO_V1(lsm3_get_bloom_stat);
+PG_FUNCTION_INFO_V1(lsm3_get_merge_stat);
+PG_FUNCTION_INFO_V1(lsm3_get_index_stats);
 
 extern void	_PG_init(void);
 extern void	_PG_fini(void);
 
 extern void lsm3_merger_main(Datum arg);
+extern PGDLLEXPORT void lsm3_parallel_merge_main(dsm_segment *seg, shm_toc *toc);
+
+static SortSupport lsm3_build_sortkeys(Relation index, bool abbreviate);
+static void lsm3_flush_buffers(void);
+static void lsm3_discard_buffers(void);
+static int lsm3_compare_index_tuples(IndexScanDesc scan, IndexTuple itup, SortSupport sortKeys);
+static IndexTuple lsm3_copy_scan_tuple(IndexScanDesc scan);
+static void lsm3_recover_tops(Lsm3DictEntry* entry, Relation index);
+static bool lsm3_index_contains(Relation index, Relation heap, IndexTuple itup);
+static Page lsm3_read_page(Relation index, BlockNumber blkno);
+static void lsm3_schedule_merge(Oid db_id);
+static bool lsm3_entry_is_valid(Lsm3DictEntry* entry, Oid base);
 
 /* Lsm3 dictionary (hashtable with control data for all indexes) */
 static HTAB*          Lsm3Dict;
 static LWLock*        Lsm3DictLock;
-static List*          Lsm3ReleasedLocks;
+static Lsm3MergerPool* Lsm3Pool;
+static HTAB*          Lsm3LocalDict;
+static bool           Lsm3TopsOpened;
+static List*          Lsm3BufferedEntries; /* Local entries with non-empty insert buffer */
 static List*          Lsm3Entries;
-static bool           Lsm3InsideCopy;
 
 /* Kind of relation optioms for Lsm3 index */
 static relopt_kind    Lsm3ReloptKind;
@@ -69,14 +120,67 @@ static shmem_startup_hook_type  PreviousShmemStartupHook = NULL;
 static shmem_request_hook_type  PreviousShmemRequestHook = NULL;
 #endif
 static ExecutorFinish_hook_type PreviousExecutorFinish = NULL;
+static get_relation_info_hook_type PreviousGetRelationInfoHook = NULL;
+static object_access_hook_type PreviousObjectAccessHook = NULL;
 
 /* Lsm3 GUCs */
 static int Lsm3MaxIndexes;
 static int Lsm3TopIndexSize;
+static int Lsm3RewriteMergeRatio;
+static int Lsm3BloomFilterSize;
+static int Lsm3MaxMergeWorkers;
+static int Lsm3MaxParallelMergeWorkers;
+static int Lsm3TopIndexSoftLimit;
+static int Lsm3TopIndexHardLimit;
+static double Lsm3ThrottleDelay;
+static int Lsm3InsertBufferSize;
+static bool Lsm3MergeGC;
+static bool Lsm3AppendMerge;
+static int Lsm3MergePrefetchDistance;
+static int Lsm3MergeChunkSize;
+
+#if PG_VERSION_NUM>=170000
+#define Lsm3LockHeldByMe(tag, mode) LockHeldByMe(tag, mode, false)
+#define Lsm3TransamVariables TransamVariables
+#define Lsm3BackendNumber MyProcNumber
+#else
+#define Lsm3LockHeldByMe(tag, mode) LockHeldByMe(tag, mode)
+#define Lsm3TransamVariables ShmemVariableCache
+#define Lsm3BackendNumber MyBackendId
+#endif
+
+/* Statistic counters stripe of this backend */
+#define LSM3_BACKEND_STATS(entry) (&(entry)->stats[(uint32)Lsm3BackendNumber % LSM3_STAT_STRIPES].counters)
+
+/* Number of 32-bit words in each Bloom filter */
+#define LSM3_BLOOM_WORDS ((Size)Lsm3BloomFilterSize*1024/sizeof(pg_atomic_uint32))
+
+/* Values of merge_mode index option */
+static relopt_enum_elt_def Lsm3MergeModes[] =
+{
+	{"auto", LSM3_MERGE_AUTO},
+	{"insert", LSM3_MERGE_INSERT},
+	{"rewrite", LSM3_MERGE_REWRITE},
+	{(const char *) NULL}
+};
 
 /* Background worker termination flag */
 static volatile bool Lsm3Cancel;
 
+/* Size of Lsm3 dictionary entry including Bloom filters */
+static Size
+lsm3_dict_entry_size(void)
+{
+	return MAXALIGN(offsetof(Lsm3DictEntry, bloom) + LSM3_MAX_BLOOM_FILTERS*LSM3_BLOOM_WORDS*sizeof(pg_atomic_uint32));
+}
+
+/* Size of merge workers pool */
+static Size
+lsm3_merger_pool_size(void)
+{
+	return offsetof(Lsm3MergerPool, slots) + Lsm3MaxMergeWorkers*sizeof(Lsm3MergerSlot);
+}
+
 static void
 lsm3_shmem_request(void)
 {
@@ -85,7 +189,8 @@ lsm3_shmem_request(void)
 		PreviousShmemRequestHook();
 #endif
 
-	RequestAddinShmemSpace(hash_estimate_size(Lsm3MaxIndexes, sizeof(Lsm3DictEntry)));
+	RequestAddinShmemSpace(hash_estimate_size(Lsm3MaxIndexes, lsm3_dict_entry_size()));
+	RequestAddinShmemSpace(lsm3_merger_pool_size());
 	RequestNamedLWLockTranche("lsm3", 1);
 }
 
@@ -93,14 +198,32 @@ static void
 lsm3_shmem_startup(void)
 {
 	HASHCTL info;
+	bool found;
 
 	if (PreviousShmemStartupHook)
 	{
 		PreviousShmemStartupHook();
     }
+	LWLockAcquire(AddinShmemInitLock, LW_EXCLUSIVE);
+	Lsm3Pool = (Lsm3MergerPool*)ShmemInitStruct("lsm3 merger pool", lsm3_merger_pool_size(), &found);
+	if (!found)
+	{
+		SpinLockInit(&Lsm3Pool->spinlock);
+		pg_atomic_init_u64(&Lsm3Pool->n_merges, 0);
+		ConditionVariableInit(&Lsm3Pool->merge_cv);
+		for (int i = 0; i < Lsm3MaxMergeWorkers; i++)
+		{
+			Lsm3Pool->slots[i].in_use = false;
+			Lsm3Pool->slots[i].db_id = InvalidOid;
+			Lsm3Pool->slots[i].proc = NULL;
+			Lsm3Pool->slots[i].base = InvalidOid;
+			Lsm3Pool->slots[i].generation = 0;
+		}
+	}
+	LWLockRelease(AddinShmemInitLock);
 	memset(&info, 0, sizeof(info));
 	info.keysize = sizeof(Oid);
-	info.entrysize = sizeof(Lsm3DictEntry);
+	info.entrysize = lsm3_dict_entry_size();
 	Lsm3Dict = ShmemInitHash("lsm3 hash",
 							 Lsm3MaxIndexes, Lsm3MaxIndexes,
 							 &info,
@@ -110,21 +233,89 @@ lsm3_shmem_startup(void)
 
 /* Initialize Lsm3 control data entry */
 static void
-lsm3_init_entry(Lsm3DictEntry* entry, Relation index)
+lsm3_init_entry(Lsm3DictEntry* entry, Relation index, TransactionId horizon, bool equal_image)
 {
 	SpinLockInit(&entry->spinlock);
 	entry->active_index = 0;
-	entry->merger = NULL;
 	entry->merge_in_progress = false;
+	pg_atomic_init_u64(&entry->merge_generation, 0);
+	entry->merge_failures = 0;
 	entry->start_merge = false;
+	entry->merge_request_size = 0;
+	entry->merge_request_seq = 0;
+	pg_atomic_init_u64(&entry->top_bytes[0], 0);
+	pg_atomic_init_u64(&entry->top_bytes[1], 0);
+	pg_atomic_init_u64(&entry->n_throttled, 0);
+	pg_atomic_init_u64(&entry->n_waits, 0);
+	pg_atomic_init_u64(&entry->merged_tuples, 0);
+	pg_atomic_init_u64(&entry->dropped_tuples, 0);
+	pg_atomic_init_u64(&entry->merged_bytes, 0);
+	pg_atomic_init_u64(&entry->merge_time, 0);
+	for (int i = 0; i < LSM3_MERGE_DURATION_BUCKETS; i++)
+		pg_atomic_init_u64(&entry->merge_durations[i], 0);
+	for (int i = 0; i < LSM3_STAT_STRIPES; i++)
+	{
+		Lsm3StatCounters* stats = &entry->stats[i].counters;
+		pg_atomic_init_u64(&stats->inserts, 0);
+		pg_atomic_init_u64(&stats->inserted_bytes, 0);
+		pg_atomic_init_u64(&stats->wait_time, 0);
+		pg_atomic_init_u64(&stats->scans, 0);
+		pg_atomic_init_u64(&stats->early_exits, 0);
+		for (int j = 0; j < LSM3_MAX_SUB_INDEXES; j++)
+			pg_atomic_init_u64(&stats->probes[j], 0);
+	}
+	entry->nonempty_levels = 0;
+	entry->resume_level = 0;
 	entry->n_merges = 0;
 	entry->n_inserts = 0;
 	entry->top[0] = entry->top[1] = InvalidOid;
+	for (int i = 0; i < LSM3_MAX_LEVELS; i++)
+	{
+		entry->level[i] = InvalidOid;
+		pg_atomic_init_u32(&entry->level_pages[i], 1);
+	}
 	entry->access_count[0] = entry->access_count[1] = 0;
 	entry->heap = index->rd_index->indrelid;
 	entry->db_id = MyDatabaseId;
-	entry->user_id = GetUserId();
 	entry->top_index_size = index->rd_options ? ((Lsm3Options*)index->rd_options)->top_index_size : 0;
+	entry->n_levels = index->rd_options ? ((Lsm3Options*)index->rd_options)->levels : 0;
+	entry->level_ratio = index->rd_options ? ((Lsm3Options*)index->rd_options)->level_ratio : LSM3_DEFAULT_LEVEL_RATIO;
+	entry->unlogged_tops = index->rd_options && ((Lsm3Options*)index->rd_options)->unlogged_tops
+		&& index->rd_rel->relpersistence == RELPERSISTENCE_PERMANENT;
+	entry->recovery_pending = entry->unlogged_tops;
+	entry->top_horizon[0] = entry->top_horizon[1] = horizon;
+	pg_atomic_init_u64(&entry->recycle_generation, 0);
+	pg_atomic_init_u64(&entry->n_vacuums, 0);
+	entry->equal_image = equal_image;
+	entry->bloom_enabled = LSM3_BLOOM_WORDS != 0 && entry->equal_image;
+	for (int i = 0; i < LSM3_MAX_BLOOM_FILTERS; i++)
+		entry->bloom_valid[i] = false; /* content of existed sub-indexes is unknown */
+	for (Size i = 0; i < LSM3_MAX_BLOOM_FILTERS*LSM3_BLOOM_WORDS; i++)
+		pg_atomic_init_u32(&entry->bloom[i], 0);
+	pg_atomic_init_u64(&entry->bloom_hits, 0);
+	pg_atomic_init_u64(&entry->bloom_skips, 0);
+	pg_atomic_init_u64(&entry->bloom_false_positives, 0);
+}
+
+/* Get Oid of sub-index with specified number: two top indexes, then intermediate levels and base index */
+static Oid
+lsm3_get_sub_index(Lsm3DictEntry* entry, int i)
+{
+	return i < 2 ? entry->top[i] : i < entry->n_levels + 2 ? entry->level[i - 2] : entry->base;
+}
+
+/*
+ * Oldest XID which may be still running or visible to some snapshot: all tuples inserted from now on
+ * have XID not preceding it. If heap is not specified, then transactions of all databases are considered.
+ */
+static TransactionId
+lsm3_get_oldest_xmin(Relation heap)
+{
+#if PG_VERSION_NUM>=140000
+	return GetOldestNonRemovableTransactionId(heap);
+#else
+	return GetOldestXmin(heap, PROCARRAY_FLAGS_VACUUM);
+#endif
 }
 
 /* Get B-Tree index size (number of blocks) */
@@ -137,636 +328,5126 @@ lsm3_get_index_size(Oid relid)
        return size;
 }
 
-/* Lookup or create Lsm3 control data for this index */
-static Lsm3DictEntry*
-lsm3_get_entry(Relation index)
+/*
+ * Lock preventing merge of sub-indexes while index is scanned in parallel:
+ * if tuple is present both in merged sub-index and in destination index, then it can be returned by two participants.
+ * Merger obtains this lock in exclusive mode, participants of parallel scan scanning base index in parallel - in shared mode.
+ */
+#define LSM3_MERGE_LOCK 3
+
+static void
+lsm3_set_merge_locktag(LOCKTAG* tag, Oid base)
 {
-	Lsm3DictEntry* entry;
-	bool found = true;
-	LWLockAcquire(Lsm3DictLock, LW_SHARED);
-	entry = (Lsm3DictEntry*)hash_search(Lsm3Dict, &RelationGetRelid(index), HASH_FIND, &found);
-	if (entry == NULL)
-	{
-		/* We need exclusive lock to create new entry */
-		LWLockRelease(Lsm3DictLock);
-		LWLockAcquire(Lsm3DictLock, LW_EXCLUSIVE);
-		entry = (Lsm3DictEntry*)hash_search(Lsm3Dict, &RelationGetRelid(index), HASH_ENTER, &found);
-	}
-	if (!found)
+	SET_LOCKTAG_ADVISORY(*tag, MyDatabaseId, base, 0, LSM3_MERGE_LOCK);
+}
+
+/*
+ * Wait completion of parallel scans. Parallel scan can take a long time, so merger does not queue for the lock
+ * (it would also block new parallel scans) but requests it conditionally during LSM3_SWITCH_LOCK_TIMEOUT.
+ */
+static bool
+lsm3_lock_for_merge(LOCKTAG* tag)
+{
+	int i;
+
+	for (i = 0; i < LSM3_SWITCH_LOCK_TIMEOUT / 10; i++)
 	{
-		char* relname = RelationGetRelationName(index);
-		lsm3_init_entry(entry, index);
-		for (int i = 0; i < 2; i++)
-		{
-			char* topidxname = psprintf("%s_top%d", relname, i);
-			entry->top[i] = get_relname_relid(topidxname, RelationGetNamespace(index));
-			if (entry->top[i] == InvalidOid)
-			{
-				elog(ERROR, "Lsm3: failed to lookup %s index", topidxname);
-			}
-		}
-		entry->active_index = lsm3_get_index_size(entry->top[0]) >= lsm3_get_index_size(entry->top[1]) ? 0 : 1;
+		if (LockAcquire(tag, ExclusiveLock, false, true) != LOCKACQUIRE_NOT_AVAIL)
+			return true;
+		(void) WaitLatch(MyLatch, WL_LATCH_SET | WL_TIMEOUT | WL_EXIT_ON_PM_DEATH, 10, PG_WAIT_EXTENSION);
+		ResetLatch(MyLatch);
+		CHECK_FOR_INTERRUPTS();
 	}
-	LWLockRelease(Lsm3DictLock);
-	return entry;
+	return false;
 }
 
-/* Launch merger bgworker */
-static void
-lsm3_launch_bgworker(Lsm3DictEntry* entry)
-{
-	BackgroundWorker worker;
-	BackgroundWorkerHandle *handle;
-	pid_t bgw_pid;
+/*
+ * Bloom filters.
+ * Filter of sub-index should include keys of all tuples present in this sub-index.
+ * It is filled by inserts in top index, merged into the filter of next level before merge
+ * and cleared after truncation of sub-index. Filter of sub-index which content is unknown
+ * (after server restart) is marked as invalid and is not used until sub-index is truncated.
+ */
 
-	MemSet(&worker, 0, sizeof(worker));
-	snprintf(worker.bgw_name, sizeof(worker.bgw_name), "lsm3-merger-%d", entry->base);
-	snprintf(worker.bgw_type, sizeof(worker.bgw_type), "lsm3-merger-%d", entry->base);
-	worker.bgw_flags = BGWORKER_SHMEM_ACCESS | BGWORKER_BACKEND_DATABASE_CONNECTION;
-	worker.bgw_start_time = BgWorkerStart_ConsistentState;
-	worker.bgw_restart_time = BGW_NEVER_RESTART;
-	strcpy(worker.bgw_function_name, "lsm3_merger_main");
-	strcpy(worker.bgw_library_name, "lsm3");
-	worker.bgw_main_arg = PointerGetDatum(entry);
-	worker.bgw_notify_pid = MyProcPid;
+static bool
+lsm3_is_integer_type(Oid type)
+{
+	return type == INT2OID || type == INT4OID || type == INT8OID;
+}
 
-	if (!RegisterDynamicBackgroundWorker(&worker, &handle))
+/* Hash value of key column. Integer types are normalized to allow cross-type lookups */
+static uint64
+lsm3_hash_datum(Datum value, Oid type, int16 typlen, bool typbyval)
+{
+	if (lsm3_is_integer_type(type))
 	{
-		elog(ERROR, "Lsm3: failed to start background worker");
+		int64 val = type == INT2OID ? DatumGetInt16(value) : type == INT4OID ? DatumGetInt32(value) : DatumGetInt64(value);
+		return hash_any_extended((unsigned char*)&val, sizeof(val), 0);
 	}
-	if (WaitForBackgroundWorkerStartup(handle, &bgw_pid) != BGWH_STARTED)
+	else if (typbyval)
 	{
-		elog(ERROR, "Lsm3: startup of background worker is failed");
+		return hash_any_extended((unsigned char*)&value, sizeof(value), 0);
 	}
-	entry->merger = BackendPidGetProc(bgw_pid);
-	for (int n_attempts = 0; entry->merger == NULL || n_attempts < 100; n_attempts++)
+	else if (typlen == -1)
 	{
-		pg_usleep(10000); /* wait background worker to be registered in procarray */
-		entry->merger = BackendPidGetProc(bgw_pid);
+		struct varlena* v = PG_DETOAST_DATUM_PACKED(value);
+		uint64 hash = hash_any_extended((unsigned char*)VARDATA_ANY(v), VARSIZE_ANY_EXHDR(v), 0);
+		if ((Pointer)v != DatumGetPointer(value))
+			pfree(v);
+		return hash;
 	}
-	if (entry->merger == NULL)
+	else if (typlen == -2)
 	{
-		elog(ERROR, "Lsm3: background worker %d is crashed", bgw_pid);
+		return hash_any_extended((unsigned char*)DatumGetCString(value), strlen(DatumGetCString(value)), 0);
+	}
+	else
+	{
+		return hash_any_extended((unsigned char*)DatumGetPointer(value), typlen, 0);
 	}
 }
 
-/* Cancel merger bgwroker */
-static void
-lsm3_merge_cancel(int sig)
+/* Calculate hash of inserted key. Returns false if key can not be located by equality lookup */
+static bool
+lsm3_key_hash(Relation index, Datum* values, bool* isnull, uint64* hash)
 {
-	Lsm3Cancel = true;
-	SetLatch(MyLatch);
+	TupleDesc desc = RelationGetDescr(index);
+	int nkeyatts = IndexRelationGetNumberOfKeyAttributes(index);
+	uint64 h = 0;
+
+	for (int i = 0; i < nkeyatts; i++)
+	{
+		Form_pg_attribute att = TupleDescAttr(desc, i);
+		if (isnull[i])
+			return false;
+		h = hash_combine64(h, lsm3_hash_datum(values[i], index->rd_opcintype[i], att->attlen, att->attbyval));
+	}
+	*hash = h;
+	return true;
 }
 
-/* Truncate top index */
-static void
-lsm3_truncate_index(Oid index_oid, Oid heap_oid)
+/* Calculate hash of searched key. Returns false if scan is not equality lookup for all key columns */
+static bool
+lsm3_bloom_scan_hash(Relation index, ScanKey scankey, int nscankeys, uint64* hash)
 {
-	Relation index = index_open(index_oid, AccessExclusiveLock);
-	Relation heap = table_open(heap_oid, AccessShareLock); /* heap is actually not used, because we will not load data to top indexes */
-	IndexInfo* indexInfo = BuildDummyIndexInfo(index);
-	RelationTruncate(index, 0);
-	elog(LOG, "Lsm3: truncate index %s", RelationGetRelationName(index));
-	index_build(heap, index, indexInfo, true, false);
-	index_close(index, AccessExclusiveLock);
-	table_close(heap, AccessShareLock);
-}
+	int nkeyatts = IndexRelationGetNumberOfKeyAttributes(index);
+	ScanKey keys[INDEX_MAX_KEYS];
+	uint64 h = 0;
 
-#if PG_VERSION_NUM>=140000
-#define INSERT_FLAGS UNIQUE_CHECK_NO, false
-#else
-#define INSERT_FLAGS false
-#endif
+	if (nscankeys != nkeyatts)
+		return false;
 
-/* Merge top index into base index */
-static void
-lsm3_merge_indexes(Oid dst_oid, Oid src_oid, Oid heap_oid)
-{
-	Relation top_index = index_open(src_oid, AccessShareLock);
-	Relation heap = table_open(heap_oid, AccessShareLock);
-	Relation base_index = index_open(dst_oid, RowExclusiveLock);
-	IndexScanDesc scan;
-	bool ok;
-	Oid  save_am = base_index->rd_rel->relam;
+	memset(keys, 0, sizeof(keys));
+	for (int i = 0; i < nscankeys; i++)
+	{
+		ScanKey key = &scankey[i];
+		int attno = key->sk_attno - 1;
+		Oid opcintype;
+		Oid type;
 
-	elog(LOG, "Lsm3: merge top index %s with size %d blocks", RelationGetRelationName(top_index), RelationGetNumberOfBlocks(top_index));
+		if (key->sk_strategy != BTEqualStrategyNumber
+			|| (key->sk_flags & (SK_ISNULL|SK_ROW_HEADER|SK_SEARCHARRAY|SK_SEARCHNULL|SK_SEARCHNOTNULL))
+			|| attno < 0 || attno >= nkeyatts || keys[attno] != NULL)
+			return false;
 
-	base_index->rd_rel->relam = BTREE_AM_OID;
-	scan = index_beginscan(heap, top_index, SnapshotAny, 0, 0);
-	scan->xs_want_itup = true;
-	btrescan(scan, NULL, 0, 0, 0);
-	for (ok = _bt_first(scan, ForwardScanDirection); ok; ok = _bt_next(scan, ForwardScanDirection))
-	{
-		IndexTuple itup = scan->xs_itup;
-		if (BTreeTupleIsPosting(itup))
-		{
-			/* Some dirty coding here related with handling of posting items (index deduplication).
-			 * If index tuple is posting item, we need to transfer it to normal index tuple.
-			 * Posting list is representing by index tuple with INDEX_ALT_TID_MASK bit set in t_info and
-			 * BT_IS_POSTING bit in TID offset, following by array of TIDs.
-			 * We need to store right TID (taken from xs_heaptid) and correct index tuple length
-			 * (not including size of TIDs array), clearing INDEX_ALT_TID_MASK.
-			 * For efficiency reasons let's do it in place, saving and restoring original values after insertion is done.
-			 */
-			ItemPointerData save_tid = itup->t_tid;
-			unsigned short save_info = itup->t_info;
-			itup->t_info = (save_info & ~(INDEX_SIZE_MASK | INDEX_ALT_TID_MASK)) + BTreeTupleGetPostingOffset(itup);
-			itup->t_tid = scan->xs_heaptid;
-			_bt_doinsert(base_index, itup, INSERT_FLAGS, heap); /* lsm3 index is not unique so need not to heck for duplica
-tes */
-			itup->t_tid = save_tid;
-			itup->t_info = save_info;
-		}
-		else
-		{
-			_bt_doinsert(base_index, itup, INSERT_FLAGS, heap); /* lsm3 index is not unique so need not to heck for duplica
-tes */
-		}
+		opcintype = index->rd_opcintype[attno];
+		type = key->sk_subtype != InvalidOid ? key->sk_subtype : opcintype;
+		if (type != opcintype && !(lsm3_is_integer_type(type) && lsm3_is_integer_type(opcintype)))
+			return false; /* cross-type comparison: equal values may have different representation */
+		keys[attno] = key;
 	}
-	index_endscan(scan);
-	base_index->rd_rel->relam = save_am;
-	index_close(top_index, AccessShareLock);
-	index_close(base_index, RowExclusiveLock);
-	table_close(heap, AccessShareLock);
+	for (int i = 0; i < nkeyatts; i++)
+	{
+		Oid type = keys[i]->sk_subtype != InvalidOid ? keys[i]->sk_subtype : index->rd_opcintype[i];
+		int16 typlen;
+		bool typbyval;
+		get_typlenbyval(type, &typlen, &typbyval);
+		h = hash_combine64(h, lsm3_hash_datum(keys[i]->sk_argument, type, typlen, typbyval));
+	}
+	*hash = h;
+	return true;
 }
 
-/* Lsm3 index options.
- */
-static bytea *
-lsm3_options(Datum reloptions, bool validate)
+static pg_atomic_uint32*
+lsm3_bloom_filter(Lsm3DictEntry* entry, int i)
 {
-	static const relopt_parse_elt tab[] = {
-		{"fillfactor", RELOPT_TYPE_INT, offsetof(BTOptions, fillfactor)},
-		{"vacuum_cleanup_index_scale_factor", RELOPT_TYPE_REAL,
-		offsetof(BTOptions, vacuum_cleanup_index_scale_factor)},
-		{"deduplicate_items", RELOPT_TYPE_BOOL,
-		 offsetof(BTOptions, deduplicate_items)},
-		{"top_index_size", RELOPT_TYPE_INT, offsetof(Lsm3Options, top_index_size)},
-		{"unique", RELOPT_TYPE_BOOL, offsetof(Lsm3Options, unique)}
-	};
-	return (bytea *) build_reloptions(reloptions, validate, Lsm3ReloptKind,
-									  sizeof(Lsm3Options), tab, lengthof(tab));
+	Assert(i < LSM3_MAX_BLOOM_FILTERS);
+	return &entry->bloom[i*LSM3_BLOOM_WORDS];
 }
 
-/* Main function of merger bgwroker */
-void
-lsm3_merger_main(Datum arg)
+static void
+lsm3_bloom_add(Lsm3DictEntry* entry, int i, uint64 hash)
 {
-	Lsm3DictEntry* entry = (Lsm3DictEntry*)DatumGetPointer(arg);
-	char	   *appname;
+	pg_atomic_uint32* filter = lsm3_bloom_filter(entry, i);
+	uint64 n_bits = LSM3_BLOOM_WORDS*32;
+	uint32 h1 = (uint32)hash;
+	uint32 h2 = (uint32)(hash >> 32) | 1;
 
-	pqsignal(SIGINT,  lsm3_merge_cancel);
-	pqsignal(SIGQUIT, lsm3_merge_cancel);
-	pqsignal(SIGTERM, lsm3_merge_cancel);
+	for (int j = 0; j < LSM3_BLOOM_HASHES; j++)
+	{
+		uint64 bit = ((uint64)h1 + (uint64)j*h2) % n_bits;
+		uint32 mask = (uint32)1 << (bit % 32);
+		if (!(pg_atomic_read_u32(&filter[bit / 32]) & mask))
+			pg_atomic_fetch_or_u32(&filter[bit / 32], mask);
+	}
+}
 
-	/* We're now ready to receive signals */
-	BackgroundWorkerUnblockSignals();
+static bool
+lsm3_bloom_contains(Lsm3DictEntry* entry, int i, uint64 hash)
+{
+	pg_atomic_uint32* filter = lsm3_bloom_filter(entry, i);
+	uint64 n_bits = LSM3_BLOOM_WORDS*32;
+	uint32 h1 = (uint32)hash;
+	uint32 h2 = (uint32)(hash >> 32) | 1;
 
-	BackgroundWorkerInitializeConnectionByOid(entry->db_id, entry->user_id, 0);
+	for (int j = 0; j < LSM3_BLOOM_HASHES; j++)
+	{
+		uint64 bit = ((uint64)h1 + (uint64)j*h2) % n_bits;
+		if (!(pg_atomic_read_u32(&filter[bit / 32]) & ((uint32)1 << (bit % 32))))
+			return false;
+	}
+	return true;
+}
 
-	appname = psprintf("lsm3 merger for %d", entry->base);
-	pgstat_report_appname(appname);
-	pfree(appname);
+/* Include keys of source sub-index in the filter of destination sub-index (should be done before merge) */
+static void
+lsm3_bloom_merge(Lsm3DictEntry* entry, int dst, int src)
+{
+	pg_atomic_uint32* dst_filter = lsm3_bloom_filter(entry, dst);
+	pg_atomic_uint32* src_filter = lsm3_bloom_filter(entry, src);
 
-	while (!Lsm3Cancel)
+	if (!entry->bloom_valid[src])
+		entry->bloom_valid[dst] = false;
+	for (Size i = 0; i < LSM3_BLOOM_WORDS; i++)
 	{
-		int merge_index= -1;
-		int wr;
-		pgstat_report_activity(STATE_IDLE, "waiting");
-		wr = WaitLatch(MyLatch, WL_LATCH_SET | WL_EXIT_ON_PM_DEATH, -1L, PG_WAIT_EXTENSION);
-
-		if ((wr & WL_POSTMASTER_DEATH) || Lsm3Cancel)
-		{
-			break;
-		}
+		uint32 bits = pg_atomic_read_u32(&src_filter[i]);
+		if (bits != 0)
+			pg_atomic_fetch_or_u32(&dst_filter[i], bits);
+	}
+}
 
-		ResetLatch(MyLatch);
+/* Clear filter of truncated sub-index */
+static void
+lsm3_bloom_reset(Lsm3DictEntry* entry, int i)
+{
+	pg_atomic_uint32* filter = lsm3_bloom_filter(entry, i);
+	for (Size j = 0; j < LSM3_BLOOM_WORDS; j++)
+		pg_atomic_write_u32(&filter[j], 0);
+	pg_write_barrier();
+	entry->bloom_valid[i] = true;
+}
 
-		/* Check if merge is requested under spinlock */
-		SpinLockAcquire(&entry->spinlock);
-		if (entry->start_merge)
-		{
-			merge_index = 1 - entry->active_index; /* at this moment active index should already by swapped */
-			entry->start_merge = false;
-		}
-		SpinLockRelease(&entry->spinlock);
+/*
+ * Persistent state.
+ * State of Lsm3 index which has to survive restart (and which is not known to Postgres) is stored in lsm3_state table
+ * created by the extension, rather than in unused fields of pg_class (them are checked by Postgres and reset by
+ * TRUNCATE and REINDEX). Table is accessed directly by heap functions and is updated transactionally together with
+ * the changes it describes. It is located in the schema of the extension (where access method handlers are defined).
+ */
+typedef struct
+{
+	Oid   relfilenode;
+	int64 value;
+} Lsm3StateItem;
 
-		if (merge_index >= 0)
-		{
-			StartTransactionCommand();
-			{
-				pgstat_report_activity(STATE_RUNNING, "merging");
-				lsm3_merge_indexes(entry->base, entry->top[merge_index], entry->heap);
+/* Open lsm3_state table. Returns NULL if it doesn't exist (is dropped by DROP EXTENSION) */
+static Relation
+lsm3_state_open(Relation index, LOCKMODE lockmode)
+{
+	Oid relid = get_relname_relid("lsm3_state", get_func_namespace(index->rd_amhandler));
+	return OidIsValid(relid) ? table_open(relid, lockmode) : NULL;
+}
 
-				pgstat_report_activity(STATE_RUNNING, "truncate");
-				lsm3_truncate_index(entry->top[merge_index], entry->heap);
-			}
-			CommitTransactionCommand();
+/* Scan state rows of the index with the specified kind (all rows if kind is 0) */
+static SysScanDesc
+lsm3_state_beginscan(Relation state, Relation index, int kind)
+{
+	ScanKeyData key[2];
 
-			SpinLockAcquire(&entry->spinlock);
-			entry->merge_in_progress = false; /* mark merge as completed */
-			SpinLockRelease(&entry->spinlock);
-		}
-	}
-	entry->merger = NULL;
+	ScanKeyInit(&key[0], Anum_lsm3_state_relid, BTEqualStrategyNumber, F_OIDEQ,
+				ObjectIdGetDatum(RelationGetRelid(index)));
+	ScanKeyInit(&key[1], Anum_lsm3_state_kind, BTEqualStrategyNumber, F_INT4EQ,
+				Int32GetDatum(kind));
+	/* Snapshot is refreshed for each scan of relation without syscache */
+	return systable_beginscan(state, InvalidOid, false, NULL, kind != 0 ? 2 : 1, key);
 }
 
-/* Build index tuple comparator context */
-static SortSupport
-lsm3_build_sortkeys(Relation index)
+/* Get list of state items (Lsm3StateItem*) of the index with the specified kind */
+static List*
+lsm3_state_get(Relation index, int kind)
 {
-	int	keysz = IndexRelationGetNumberOfKeyAttributes(index);
-	SortSupport	sortKeys = (SortSupport) palloc0(keysz * sizeof(SortSupportData));
-	BTScanInsert inskey = _bt_mkscankey(index, NULL);
-	Oid          save_am = index->rd_rel->relam;
+	Relation state = lsm3_state_open(index, AccessShareLock);
+	List* items = NIL;
+	SysScanDesc scan;
+	HeapTuple tuple;
 
-	index->rd_rel->relam = BTREE_AM_OID;
+	if (state == NULL)
+		return NIL;
 
-	for (int i = 0; i < keysz; i++)
+	scan = lsm3_state_beginscan(state, index, kind);
+	while (HeapTupleIsValid(tuple = systable_getnext(scan)))
 	{
-		SortSupport sortKey = &sortKeys[i];
-		ScanKey		scanKey = &inskey->scankeys[i];
-		int16		strategy;
-
-		sortKey->ssup_cxt = CurrentMemoryContext;
-		sortKey->ssup_collation = scanKey->sk_collation;
-		sortKey->ssup_nulls_first =
-			(scanKey->sk_flags & SK_BT_NULLS_FIRST) != 0;
-		sortKey->ssup_attno = scanKey->sk_attno;
-		/* Abbreviation is not supported here */
-		sortKey->abbreviate = false;
-
-		Assert(sortKey->ssup_attno != 0);
-
-		strategy = (scanKey->sk_flags & SK_BT_DESC) != 0 ?
-			BTGreaterStrategyNumber : BTLessStrategyNumber;
-
-		PrepareSortSupportFromIndexRel(index, strategy, sortKey);
+		Lsm3StateItem* item = (Lsm3StateItem*)palloc(sizeof(Lsm3StateItem));
+		bool isnull;
+		item->relfilenode = DatumGetObjectId(heap_getattr(tuple, Anum_lsm3_state_relfilenode, RelationGetDescr(state), &isnull));
+		item->value = DatumGetInt64(heap_getattr(tuple, Anum_lsm3_state_value, RelationGetDescr(state), &isnull));
+		items = lappend(items, item);
 	}
-	index->rd_rel->relam = save_am;
-	return sortKeys;
+	systable_endscan(scan);
+	table_close(state, AccessShareLock);
+	return items;
 }
 
-/* Compare index tuples */
-static int
-lsm3_compare_index_tuples(IndexScanDesc scan1, IndexScanDesc scan2, SortSupport sortKeys)
+/* Remove state rows of the index with the specified kind (all rows if kind is 0) and relfilenode (any if invalid) */
+static void
+lsm3_state_remove(Relation index, int kind, Oid relfilenode)
 {
-	int n_keys = IndexRelationGetNumberOfKeyAttributes(scan1->indexRelation);
+	Relation state = lsm3_state_open(index, RowExclusiveLock);
+	SysScanDesc scan;
+	HeapTuple tuple;
 
-	for (int i = 1; i <= n_keys; i++)
-	{
-		Datum	datum[2];
-		bool	isNull[2];
-		int 	result;
+	if (state == NULL)
+		return;
 
-		datum[0] = index_getattr(scan1->xs_itup, i, scan1->xs_itupdesc, &isNull[0]);
-		datum[1] = index_getattr(scan2->xs_itup, i, scan2->xs_itupdesc, &isNull[1]);
-		result = ApplySortComparator(datum[0], isNull[0],
-									 datum[1], isNull[1],
-									 &sortKeys[i - 1]);
-		if (result != 0)
+	scan = lsm3_state_beginscan(state, index, kind);
+	while (HeapTupleIsValid(tuple = systable_getnext(scan)))
+	{
+		bool isnull;
+		if (!OidIsValid(relfilenode)
+			|| DatumGetObjectId(heap_getattr(tuple, Anum_lsm3_state_relfilenode, RelationGetDescr(state), &isnull)) == relfilenode)
 		{
-			return result;
+			simple_heap_delete(state, &tuple->t_self);
 		}
 	}
-	return ItemPointerCompare(&scan1->xs_heaptid, &scan2->xs_heaptid);
+	systable_endscan(scan);
+	table_close(state, RowExclusiveLock);
+	CommandCounterIncrement();
+}
+
+/* Add state row */
+static void
+lsm3_state_add(Relation index, int kind, Oid relfilenode, int64 value)
+{
+	Relation state = lsm3_state_open(index, RowExclusiveLock);
+	Datum values[Natts_lsm3_state];
+	bool  nulls[Natts_lsm3_state] = {false};
+	HeapTuple tuple;
+
+	if (state == NULL)
+		ereport(ERROR,
+				(errcode(ERRCODE_OBJECT_NOT_IN_PREREQUISITE_STATE),
+				 errmsg("Lsm3: lsm3_state table is not found"),
+				 errhint("Update the extension with ALTER EXTENSION lsm3 UPDATE.")));
+
+	values[Anum_lsm3_state_relid - 1] = ObjectIdGetDatum(RelationGetRelid(index));
+	values[Anum_lsm3_state_kind - 1] = Int32GetDatum(kind);
+	values[Anum_lsm3_state_relfilenode - 1] = ObjectIdGetDatum(relfilenode);
+	values[Anum_lsm3_state_value - 1] = Int64GetDatum(value);
+	tuple = heap_form_tuple(RelationGetDescr(state), values, nulls);
+	simple_heap_insert(state, tuple);
+	heap_freetuple(tuple);
+	table_close(state, RowExclusiveLock);
+	CommandCounterIncrement();
 }
 
 /*
- * Lsm3 access methods implementation
+ * Recovery horizon of unlogged top indexes is stored in state of base index.
+ * It is updated transactionally together with recycling of merged top index,
+ * so after crash all tuples with XID preceding the horizon are present in logged sub-indexes.
  */
+static TransactionId
+lsm3_get_recovery_horizon(Relation index)
+{
+	List* items = lsm3_state_get(index, LSM3_STATE_RECOVERY_HORIZON);
+	TransactionId horizon = items != NIL ? (TransactionId)((Lsm3StateItem*)linitial(items))->value : InvalidTransactionId;
+	list_free_deep(items);
+	return horizon;
+}
 
-static IndexBuildResult *
-lsm3_build(Relation heap, Relation index, IndexInfo *indexInfo)
+static void
+lsm3_set_recovery_horizon(Oid base, TransactionId horizon)
 {
-	bool found;
-	Lsm3DictEntry* entry;
-	LWLockAcquire(Lsm3DictLock, LW_EXCLUSIVE);
-	elog(LOG, "lsm3_build %s", index->rd_rel->relname.data);
-	entry = hash_search(Lsm3Dict, &RelationGetRelid(index), HASH_ENTER, &found); /* Setting Lsm3Entry indicates to utility hook that Lsm3 index was created */
-	if (!found)
-	{
-		lsm3_init_entry(entry, index);
-	}
+	Relation index = index_open(base, AccessShareLock);
+	lsm3_state_remove(index, LSM3_STATE_RECOVERY_HORIZON, InvalidOid);
+	lsm3_state_add(index, LSM3_STATE_RECOVERY_HORIZON, InvalidOid, horizon);
+	index_close(index, AccessShareLock);
+}
+
+/*
+ * Position of chunked merge (block number of the next leaf page of merged index, see lsm3_merge_chunks) is stored
+ * in state of merged index together with relfilenode of its storage, so that position is ignored after
+ * the index is switched to other storage (by recycling, TRUNCATE or REINDEX). P_NONE means that merge is not in progress.
+ */
+static void
+lsm3_set_merge_position(Relation index, BlockNumber position)
+{
+	lsm3_state_remove(index, LSM3_STATE_MERGE_POSITION, InvalidOid);
+	if (position != P_NONE)
+		lsm3_state_add(index, LSM3_STATE_MERGE_POSITION, index->rd_rel->relfilenode, position);
+}
+
+static BlockNumber
+lsm3_get_merge_position(Oid index_oid)
+{
+	Relation index = index_open(index_oid, AccessShareLock);
+	List* items = lsm3_state_get(index, LSM3_STATE_MERGE_POSITION);
+	BlockNumber position = P_NONE;
+	ListCell* cell;
+
+	foreach (cell, items)
+	{
+		Lsm3StateItem* item = (Lsm3StateItem*)lfirst(cell);
+		if (item->relfilenode == index->rd_rel->relfilenode)
+			position = (BlockNumber)item->value;
+	}
+	list_free_deep(items);
+	index_close(index, AccessShareLock);
+	return position;
+}
+
+/* Lookup or create Lsm3 control data for this index in shared hash table */
+static Lsm3DictEntry*
+lsm3_get_shared_entry(Relation index)
+{
+	Lsm3DictEntry* entry;
+	bool found;
+	bool schedule_merge = false;
+	char* relname = RelationGetRelationName(index);
+	Oid  sub_index[LSM3_MAX_SUB_INDEXES];
+	BlockNumber size[LSM3_MAX_SUB_INDEXES];
+	BlockNumber position[LSM3_MAX_SUB_INDEXES];
+	int n_levels = 0;
+	TransactionId horizon;
+	bool equal_image;
+
+	LWLockAcquire(Lsm3DictLock, LW_SHARED);
+	entry = (Lsm3DictEntry*)hash_search(Lsm3Dict, &RelationGetRelid(index), HASH_FIND, NULL);
+	LWLockRelease(Lsm3DictLock);
+	if (entry != NULL)
+		return entry;
+
+	/* Catalog and state of the index are inspected without holding LWLock */
+	for (int i = 0; i < 2; i++)
+	{
+		char* topidxname = psprintf("%s_top%d", relname, i);
+		sub_index[i] = get_relname_relid(topidxname, RelationGetNamespace(index));
+		if (sub_index[i] == InvalidOid)
+		{
+			elog(ERROR, "Lsm3: failed to lookup %s index", topidxname);
+		}
+	}
+	/* Number of levels is determined by existed level indexes rather than by index option */
+	while (n_levels < LSM3_MAX_LEVELS)
+	{
+		char* levelidxname = psprintf("%s_level%d", relname, n_levels);
+		Oid level = get_relname_relid(levelidxname, RelationGetNamespace(index));
+		if (level == InvalidOid)
+			break;
+		sub_index[2 + n_levels++] = level;
+	}
+	for (int i = 0; i < n_levels + 2; i++)
+	{
+		size[i] = lsm3_get_index_size(sub_index[i]);
+		position[i] = lsm3_get_merge_position(sub_index[i]);
+	}
+	horizon = lsm3_get_recovery_horizon(index);
+	equal_image = _bt_allequalimage(index, false);
+
+	/* We need exclusive lock to create new entry */
+	LWLockAcquire(Lsm3DictLock, LW_EXCLUSIVE);
+	entry = (Lsm3DictEntry*)hash_search(Lsm3Dict, &RelationGetRelid(index), HASH_ENTER, &found);
+	if (!found)
+	{
+		lsm3_init_entry(entry, index, horizon, equal_image);
+		entry->top[0] = sub_index[0];
+		entry->top[1] = sub_index[1];
+		entry->n_levels = n_levels;
+		for (int i = 0; i < n_levels; i++)
+		{
+			entry->level[i] = sub_index[2 + i];
+			pg_atomic_write_u32(&entry->level_pages[i], size[2 + i]);
+		}
+		entry->active_index = size[0] >= size[1] ? 0 : 1;
+		/* Size of tuples in existed top indexes is unknown: estimate it by size of index */
+		for (int i = 0; i < 2; i++)
+			pg_atomic_write_u64(&entry->top_bytes[i], size[i] > 1 ? (uint64)size[i]*BLCKSZ : 0);
+		/* Bloom filter of empty sub-index (having only metapage) is valid */
+		for (int i = 0; i < n_levels + 2; i++)
+		{
+			bool empty = size[i] <= 1;
+			entry->bloom_valid[i] = empty;
+			if (i >= 2 && !empty)
+				entry->nonempty_levels |= 1 << (i - 2);
+		}
+		/* Resume chunked merge interrupted by shutdown or crash */
+		for (int i = 0; i < n_levels + 2; i++)
+		{
+			if (position[i] == P_NONE)
+				continue;
+			if (i >= 2)
+				entry->resume_level = i; /* merged before the next merge of top index */
+			else
+			{
+				entry->active_index = 1 - i;
+				entry->merge_in_progress = true;
+				entry->start_merge = true;
+				entry->n_merges += 1;
+				entry->merge_request_seq = pg_atomic_read_u64(&Lsm3Pool->n_merges);
+				schedule_merge = true;
+			}
+		}
+	}
+	LWLockRelease(Lsm3DictLock);
+	if (schedule_merge && !RecoveryInProgress())
+		lsm3_schedule_merge(entry->db_id);
+	return entry;
+}
+
+/*
+ * Close top indexes opened by inserts in this transaction.
+ * On abort references are released by resource owner, so we should just forget them.
+ */
+static void
+lsm3_close_tops(bool release)
+{
+	HASH_SEQ_STATUS status;
+	Lsm3LocalEntry* local;
+
+	if (!Lsm3TopsOpened)
+		return;
+
+	hash_seq_init(&status, Lsm3LocalDict);
+	while ((local = (Lsm3LocalEntry*)hash_seq_search(&status)) != NULL)
+	{
+		for (int i = 0; i < 2; i++)
+		{
+			if (local->top[i])
+			{
+				if (release)
+				{
+					ResourceOwner save_owner = CurrentResourceOwner;
+					CurrentResourceOwner = TopTransactionResourceOwner;
+					RelationClose(local->top[i]);
+					CurrentResourceOwner = save_owner;
+				}
+				local->top[i] = NULL;
+			}
+		}
+	}
+	Lsm3TopsOpened = false;
+}
+
+static void
+lsm3_xact_callback(XactEvent event, void *arg)
+{
+	switch (event)
+	{
+		case XACT_EVENT_PRE_COMMIT:
+		case XACT_EVENT_PARALLEL_PRE_COMMIT:
+		case XACT_EVENT_PRE_PREPARE:
+			lsm3_flush_buffers();
+			lsm3_close_tops(true);
+			break;
+		case XACT_EVENT_ABORT:
+		case XACT_EVENT_PARALLEL_ABORT:
+			lsm3_discard_buffers();
+			lsm3_close_tops(false);
+			break;
+		default:
+			break;
+	}
+}
+
+/*
+ * Insert buffer holds only tuples of the current subtransaction: it is flushed when subtransaction is started
+ * and discarded when it is aborted. Otherwise tuples of rolled back subtransaction would be inserted in top index
+ * after their heap tuples may be pruned and line pointers reused by other tuples.
+ */
+static void
+lsm3_subxact_callback(SubXactEvent event, SubTransactionId mySubid, SubTransactionId parentSubid, void *arg)
+{
+	switch (event)
+	{
+		case SUBXACT_EVENT_START_SUB:
+			lsm3_flush_buffers();
+			break;
+		case SUBXACT_EVENT_ABORT_SUB:
+			lsm3_discard_buffers();
+			break;
+		default:
+			break;
+	}
+}
+
+/* Forget cached pointer to shared entry when index is altered or dropped */
+static void
+lsm3_relcache_callback(Datum arg, Oid relid)
+{
+	HASH_SEQ_STATUS status;
+	Lsm3LocalEntry* local;
+
+	if (OidIsValid(relid))
+	{
+		local = (Lsm3LocalEntry*)hash_search(Lsm3LocalDict, &relid, HASH_FIND, NULL);
+		if (local)
+			local->entry = NULL;
+	}
+	else
+	{
+		hash_seq_init(&status, Lsm3LocalDict);
+		while ((local = (Lsm3LocalEntry*)hash_seq_search(&status)) != NULL)
+			local->entry = NULL;
+	}
+}
+
+/* Lookup Lsm3 control data for this index in backend-local cache */
+static Lsm3LocalEntry*
+lsm3_get_local_entry(Relation index)
+{
+	Lsm3LocalEntry* local;
+	bool found;
+
+	if (Lsm3LocalDict == NULL)
+	{
+		HASHCTL info;
+		memset(&info, 0, sizeof(info));
+		info.keysize = sizeof(Oid);
+		info.entrysize = sizeof(Lsm3LocalEntry);
+		info.hcxt = TopMemoryContext;
+		Lsm3LocalDict = hash_create("lsm3 local hash", 64, &info, HASH_ELEM | HASH_BLOBS | HASH_CONTEXT);
+		CacheRegisterRelcacheCallback(lsm3_relcache_callback, (Datum)0);
+		RegisterXactCallback(lsm3_xact_callback, NULL);
+		RegisterSubXactCallback(lsm3_subxact_callback, NULL);
+	}
+	local = (Lsm3LocalEntry*)hash_search(Lsm3LocalDict, &RelationGetRelid(index), HASH_ENTER, &found);
+	if (!found)
+	{
+		local->entry = NULL;
+		local->top[0] = local->top[1] = NULL;
+		local->recycle_generation = 0;
+		local->buffer_cxt = NULL;
+		local->buffer = NULL;
+		local->buffer_used = 0;
+		local->buffer_allocated = 0;
+		local->buffer_size = 0;
+	}
+	if (local->entry == NULL)
+		local->entry = lsm3_get_shared_entry(index);
+	if (local->entry->recovery_pending)
+		lsm3_recover_tops(local->entry, index);
+	return local;
+}
+
+/* Lookup or create Lsm3 control data for this index */
+static Lsm3DictEntry*
+lsm3_get_entry(Relation index)
+{
+	return lsm3_get_local_entry(index)->entry;
+}
+
+/*
+ * Merge switches recycled sub-index to new storage without exclusive lock (see lsm3_recycle_index),
+ * so relcache entries of sub-indexes locked by this transaction may refer to old storage.
+ * Invalidation messages are accepted before inserting in or scanning sub-indexes if some of them was recycled since last check.
+ * At standby recycling is replayed from WAL and is not tracked by shared entry, so invalidation messages are always accepted.
+ */
+static void
+lsm3_accept_recycle(Lsm3LocalEntry* local)
+{
+	uint64 generation = pg_atomic_read_u64(&local->entry->recycle_generation);
+	if (RecoveryInProgress())
+		AcceptInvalidationMessages();
+	else if (local->recycle_generation != generation)
+	{
+		AcceptInvalidationMessages();
+		local->recycle_generation = generation;
+	}
+}
+
+/* Get top index opened till the end of transaction */
+static Relation
+lsm3_get_top(Lsm3LocalEntry* local, int i)
+{
+	lsm3_accept_recycle(local);
+	if (local->top[i] == NULL)
+	{
+		ResourceOwner save_owner = CurrentResourceOwner;
+		CurrentResourceOwner = TopTransactionResourceOwner;
+		local->top[i] = RelationIdGetRelation(local->entry->top[i]);
+		CurrentResourceOwner = save_owner;
+		if (!RelationIsValid(local->top[i]))
+			elog(ERROR, "Lsm3: could not open top index %u", local->entry->top[i]);
+		Lsm3TopsOpened = true;
+	}
+	return local->top[i];
+}
+
+/*
+ * Assign slot of merge pool to the database before launch of merge worker. Should be called under pool spinlock.
+ * Returns generation of the slot which identifies the launched worker.
+ */
+static uint32
+lsm3_assign_slot(Lsm3MergerSlot* slot, Oid db_id, TimestampTz now)
+{
+	slot->in_use = true;
+	slot->db_id = db_id;
+	slot->proc = NULL;
+	slot->base = InvalidOid;
+	slot->launched = now;
+	return ++slot->generation;
+}
+
+/* Worker launched for the slot has not started during LSM3_MERGER_START_TIMEOUT. Should be called under pool spinlock. */
+static bool
+lsm3_slot_start_failed(Lsm3MergerSlot* slot, TimestampTz now)
+{
+	return slot->in_use && slot->proc == NULL && TimestampDifferenceExceeds(slot->launched, now, LSM3_MERGER_START_TIMEOUT);
+}
+
+/*
+ * Launch merge worker for the slot of merge pool assigned to the database.
+ * Backend does not wait for worker startup: if worker can not be registered, then slot is released,
+ * and if registered worker is not started, then slot is reused by lsm3_schedule_merge after LSM3_MERGER_START_TIMEOUT.
+ */
+static bool
+lsm3_launch_merger(int slot_no, Oid db_id, uint32 generation)
+{
+	BackgroundWorker worker;
+	BackgroundWorkerHandle *handle;
+
+	MemSet(&worker, 0, sizeof(worker));
+	snprintf(worker.bgw_name, sizeof(worker.bgw_name), "lsm3-merger-%d", slot_no);
+	snprintf(worker.bgw_type, sizeof(worker.bgw_type), "lsm3-merger");
+	worker.bgw_flags = BGWORKER_SHMEM_ACCESS | BGWORKER_BACKEND_DATABASE_CONNECTION;
+	worker.bgw_start_time = BgWorkerStart_ConsistentState;
+	worker.bgw_restart_time = BGW_NEVER_RESTART;
+	strcpy(worker.bgw_function_name, "lsm3_merger_main");
+	strcpy(worker.bgw_library_name, "lsm3");
+	worker.bgw_main_arg = Int32GetDatum(slot_no);
+	memcpy(worker.bgw_extra, &generation, sizeof(generation));
+	worker.bgw_notify_pid = 0;
+
+	if (!RegisterDynamicBackgroundWorker(&worker, &handle))
+	{
+		Lsm3MergerSlot* slot = &Lsm3Pool->slots[slot_no];
+		SpinLockAcquire(&Lsm3Pool->spinlock);
+		if (slot->in_use && slot->proc == NULL && slot->generation == generation)
+			slot->in_use = false;
+		SpinLockRelease(&Lsm3Pool->spinlock);
+		elog(WARNING, "Lsm3: failed to start merge worker");
+		return false;
+	}
+	return true;
+}
+
+/*
+ * Notify merge pool about merge request in the database: wake up idle worker serving this database
+ * or launch new worker if there is free slot. If all slots are used by other databases,
+ * then their idle workers are woken up to pass slot to this database.
+ */
+static void
+lsm3_schedule_merge(Oid db_id)
+{
+	PGPROC** idle = (PGPROC**)palloc(Lsm3MaxMergeWorkers*sizeof(PGPROC*));
+	int n_idle = 0;
+	PGPROC* target = NULL;
+	bool served = false;
+	bool starting = false;
+	int free_slot = -1;
+	uint32 generation = 0;
+	TimestampTz now = GetCurrentTimestamp();
+
+	SpinLockAcquire(&Lsm3Pool->spinlock);
+	for (int i = 0; i < Lsm3MaxMergeWorkers; i++)
+	{
+		Lsm3MergerSlot* slot = &Lsm3Pool->slots[i];
+		if (lsm3_slot_start_failed(slot, now))
+			slot->in_use = false; /* worker was not started */
+		if (!slot->in_use)
+		{
+			if (free_slot < 0)
+				free_slot = i;
+		}
+		else if (slot->db_id == db_id)
+		{
+			served = true;
+			if (slot->proc == NULL)
+				starting = true; /* started worker will check pending requests itself */
+			else if (slot->base == InvalidOid)
+				target = slot->proc;
+		}
+		else if (slot->proc != NULL && slot->base == InvalidOid)
+		{
+			idle[n_idle++] = slot->proc;
+		}
+	}
+	if (target == NULL && !starting && free_slot >= 0)
+		generation = lsm3_assign_slot(&Lsm3Pool->slots[free_slot], db_id, now);
+	else
+		free_slot = -1;
+	SpinLockRelease(&Lsm3Pool->spinlock);
+
+	if (target != NULL)
+		SetLatch(&target->procLatch);
+	else if (free_slot >= 0)
+		lsm3_launch_merger(free_slot, db_id, generation);
+	else if (!served)
+	{
+		for (int i = 0; i < n_idle; i++)
+			SetLatch(&idle[i]->procLatch);
+	}
+	pfree(idle);
+}
+
+/* Cancel merger bgwroker */
+static void
+lsm3_merge_cancel(int sig)
+{
+	Lsm3Cancel = true;
+	SetLatch(MyLatch);
+}
+
+/*
+ * Switch just created top index to new unlogged storage (unlogged_tops option).
+ * Init fork of the index is created by index_build.
+ */
+static void
+lsm3_set_unlogged(Oid index_oid, Oid heap_oid)
+{
+	Relation heap = table_open(heap_oid, AccessShareLock);
+	Relation index;
+	Relation pg_class;
+	HeapTuple tuple;
+
+	/* Recovery of top indexes scans heap pages */
+	if (heap->rd_rel->relam != HEAP_TABLE_AM_OID)
+		elog(ERROR, "Lsm3: unlogged_tops option is supported only for heap tables");
+
+	pg_class = table_open(RelationRelationId, RowExclusiveLock);
+	tuple = SearchSysCacheCopy1(RELOID, ObjectIdGetDatum(index_oid));
+	if (!HeapTupleIsValid(tuple))
+		elog(ERROR, "Lsm3: could not find tuple for relation %u", index_oid);
+	((Form_pg_class) GETSTRUCT(tuple))->relpersistence = RELPERSISTENCE_UNLOGGED;
+	CatalogTupleUpdate(pg_class, &tuple->t_self, tuple);
+	heap_freetuple(tuple);
+	table_close(pg_class, RowExclusiveLock);
+	CommandCounterIncrement();
+
+	index = index_open(index_oid, AccessExclusiveLock);
+#if PG_VERSION_NUM>=160000
+	RelationSetNewRelfilenumber(index, RELPERSISTENCE_UNLOGGED);
+#else
+	RelationSetNewRelfilenode(index, RELPERSISTENCE_UNLOGGED);
+#endif
+	index_build(heap, index, BuildDummyIndexInfo(index), true, false);
+	index_close(index, AccessExclusiveLock);
+	table_close(heap, AccessShareLock);
+}
+
+#if PG_VERSION_NUM>=140000
+#define INSERT_FLAGS UNIQUE_CHECK_NO, false
+#else
+#define INSERT_FLAGS false
+#endif
+
+#if PG_VERSION_NUM>=150000
+#define LSM3_MQ_SEND(mqh, len, data) shm_mq_send(mqh, len, data, false, false)
+#else
+#define LSM3_MQ_SEND(mqh, len, data) shm_mq_send(mqh, len, data, false)
+#endif
+
+/*
+ * Parallel merge.
+ * Top index is split into ranges of values of the first key column using separator keys of its root page.
+ * Parallel workers claim ranges one by one, read live tuples of the range from top index (checking their
+ * visibility in heap and prefetching pages of destination index) and send them to the leader through
+ * per-worker message queues. Index is not updated in parallel workers: leader inserts received tuples
+ * in destination index. Range following the last one contains NULLs of the first key column.
+ */
+#define LSM3_MERGE_RANGES_PER_PARTICIPANT 4
+#define LSM3_MERGE_QUEUE_SIZE 65536
+#define LSM3_PARALLEL_MERGE_KEY UINT64CONST(0xA5D3000000000001)
+#define LSM3_PARALLEL_MERGE_QUEUE_KEY UINT64CONST(0xA5D3000000000002)
+
+typedef struct
+{
+	Oid dst_oid;  /* Destination index */
+	Oid src_oid;  /* Merged index */
+	Oid heap_oid; /* Indexed relation */
+	int n_splits; /* Number of split values (number of ranges is n_splits+2) */
+	pg_atomic_uint32 next_range; /* Next range to be merged */
+	pg_atomic_uint64 n_merged;   /* Number of tuples inserted by all participants */
+	pg_atomic_uint64 n_dropped;  /* Number of dead tuples skipped by all participants */
+	pg_atomic_uint64 n_bytes;    /* Total size of tuples inserted by all participants */
+	/* followed by serialized split values */
+} Lsm3ParallelMergeData;
+
+/*
+ * Garbage-collecting merge.
+ * Tuples of merged sub-index are read in key order by batches of LSM3_MERGE_BATCH_SIZE tuples.
+ * Heap TIDs of the batch are checked in heap block order against global xmin horizon, and entries
+ * which are dead for all transactions (including entries inserted by aborted transactions) are not
+ * propagated to the next level. Remaining tuples of the batch are returned in key order.
+ */
+typedef struct
+{
+	IndexScanDesc scan;    /* Scan of merged index with SnapshotAny (NULL if index is read by leaf pages) */
+	Relation index;        /* Merged index */
+	BlockNumber next_block; /* Next leaf page to be read when scan is not used (P_NONE at the end of index) */
+	bool     started;      /* Scan is positioned by _bt_first */
+	bool     eof;          /* Merged index is exhausted */
+	IndexFetchTableData* fetch; /* Heap access used to check visibility of entries (NULL if GC is disabled) */
+	TupleTableSlot* slot;  /* Slot for fetched heap tuples */
+	SnapshotData snapshot; /* Non-vacuumable snapshot */
+	MemoryContext batch_cxt; /* Memory context for tuples of current batch */
+	int      n_batch;      /* Number of tuples in current batch */
+	int      pos;          /* Position of next returned tuple in current batch */
+	uint64   n_dropped;    /* Number of dropped dead tuples */
+	IndexTuple batch[LSM3_MERGE_BATCH_SIZE]; /* Tuples of current batch in key order */
+	int      order[LSM3_MERGE_BATCH_SIZE];   /* Positions of batch tuples in heap TID order */
+} Lsm3MergeReader;
+
+typedef struct
+{
+	uint64 n_merged;  /* Number of tuples inserted in destination index */
+	uint64 n_dropped; /* Number of dead tuples skipped */
+	uint64 n_bytes;   /* Total size of tuples written to destination index */
+} Lsm3MergeStat;
+
+/* Space occupied by index tuple in B-Tree page (as accounted by lsm3_index_tuple_size) */
+#define LSM3_STORED_TUPLE_SIZE(itup) (MAXALIGN(IndexTupleSize(itup)) + sizeof(ItemIdData))
+
+static Lsm3MergeReader*
+lsm3_merge_reader_create(Relation index, Relation heap)
+{
+	Lsm3MergeReader* reader = (Lsm3MergeReader*)palloc0(sizeof(Lsm3MergeReader));
+
+	reader->index = index;
+	if (Lsm3MergeGC)
+	{
+#if PG_VERSION_NUM>=140000
+		InitNonVacuumableSnapshot(reader->snapshot, GlobalVisTestFor(heap));
+#else
+		InitNonVacuumableSnapshot(reader->snapshot, GetOldestXmin(heap, PROCARRAY_FLAGS_VACUUM));
+#endif
+		reader->fetch = table_index_fetch_begin(heap);
+		reader->slot = table_slot_create(heap, NULL);
+	}
+	reader->batch_cxt = AllocSetContextCreate(CurrentMemoryContext, "lsm3 merge batch", ALLOCSET_DEFAULT_SIZES);
+	return reader;
+}
+
+/* Read tuples of merged index matching scan keys */
+static Lsm3MergeReader*
+lsm3_merge_reader_begin(Relation index, Relation heap, ScanKey keys, int nkeys)
+{
+	Lsm3MergeReader* reader = lsm3_merge_reader_create(index, heap);
+
+	reader->scan = index_beginscan(heap, index, SnapshotAny, nkeys, 0);
+	reader->scan->xs_want_itup = true;
+	btrescan(reader->scan, keys, nkeys, 0, 0);
+	return reader;
+}
+
+/*
+ * Read merged index leaf page by leaf page starting from the specified one.
+ * Each batch contains tuples of one page, so that position of the reader can be saved as block number of the next page.
+ */
+static Lsm3MergeReader*
+lsm3_merge_reader_begin_pages(Relation index, Relation heap, BlockNumber blkno)
+{
+	Lsm3MergeReader* reader = lsm3_merge_reader_create(index, heap);
+
+	reader->next_block = blkno;
+	reader->eof = blkno == P_NONE;
+	return reader;
+}
+
+static int
+lsm3_compare_batch_tids(const void* a, const void* b, void* arg)
+{
+	IndexTuple* batch = (IndexTuple*)arg;
+	return ItemPointerCompare(&batch[*(int const*)a]->t_tid, &batch[*(int const*)b]->t_tid);
+}
+
+/*
+ * Load tuples of the next leaf page of merged index into the batch (posting lists are expanded).
+ * Merged index is not concurrently updated, so it is enough to inspect a copy of the page.
+ */
+static int
+lsm3_merge_reader_load_page(Lsm3MergeReader* reader)
+{
+	Page page = lsm3_read_page(reader->index, reader->next_block);
+	BTPageOpaque opaque = (BTPageOpaque) PageGetSpecialPointer(page);
+	OffsetNumber maxoff = PageGetMaxOffsetNumber(page);
+	MemoryContext old_cxt = MemoryContextSwitchTo(reader->batch_cxt);
+	int n = 0;
+
+	StaticAssertStmt(MaxTIDsPerBTreePage <= LSM3_MERGE_BATCH_SIZE, "leaf page doesn't fit in merge batch");
+	if (!P_IGNORE(opaque))
+	{
+		for (OffsetNumber off = P_FIRSTDATAKEY(opaque); off <= maxoff; off++)
+		{
+			ItemId lp = PageGetItemId(page, off);
+			IndexTuple itup = (IndexTuple) PageGetItem(page, lp);
+
+			if (ItemIdIsDead(lp))
+				continue;
+			if (BTreeTupleIsPosting(itup))
+			{
+				for (int i = 0; i < BTreeTupleGetNPosting(itup); i++)
+					reader->batch[n++] = _bt_form_posting(itup, BTreeTupleGetPostingN(itup, i), 1);
+			}
+			else
+				reader->batch[n++] = CopyIndexTuple(itup);
+		}
+	}
+	MemoryContextSwitchTo(old_cxt);
+	reader->next_block = opaque->btpo_next;
+	reader->eof = reader->next_block == P_NONE;
+	pfree(page);
+	return n;
+}
+
+/* Read next batch of merged index tuples and remove dead entries from it */
+static void
+lsm3_merge_reader_fill(Lsm3MergeReader* reader)
+{
+	IndexScanDesc scan = reader->scan;
+	int n = 0;
+
+	MemoryContextReset(reader->batch_cxt);
+	if (scan == NULL)
+		n = lsm3_merge_reader_load_page(reader);
+	while (scan != NULL && n < LSM3_MERGE_BATCH_SIZE && !reader->eof)
+	{
+		bool ok = reader->started ? _bt_next(scan, ForwardScanDirection) : _bt_first(scan, ForwardScanDirection);
+		reader->started = true;
+		if (ok)
+		{
+			MemoryContext old_cxt = MemoryContextSwitchTo(reader->batch_cxt);
+			reader->batch[n++] = lsm3_copy_scan_tuple(scan);
+			MemoryContextSwitchTo(old_cxt);
+		}
+		else
+			reader->eof = true;
+	}
+	if (reader->fetch != NULL && n != 0)
+	{
+		int n_live = 0;
+
+		CHECK_FOR_INTERRUPTS();
+
+		/* Visit heap in block order: each heap page is read once per batch */
+		for (int i = 0; i < n; i++)
+			reader->order[i] = i;
+		qsort_arg(reader->order, n, sizeof(int), lsm3_compare_batch_tids, reader->batch);
+
+		for (int i = 0; i < n; i++)
+		{
+			int pos = reader->order[i];
+			ItemPointerData tid = reader->batch[pos]->t_tid; /* updated by HOT chain traversal */
+			bool call_again = false;
+			bool all_dead = false;
+			if (!table_index_fetch_tuple(reader->fetch, &tid, &reader->snapshot, reader->slot, &call_again, &all_dead))
+				reader->batch[pos] = NULL; /* no member of HOT chain can be visible to any transaction */
+		}
+		ExecClearTuple(reader->slot);
+
+		for (int i = 0; i < n; i++)
+		{
+			if (reader->batch[i] != NULL)
+				reader->batch[n_live++] = reader->batch[i];
+		}
+		reader->n_dropped += n - n_live;
+		n = n_live;
+	}
+	reader->n_batch = n;
+	reader->pos = 0;
+}
+
+/* Get next live tuple of merged index in key order or NULL at the end of index */
+static IndexTuple
+lsm3_merge_reader_next(Lsm3MergeReader* reader)
+{
+	while (reader->pos == reader->n_batch)
+	{
+		if (reader->eof)
+			return NULL;
+		lsm3_merge_reader_fill(reader);
+	}
+	return reader->batch[reader->pos++];
+}
+
+static void
+lsm3_merge_reader_end(Lsm3MergeReader* reader)
+{
+	if (reader->scan != NULL)
+		index_endscan(reader->scan);
+	if (reader->fetch != NULL)
+	{
+		ExecDropSingleTupleTableSlot(reader->slot);
+		table_index_fetch_end(reader->fetch);
+	}
+	MemoryContextDelete(reader->batch_cxt);
+	pfree(reader);
+}
+
+/* Get copy of index page */
+static Page
+lsm3_read_page(Relation index, BlockNumber blkno)
+{
+	Buffer buf = ReadBuffer(index, blkno);
+	Page   page = (Page) palloc(BLCKSZ);
+
+	LockBuffer(buf, BUFFER_LOCK_SHARE);
+	memcpy(page, BufferGetPage(buf), BLCKSZ);
+	UnlockReleaseBuffer(buf);
+	return page;
+}
+
+/*
+ * Prefetch of destination leaf pages.
+ * Merged tuples are inserted in key order, so the next tuples of reader batch will be inserted in leaf pages
+ * which are children of the same or next level 1 pages. Copy of current level 1 page is used to locate leaf pages
+ * of lsm3.merge_prefetch_distance next tuples and prefetch them, so that inserts do not wait for random reads.
+ * Location is approximate (splits performed after level 1 page was copied are not taken in account),
+ * but it affects only efficiency of prefetch.
+ */
+typedef struct
+{
+	Relation    index;      /* destination index */
+	int         pos;        /* position in reader batch of next tuple to be prefetched */
+	Page        parent;     /* copy of level 1 page containing downlinks for prefetched tuples (NULL if not loaded) */
+	BlockNumber last_block; /* last prefetched leaf page */
+} Lsm3Prefetch;
+
+/* Find child page of internal page for the specified key */
+static BlockNumber
+lsm3_find_child(Relation index, BTScanInsert key, Page page)
+{
+	BTPageOpaque opaque = (BTPageOpaque) PageGetSpecialPointer(page);
+	OffsetNumber low = P_FIRSTDATAKEY(opaque);
+	OffsetNumber high = PageGetMaxOffsetNumber(page);
+
+	/* Locate last pivot less or equal than key (first data item is "minus infinity") */
+	while (low < high)
+	{
+		OffsetNumber mid = low + (high - low + 1) / 2;
+		if (_bt_compare(index, key, page, mid) >= 0)
+			low = mid;
+		else
+			high = mid - 1;
+	}
+	return BTreeTupleGetDownLink((IndexTuple) PageGetItem(page, PageGetItemId(page, low)));
+}
+
+/* Descend from root to level 1 page covering the key. Returns false if index has no internal pages. */
+static bool
+lsm3_prefetch_load_parent(Lsm3Prefetch* prefetch, BTScanInsert key)
+{
+	Page        page = lsm3_read_page(prefetch->index, BTREE_METAPAGE);
+	BlockNumber blkno = BTPageGetMeta(page)->btm_fastroot;
+	uint32      level = BTPageGetMeta(page)->btm_fastlevel;
+
+	pfree(page);
+	if (blkno == P_NONE || level == 0)
+		return false;
+
+	while (true)
+	{
+		page = lsm3_read_page(prefetch->index, blkno);
+		if (P_IGNORE((BTPageOpaque) PageGetSpecialPointer(page)))
+		{
+			pfree(page); /* concurrently deleted page: just skip prefetch */
+			return false;
+		}
+		if (--level == 0)
+			break;
+		blkno = lsm3_find_child(prefetch->index, key, page);
+		pfree(page);
+	}
+	prefetch->parent = page;
+	return true;
+}
+
+/* Prefetch leaf pages for the tuples following the current tuple of the reader */
+static void
+lsm3_merge_prefetch(Lsm3Prefetch* prefetch, Lsm3MergeReader* reader)
+{
+	int end = Min(reader->pos + Lsm3MergePrefetchDistance, reader->n_batch);
+
+	if (reader->pos == 1)
+	{
+		/* New batch is loaded */
+		prefetch->pos = reader->pos;
+		if (prefetch->parent)
+		{
+			pfree(prefetch->parent);
+			prefetch->parent = NULL;
+		}
+	}
+	for (; prefetch->pos < end; prefetch->pos++)
+	{
+		BTScanInsert key = _bt_mkscankey(prefetch->index, reader->batch[prefetch->pos]);
+		BlockNumber  blkno;
+
+		if (prefetch->parent != NULL
+			&& !P_RIGHTMOST((BTPageOpaque) PageGetSpecialPointer(prefetch->parent))
+			&& _bt_compare(prefetch->index, key, prefetch->parent, P_HIKEY) >= 0)
+		{
+			/* Key is beyond the range of the copied level 1 page */
+			pfree(prefetch->parent);
+			prefetch->parent = NULL;
+		}
+		if (prefetch->parent != NULL || lsm3_prefetch_load_parent(prefetch, key))
+		{
+			blkno = lsm3_find_child(prefetch->index, key, prefetch->parent);
+			if (blkno != prefetch->last_block)
+			{
+				(void) PrefetchBuffer(prefetch->index, MAIN_FORKNUM, blkno);
+				prefetch->last_block = blkno;
+			}
+		}
+		pfree(key);
+	}
+}
+
+/*
+ * Insert live tuples of top index matching scan keys into base index.
+ * Parallel worker sends them to the leader through the queue instead of inserting.
+ */
+static void
+lsm3_merge_range(Relation top_index, Relation base_index, Relation heap, ScanKey keys, int nkeys, Lsm3MergeStat* stat, shm_mq_handle* queue)
+{
+	Lsm3MergeReader* reader = lsm3_merge_reader_begin(top_index, heap, keys, nkeys);
+	Lsm3Prefetch prefetch = {base_index, 0, NULL, InvalidBlockNumber};
+	IndexTuple itup;
+
+	while ((itup = lsm3_merge_reader_next(reader)) != NULL)
+	{
+		if (Lsm3MergePrefetchDistance != 0)
+			lsm3_merge_prefetch(&prefetch, reader);
+		if (queue)
+		{
+			if (LSM3_MQ_SEND(queue, IndexTupleSize(itup), itup) != SHM_MQ_SUCCESS)
+				elog(ERROR, "Lsm3: leader of parallel merge is detached");
+		}
+		else
+		{
+			_bt_doinsert(base_index, itup, INSERT_FLAGS, heap); /* lsm3 index is not unique so need not to heck for duplicates */
+		}
+		stat->n_merged += 1;
+		stat->n_bytes += LSM3_STORED_TUPLE_SIZE(itup);
+	}
+	stat->n_dropped += reader->n_dropped;
+	lsm3_merge_reader_end(reader);
+	if (prefetch.parent)
+		pfree(prefetch.parent);
+}
+
+/* Initialize scan key for the first key column of the index */
+static void
+lsm3_init_range_key(Relation index, ScanKey key, StrategyNumber strategy, Datum value)
+{
+	Oid opr = get_opfamily_member(index->rd_opfamily[0], index->rd_opcintype[0], index->rd_opcintype[0], strategy);
+	if (!OidIsValid(opr))
+		elog(ERROR, "Lsm3: missing operator %d for index %s", strategy, RelationGetRelationName(index));
+	ScanKeyEntryInitialize(key, 0, 1, strategy, InvalidOid, index->rd_indcollation[0], get_opcode(opr), value);
+}
+
+/* Read ranges of top index until all of them are claimed by parallel workers */
+static void
+lsm3_merge_ranges(Lsm3ParallelMergeData* shared, Datum* splits, Relation top_index, Relation base_index, Relation heap, shm_mq_handle* queue)
+{
+	int n_splits = shared->n_splits;
+	int range;
+	Lsm3MergeStat stat = {0, 0, 0};
+
+	while ((range = (int)pg_atomic_fetch_add_u32(&shared->next_range, 1)) < n_splits + 2)
+	{
+		ScanKeyData keys[2];
+		int nkeys = 0;
+		if (range == n_splits + 1)
+		{
+			ScanKeyEntryInitialize(&keys[nkeys++], SK_ISNULL | SK_SEARCHNULL, 1, InvalidStrategy,
+								   InvalidOid, top_index->rd_indcollation[0], InvalidOid, (Datum)0);
+		}
+		else
+		{
+			if (range > 0)
+				lsm3_init_range_key(top_index, &keys[nkeys++], BTGreaterEqualStrategyNumber, splits[range-1]);
+			if (range < n_splits)
+				lsm3_init_range_key(top_index, &keys[nkeys++], BTLessStrategyNumber, splits[range]);
+		}
+		lsm3_merge_range(top_index, base_index, heap, keys, nkeys, &stat, queue);
+	}
+	pg_atomic_fetch_add_u64(&shared->n_merged, stat.n_merged);
+	pg_atomic_fetch_add_u64(&shared->n_dropped, stat.n_dropped);
+	pg_atomic_fetch_add_u64(&shared->n_bytes, stat.n_bytes);
+}
+
+/*
+ * Choose split values for parallel merge among separator keys of root page of top index.
+ * Returns number of split values (zero if top index is too small to be split).
+ */
+static int
+lsm3_get_merge_splits(Relation index, int max_ranges, Datum* splits)
+{
+	Buffer buf;
+	Page page;
+	BTMetaPageData* metad;
+	BlockNumber root;
+	uint32 level;
+	TupleDesc desc = RelationGetDescr(index);
+	Form_pg_attribute att = TupleDescAttr(desc, 0);
+	SortSupport sortKeys;
+	Datum* separators;
+	int n_separators = 0;
+	int n_splits = 0;
+	int n_ranges;
+
+	buf = ReadBuffer(index, BTREE_METAPAGE);
+	LockBuffer(buf, BUFFER_LOCK_SHARE);
+	metad = BTPageGetMeta(BufferGetPage(buf));
+	root = metad->btm_fastroot;
+	level = metad->btm_fastlevel;
+	UnlockReleaseBuffer(buf);
+
+	if (root == P_NONE || level == 0)
+		return 0; /* top index has single leaf page */
+
+	buf = ReadBuffer(index, root);
+	LockBuffer(buf, BUFFER_LOCK_SHARE);
+	page = BufferGetPage(buf);
+	{
+		BTPageOpaque opaque = (BTPageOpaque) PageGetSpecialPointer(page);
+		OffsetNumber maxoff = PageGetMaxOffsetNumber(page);
+		separators = (Datum*)palloc(maxoff*sizeof(Datum));
+		for (OffsetNumber off = OffsetNumberNext(P_FIRSTDATAKEY(opaque)); off <= maxoff; off++)
+		{
+			IndexTuple itup = (IndexTuple) PageGetItem(page, PageGetItemId(page, off));
+			bool isnull;
+			Datum value;
+			if (BTreeTupleGetNAtts(itup, index) == 0)
+				continue;
+			value = index_getattr(itup, 1, desc, &isnull);
+			if (!isnull)
+				separators[n_separators++] = datumCopy(value, att->attbyval, att->attlen);
+		}
+	}
+	UnlockReleaseBuffer(buf);
+
+	/* Choose evenly distributed distinct separators */
+	n_ranges = Min(n_separators + 1, max_ranges);
+	sortKeys = lsm3_build_sortkeys(index, false);
+	for (int i = 1; i < n_ranges; i++)
+	{
+		Datum value = separators[(int64)i*n_separators/n_ranges];
+		if (n_splits == 0 || ApplySortComparator(splits[n_splits-1], false, value, false, sortKeys) < 0)
+			splits[n_splits++] = value;
+	}
+	pfree(sortKeys);
+	if (index->rd_indoption[0] & INDOPTION_DESC)
+	{
+		/* Ranges are defined by comparison operators, so split values should be in ascending order */
+		for (int i = 0, j = n_splits - 1; i < j; i++, j--)
+		{
+			Datum tmp = splits[i];
+			splits[i] = splits[j];
+			splits[j] = tmp;
+		}
+	}
+	return n_splits;
+}
+
+/* Entry point of parallel merge worker */
+void
+lsm3_parallel_merge_main(dsm_segment *seg, shm_toc *toc)
+{
+	Lsm3ParallelMergeData* shared = (Lsm3ParallelMergeData*)shm_toc_lookup(toc, LSM3_PARALLEL_MERGE_KEY, false);
+	char* queues = (char*)shm_toc_lookup(toc, LSM3_PARALLEL_MERGE_QUEUE_KEY, false);
+	shm_mq* mq = (shm_mq*)(queues + ParallelWorkerNumber*LSM3_MERGE_QUEUE_SIZE);
+	shm_mq_handle* queue;
+	Relation top_index = index_open(shared->src_oid, AccessShareLock);
+	Relation heap = table_open(shared->heap_oid, AccessShareLock);
+	Relation base_index = index_open(shared->dst_oid, AccessShareLock); /* only prefetched by worker */
+	Datum* splits = (Datum*)palloc((shared->n_splits + 1)*sizeof(Datum));
+	char* ptr = (char*)shared + MAXALIGN(sizeof(Lsm3ParallelMergeData));
+
+	for (int i = 0; i < shared->n_splits; i++)
+	{
+		bool isnull;
+		splits[i] = datumRestore(&ptr, &isnull);
+	}
+	shm_mq_set_sender(mq, MyProc);
+	queue = shm_mq_attach(mq, seg, NULL);
+
+	lsm3_merge_ranges(shared, splits, top_index, base_index, heap, queue);
+
+	shm_mq_detach(queue);
+	index_close(top_index, AccessShareLock);
+	index_close(base_index, AccessShareLock);
+	table_close(heap, AccessShareLock);
+}
+
+/* Insert tuples sent by parallel workers in destination index until all workers are detached */
+static void
+lsm3_merge_receive(ParallelContext *pcxt, shm_mq_handle** queues, Relation base_index, Relation heap)
+{
+	int n_active = pcxt->nworkers_launched;
+
+	while (n_active > 0)
+	{
+		bool received = false;
+
+		for (int i = 0; i < pcxt->nworkers_launched; i++)
+		{
+			Size  len;
+			void* data;
+			shm_mq_result res;
+
+			if (queues[i] == NULL)
+				continue;
+			res = shm_mq_receive(queues[i], &len, &data, true);
+			if (res == SHM_MQ_SUCCESS)
+			{
+				/* Message can point to the queue ring buffer which is reused by the next receive */
+				IndexTuple itup = CopyIndexTuple((IndexTuple)data);
+				_bt_doinsert(base_index, itup, INSERT_FLAGS, heap);
+				pfree(itup);
+				received = true;
+			}
+			else if (res == SHM_MQ_DETACHED)
+			{
+				shm_mq_detach(queues[i]);
+				queues[i] = NULL;
+				n_active -= 1;
+			}
+		}
+		if (!received && n_active > 0)
+		{
+			(void) WaitLatch(MyLatch, WL_LATCH_SET | WL_EXIT_ON_PM_DEATH, 0, PG_WAIT_EXTENSION);
+			ResetLatch(MyLatch);
+		}
+		CHECK_FOR_INTERRUPTS();
+	}
+}
+
+/* Merge top index into base index */
+static void
+lsm3_merge_indexes(Oid dst_oid, Oid src_oid, Oid heap_oid, Lsm3MergeStat* stat)
+{
+	Relation top_index = index_open(src_oid, AccessShareLock);
+	Relation heap = table_open(heap_oid, AccessShareLock);
+	Relation base_index = index_open(dst_oid, RowExclusiveLock);
+	Oid  save_am = base_index->rd_rel->relam;
+	int  n_workers = Lsm3MaxParallelMergeWorkers;
+	int  max_ranges = (n_workers + 1)*LSM3_MERGE_RANGES_PER_PARTICIPANT;
+	Datum* splits = (Datum*)palloc(max_ranges*sizeof(Datum));
+	int  n_splits = n_workers > 0 ? lsm3_get_merge_splits(top_index, max_ranges, splits) : 0;
+
+	elog(LOG, "Lsm3: merge top index %s with size %d blocks", RelationGetRelationName(top_index), RelationGetNumberOfBlocks(top_index));
+
+	base_index->rd_rel->relam = BTREE_AM_OID;
+	if (n_splits == 0)
+	{
+		lsm3_merge_range(top_index, base_index, heap, NULL, 0, stat, NULL);
+	}
+	else
+	{
+		ParallelContext *pcxt;
+		Lsm3ParallelMergeData* shared;
+		char* queue_space;
+		shm_mq_handle** queues;
+		Form_pg_attribute att = TupleDescAttr(RelationGetDescr(top_index), 0);
+		Size size = MAXALIGN(sizeof(Lsm3ParallelMergeData));
+		char* ptr;
+
+		for (int i = 0; i < n_splits; i++)
+			size += datumEstimateSpace(splits[i], false, att->attbyval, att->attlen);
+
+		/* Parallel context requires active snapshot */
+		PushActiveSnapshot(GetTransactionSnapshot());
+		EnterParallelMode();
+		pcxt = CreateParallelContext("lsm3", "lsm3_parallel_merge_main", n_workers);
+		shm_toc_estimate_chunk(&pcxt->estimator, size);
+		shm_toc_estimate_chunk(&pcxt->estimator, mul_size(LSM3_MERGE_QUEUE_SIZE, n_workers));
+		shm_toc_estimate_keys(&pcxt->estimator, 2);
+		InitializeParallelDSM(pcxt);
+
+		shared = (Lsm3ParallelMergeData*)shm_toc_allocate(pcxt->toc, size);
+		shared->dst_oid = dst_oid;
+		shared->src_oid = src_oid;
+		shared->heap_oid = heap_oid;
+		shared->n_splits = n_splits;
+		pg_atomic_init_u32(&shared->next_range, 0);
+		pg_atomic_init_u64(&shared->n_merged, 0);
+		pg_atomic_init_u64(&shared->n_dropped, 0);
+		pg_atomic_init_u64(&shared->n_bytes, 0);
+		ptr = (char*)shared + MAXALIGN(sizeof(Lsm3ParallelMergeData));
+		for (int i = 0; i < n_splits; i++)
+			datumSerialize(splits[i], false, att->attbyval, att->attlen, &ptr);
+		shm_toc_insert(pcxt->toc, LSM3_PARALLEL_MERGE_KEY, shared);
+
+		queue_space = (char*)shm_toc_allocate(pcxt->toc, mul_size(LSM3_MERGE_QUEUE_SIZE, n_workers));
+		for (int i = 0; i < n_workers; i++)
+		{
+			shm_mq* mq = shm_mq_create(queue_space + i*LSM3_MERGE_QUEUE_SIZE, LSM3_MERGE_QUEUE_SIZE);
+			shm_mq_set_receiver(mq, MyProc);
+		}
+		shm_toc_insert(pcxt->toc, LSM3_PARALLEL_MERGE_QUEUE_KEY, queue_space);
+
+		LaunchParallelWorkers(pcxt);
+		elog(LOG, "Lsm3: merge %d ranges of index %s using %d parallel workers",
+			 n_splits + 2, RelationGetRelationName(top_index), pcxt->nworkers_launched);
+		n_splits = pcxt->nworkers_launched == 0 ? 0 : n_splits;
+		if (n_splits != 0)
+		{
+			queues = (shm_mq_handle**)palloc(pcxt->nworkers_launched*sizeof(shm_mq_handle*));
+			for (int i = 0; i < pcxt->nworkers_launched; i++)
+			{
+				queues[i] = shm_mq_attach((shm_mq*)(queue_space + i*LSM3_MERGE_QUEUE_SIZE), pcxt->seg, pcxt->worker[i].bgwhandle);
+			}
+			lsm3_merge_receive(pcxt, queues, base_index, heap);
+			pfree(queues);
+		}
+		WaitForParallelWorkersToFinish(pcxt);
+		stat->n_merged += pg_atomic_read_u64(&shared->n_merged);
+		stat->n_dropped += pg_atomic_read_u64(&shared->n_dropped);
+		stat->n_bytes += pg_atomic_read_u64(&shared->n_bytes);
+
+		DestroyParallelContext(pcxt);
+		ExitParallelMode();
+		PopActiveSnapshot();
+
+		if (n_splits == 0)
+		{
+			/* No workers were launched, so merge is performed serially */
+			lsm3_merge_range(top_index, base_index, heap, NULL, 0, stat, NULL);
+		}
+	}
+	base_index->rd_rel->relam = save_am;
+	pfree(splits);
+	index_close(top_index, AccessShareLock);
+	index_close(base_index, RowExclusiveLock);
+	table_close(heap, AccessShareLock);
+}
+
+#if PG_VERSION_NUM>=160000
+typedef RelFileLocator Lsm3RelFileLocator;
+#define LSM3_RELATION_LOCATOR(rel)  ((rel)->rd_locator)
+#define LSM3_LOCATOR_NUMBER(loc)    ((loc).relNumber)
+#define LSM3_NEW_RELFILENUMBER(rel) GetNewRelFileNumber((rel)->rd_rel->reltablespace, NULL, (rel)->rd_rel->relpersistence)
+#else
+typedef RelFileNode Lsm3RelFileLocator;
+#define LSM3_RELATION_LOCATOR(rel)  ((rel)->rd_node)
+#define LSM3_LOCATOR_NUMBER(loc)    ((loc).relNode)
+#define LSM3_NEW_RELFILENUMBER(rel) GetNewRelFileNode((rel)->rd_rel->reltablespace, NULL, (rel)->rd_rel->relpersistence)
+#endif
+
+/* Create new storage for the relation. It is removed on abort, but not yet used by the relation */
+static SMgrRelation
+lsm3_create_storage(Relation rel, Lsm3RelFileLocator* locator)
+{
+	*locator = LSM3_RELATION_LOCATOR(rel);
+	LSM3_LOCATOR_NUMBER(*locator) = LSM3_NEW_RELFILENUMBER(rel);
+#if PG_VERSION_NUM>=150000
+	return RelationCreateStorage(*locator, rel->rd_rel->relpersistence, true);
+#else
+	return RelationCreateStorage(*locator, rel->rd_rel->relpersistence);
+#endif
+}
+
+/* Switch relation to the new storage created by lsm3_create_storage */
+static void
+lsm3_set_relfilenode(Relation rel, Lsm3RelFileLocator* locator, BlockNumber n_pages)
+{
+	Relation	pg_class = table_open(RelationRelationId, RowExclusiveLock);
+	HeapTuple	tuple = SearchSysCacheCopy1(RELOID, ObjectIdGetDatum(RelationGetRelid(rel)));
+	Form_pg_class classform;
+
+	if (!HeapTupleIsValid(tuple))
+		elog(ERROR, "Lsm3: could not find tuple for relation %u", RelationGetRelid(rel));
+	classform = (Form_pg_class) GETSTRUCT(tuple);
+	classform->relfilenode = LSM3_LOCATOR_NUMBER(*locator);
+	classform->relpages = n_pages;
+	CatalogTupleUpdate(pg_class, &tuple->t_self, tuple);
+	heap_freetuple(tuple);
+	table_close(pg_class, RowExclusiveLock);
+
+	/* Make the new relfilenode visible (relcache entry of the relation is rebuilt) */
+	CommandCounterIncrement();
+}
+
+/*
+ * Recycling of merged sub-indexes.
+ * Truncation of merged sub-index needs exclusive lock, so it would wait for all transactions which have accessed this index
+ * (including long-running queries). Instead of it merge switches sub-index to new empty storage: concurrent scans
+ * continue to read old storage (its tuples are already present in the next level, and duplicates are skipped by lsm3_gettuple),
+ * while new transactions use new storage. Old storage is registered in lsm3_state table together with XID of the transaction
+ * which has switched sub-index (so it is dropped on abort of this transaction and after restart) and is dropped
+ * by one of the next merges when all snapshots taken before the switch are released. Merge never waits for release
+ * of old storage: sub-index can be recycled several times while long-running query is using some of its old storages.
+ */
+/* Schedule removal of storage with the specified relfilenode (in tablespace of the index) at commit */
+static void
+lsm3_drop_storage(Relation index, Oid relfilenode)
+{
+	Lsm3RelFileLocator current = LSM3_RELATION_LOCATOR(index);
+
+	LSM3_LOCATOR_NUMBER(LSM3_RELATION_LOCATOR(index)) = relfilenode;
+	RelationDropStorage(index); /* also closes smgr of the index */
+	LSM3_RELATION_LOCATOR(index) = current;
+}
+
+/*
+ * Drop old storages of recycled sub-index which are not used any more: transaction which has recycled sub-index
+ * precedes xmin of all transactions (including standbys with hot_standby_feedback) and vacuum of the table is not running.
+ * Storages which are still used are left to the next merge.
+ */
+static void
+lsm3_drop_garbage(Lsm3DictEntry* entry, int i)
+{
+	Relation index = index_open(lsm3_get_sub_index(entry, i), AccessShareLock);
+	List* items = lsm3_state_get(index, LSM3_STATE_GARBAGE);
+	TransactionId oldest_xmin = lsm3_get_oldest_xmin(NULL);
+	bool locked = false;
+	ListCell* cell;
+
+	foreach (cell, items)
+	{
+		Lsm3StateItem* item = (Lsm3StateItem*)lfirst(cell);
+		if (!TransactionIdPrecedes((TransactionId)item->value, oldest_xmin))
+			continue;
+		/* Vacuum doesn't use snapshot, so it is excluded by lock */
+		if (!locked && !(locked = ConditionalLockRelationOid(entry->heap, ShareUpdateExclusiveLock)))
+			break;
+		elog(LOG, "Lsm3: drop old storage %u of index %s", item->relfilenode, RelationGetRelationName(index));
+		lsm3_drop_storage(index, item->relfilenode);
+		lsm3_state_remove(index, LSM3_STATE_GARBAGE, item->relfilenode);
+	}
+	list_free_deep(items);
+	index_close(index, NoLock); /* locks are held until end of transaction */
+}
+
+/* Switch merged sub-index to new empty storage. Old storage is dropped after commit by lsm3_drop_garbage */
+static void
+lsm3_recycle_index(Lsm3DictEntry* entry, int i)
+{
+	Oid index_oid = lsm3_get_sub_index(entry, i);
+	Relation heap = table_open(entry->heap, AccessShareLock); /* heap is actually not used, because we will not load data to sub-index */
+	Relation index;
+	Lsm3RelFileLocator locator;
+	Oid garbage;
+
+	index = index_open(index_oid, ShareUpdateExclusiveLock);
+	garbage = index->rd_rel->relfilenode;
+	elog(LOG, "Lsm3: recycle index %s", RelationGetRelationName(index));
+	(void) lsm3_create_storage(index, &locator);
+	lsm3_set_relfilenode(index, &locator, 0);
+	lsm3_state_add(index, LSM3_STATE_GARBAGE, garbage, GetCurrentTransactionId());
+	/* Metapage (and init fork of unlogged index) is written by build of empty index */
+	index_build(heap, index, BuildDummyIndexInfo(index), true, false);
+	index_close(index, NoLock);
+	table_close(heap, AccessShareLock);
+}
+
+/*
+ * Bulk loader of B-Tree: builds index bottom-up from sorted stream of index tuples.
+ * It is simplified version of _bt_load from nbtsort.c which is not accessible for extensions:
+ * it writes pages directly to the specified storage. For indexes with packed_base option pages are filled completely
+ * and tuples with equal keys are merged into posting lists (like B-Tree deduplication does).
+ */
+typedef struct Lsm3PageState
+{
+	Page         page;     /* page being filled */
+	BlockNumber  blkno;    /* block number of this page */
+	IndexTuple   lowkey;   /* page's strict lower bound pivot tuple */
+	OffsetNumber lastoff;  /* last item offset loaded */
+	uint32       level;    /* tree level (0 = leaf) */
+	Size         full;     /* page is "full" if less than this much space is free */
+	struct Lsm3PageState* next; /* state of parent level (NULL if not yet created) */
+} Lsm3PageState;
+
+typedef struct
+{
+	Relation     index;         /* index definition (tuple descriptor and options) */
+	SMgrRelation smgr;          /* storage where pages are written (NULL if pages are appended through shared buffers) */
+	Lsm3RelFileLocator locator; /* locator of this storage (for WAL logging) */
+	BTScanInsert inskey;        /* used for suffix truncation of high keys */
+	bool         use_wal;       /* WAL-log written pages */
+	Size         leaf_full;     /* free space left at leaf pages according to fillfactor */
+	Size         nonleaf_full;  /* free space left at internal pages */
+	bool         deduplicate;   /* merge tuples with equal keys into posting lists */
+	Size         max_posting_size; /* maximal size of posting list tuple */
+	IndexTuple   dup_base;      /* first tuple of pending group of equal keys (NULL if none) */
+	ItemPointerData* dup_tids;  /* heap TIDs of pending group */
+	int          dup_n_tids;    /* number of TIDs in pending group */
+	BlockNumber  pages_alloced; /* number of allocated pages */
+	BlockNumber  pages_written; /* number of pages written to the storage */
+	Page         zeropage;      /* zero page used to fill the gaps */
+	Lsm3PageState* leaf;        /* state of leaf level (NULL if nothing was loaded) */
+} Lsm3BulkLoader;
+
+/*
+ * If smgr is NULL, then pages are appended to the existing index through shared buffers,
+ * otherwise the whole index is written to the new storage.
+ */
+static void
+lsm3_bulk_init(Lsm3BulkLoader* loader, Relation index, SMgrRelation smgr, Lsm3RelFileLocator* locator)
+{
+	Lsm3Options* options = (Lsm3Options*)index->rd_options;
+	bool packed = options ? options->packed_base : false;
+	int fillfactor = packed ? 100 : options ? options->nbt_opts.fillfactor : BTREE_DEFAULT_FILLFACTOR;
+
+	loader->index = index;
+	loader->smgr = smgr;
+	if (locator)
+		loader->locator = *locator;
+	loader->inskey = _bt_mkscankey(index, NULL);
+	loader->inskey->allequalimage = _bt_allequalimage(index, false);
+	/* Pages are written bypassing shared buffers, so always log them (as btbuild does for non-skipped WAL) */
+	loader->use_wal = index->rd_rel->relpersistence == RELPERSISTENCE_PERMANENT;
+	loader->leaf_full = BLCKSZ * (100 - fillfactor) / 100;
+	loader->nonleaf_full = packed ? 0 : BLCKSZ * (100 - BTREE_NONLEAF_FILLFACTOR) / 100;
+	/* Posting lists can be used only if equal keys have the same binary representation (no INCLUDE columns) */
+	loader->deduplicate = packed && options->nbt_opts.deduplicate_items && loader->inskey->allequalimage;
+	/* The same limit as used by _bt_sort_dedup */
+	loader->max_posting_size = MAXALIGN_DOWN((BLCKSZ * 10 / 100)) - sizeof(ItemIdData);
+	loader->dup_base = NULL;
+	loader->dup_tids = loader->deduplicate ? (ItemPointerData*) palloc(loader->max_posting_size) : NULL;
+	loader->dup_n_tids = 0;
+	if (smgr)
+	{
+		loader->pages_alloced = BTREE_METAPAGE + 1;
+		loader->pages_written = 0;
+	}
+	else
+	{
+		loader->pages_alloced = loader->pages_written = RelationGetNumberOfBlocks(index);
+	}
+	loader->zeropage = NULL;
+	loader->leaf = NULL;
+}
+
+static Page
+lsm3_bulk_newpage(uint32 level)
+{
+	Page		 page = (Page) palloc(BLCKSZ);
+	BTPageOpaque opaque;
+
+	_bt_pageinit(page, BLCKSZ);
+	opaque = (BTPageOpaque) PageGetSpecialPointer(page);
+	opaque->btpo_prev = opaque->btpo_next = P_NONE;
+#if PG_VERSION_NUM>=140000
+	opaque->btpo_level = level;
+#else
+	opaque->btpo.level = level;
+#endif
+	opaque->btpo_flags = level > 0 ? 0 : BTP_LEAF;
+	opaque->btpo_cycleid = 0;
+
+	/* Make the P_HIKEY line pointer appear allocated */
+	((PageHeader) page)->pd_lower += sizeof(ItemIdData);
+
+	return page;
+}
+
+/* Write page to the existing index through shared buffers, extending index if needed */
+static void
+lsm3_bulk_writebuffer(Lsm3BulkLoader* loader, Page page, BlockNumber blkno)
+{
+	Buffer buf;
+
+	if (blkno >= loader->pages_written)
+	{
+		LockRelationForExtension(loader->index, ExclusiveLock);
+		while (blkno >= loader->pages_written)
+		{
+			buf = ReadBuffer(loader->index, P_NEW);
+			if (BufferGetBlockNumber(buf) != loader->pages_written)
+				elog(ERROR, "Lsm3: index %s was concurrently extended", RelationGetRelationName(loader->index));
+			ReleaseBuffer(buf);
+			loader->pages_written++;
+		}
+		UnlockRelationForExtension(loader->index, ExclusiveLock);
+	}
+	buf = ReadBuffer(loader->index, blkno);
+	LockBuffer(buf, BUFFER_LOCK_EXCLUSIVE);
+
+	START_CRIT_SECTION();
+	memcpy(BufferGetPage(buf), page, BLCKSZ);
+	MarkBufferDirty(buf);
+	if (loader->use_wal)
+		log_newpage_buffer(buf, true);
+	END_CRIT_SECTION();
+
+	UnlockReleaseBuffer(buf);
+}
+
+static void
+lsm3_bulk_writepage(Lsm3BulkLoader* loader, Page page, BlockNumber blkno)
+{
+	if (loader->smgr == NULL)
+	{
+		lsm3_bulk_writebuffer(loader, page, blkno);
+		pfree(page);
+		return;
+	}
+	if (loader->use_wal)
+	{
+		log_newpage(&loader->locator, MAIN_FORKNUM, blkno, page, true);
+	}
+	/* Pages are allocated before they are written, so we may need to fill the gap with zero pages */
+	while (blkno > loader->pages_written)
+	{
+		if (!loader->zeropage)
+			loader->zeropage = (Page) palloc0(BLCKSZ);
+		smgrextend(loader->smgr, MAIN_FORKNUM, loader->pages_written++,
+				   (char *) loader->zeropage, true);
+	}
+	PageSetChecksumInplace(page, blkno);
+	if (blkno == loader->pages_written)
+	{
+		smgrextend(loader->smgr, MAIN_FORKNUM, blkno, (char *) page, true);
+		loader->pages_written++;
+	}
+	else
+	{
+		smgrwrite(loader->smgr, MAIN_FORKNUM, blkno, (char *) page, true);
+	}
+	pfree(page);
+}
+
+static Lsm3PageState*
+lsm3_bulk_pagestate(Lsm3BulkLoader* loader, uint32 level)
+{
+	Lsm3PageState* state = (Lsm3PageState*) palloc0(sizeof(Lsm3PageState));
+
+	state->page = lsm3_bulk_newpage(level);
+	state->blkno = loader->pages_alloced++;
+	state->lowkey = NULL;
+	state->lastoff = P_HIKEY;
+	state->level = level;
+	state->full = level > 0 ? loader->nonleaf_full : loader->leaf_full;
+	state->next = NULL;
+
+	return state;
+}
+
+static void
+lsm3_bulk_addtup(Page page, Size itemsize, IndexTuple itup, OffsetNumber itup_off, bool newfirstdataitem)
+{
+	IndexTupleData trunctuple;
+
+	if (newfirstdataitem)
+	{
+		/* First data item of internal page is "minus infinity" */
+		trunctuple = *itup;
+		trunctuple.t_info = sizeof(IndexTupleData);
+		BTreeTupleSetNAtts(&trunctuple, 0, false);
+		itup = &trunctuple;
+		itemsize = sizeof(IndexTupleData);
+	}
+	if (PageAddItem(page, (Item) itup, itemsize, itup_off, false, false) == InvalidOffsetNumber)
+	{
+		elog(ERROR, "Lsm3: failed to add item to the index page");
+	}
+}
+
+static void
+lsm3_bulk_buildadd(Lsm3BulkLoader* loader, Lsm3PageState* state, IndexTuple itup)
+{
+	Page		 npage = state->page;
+	BlockNumber  nblkno = state->blkno;
+	OffsetNumber last_off = state->lastoff;
+	Size		 pgspc = PageGetFreeSpace(npage);
+	Size		 itupsz = MAXALIGN(IndexTupleSize(itup));
+	bool		 isleaf = state->level == 0;
+
+	/* Leave room for heap TID which may be appended to the high key by suffix truncation */
+	if (pgspc < itupsz + (isleaf ? MAXALIGN(sizeof(ItemPointerData)) : 0) ||
+		(pgspc < state->full && last_off > P_FIRSTKEY))
+	{
+		/* Finish off the page and write it out */
+		Page		 opage = npage;
+		BlockNumber  oblkno = nblkno;
+		ItemId		 ii;
+		ItemId		 hii;
+		IndexTuple	 oitup;
+		BTPageOpaque oopaque;
+		BTPageOpaque nopaque;
+
+		npage = lsm3_bulk_newpage(state->level);
+		nblkno = loader->pages_alloced++;
+
+		/* Last item of the old page becomes first item of the new page... */
+		ii = PageGetItemId(opage, last_off);
+		oitup = (IndexTuple) PageGetItem(opage, ii);
+		lsm3_bulk_addtup(npage, ItemIdGetLength(ii), oitup, P_FIRSTKEY, !isleaf);
+
+		/* ... and high key of the old page */
+		hii = PageGetItemId(opage, P_HIKEY);
+		*hii = *ii;
+		ItemIdSetUnused(ii);
+		((PageHeader) opage)->pd_lower -= sizeof(ItemIdData);
+
+		if (isleaf)
+		{
+			/* Truncate away unneeded attributes of leaf high key */
+			IndexTuple lastleft = (IndexTuple) PageGetItem(opage, PageGetItemId(opage, OffsetNumberPrev(last_off)));
+			IndexTuple truncated = _bt_truncate(loader->index, lastleft, oitup, loader->inskey);
+
+			if (!PageIndexTupleOverwrite(opage, P_HIKEY, (Item) truncated, IndexTupleSize(truncated)))
+			{
+				elog(ERROR, "Lsm3: failed to add high key to the index page");
+			}
+			pfree(truncated);
+			oitup = (IndexTuple) PageGetItem(opage, hii);
+		}
+
+		/* Link the old page into its parent using its low key */
+		if (state->next == NULL)
+		{
+			state->next = lsm3_bulk_pagestate(loader, state->level + 1);
+		}
+		BTreeTupleSetDownLink(state->lowkey, oblkno);
+		lsm3_bulk_buildadd(loader, state->next, state->lowkey);
+		pfree(state->lowkey);
+
+		/* High key of the old page is low key of the new page */
+		state->lowkey = CopyIndexTuple(oitup);
+
+		oopaque = (BTPageOpaque) PageGetSpecialPointer(opage);
+		nopaque = (BTPageOpaque) PageGetSpecialPointer(npage);
+		oopaque->btpo_next = nblkno;
+		nopaque->btpo_prev = oblkno;
+		nopaque->btpo_next = P_NONE;
+
+		lsm3_bulk_writepage(loader, opage, oblkno);
+
+		last_off = P_FIRSTKEY;
+	}
+
+	if (last_off == P_HIKEY && state->lowkey == NULL)
+	{
+		/* Very first page at this level: its low key is "minus infinity" (unless pages are appended to existing index) */
+		state->lowkey = palloc0(sizeof(IndexTupleData));
+		state->lowkey->t_info = sizeof(IndexTupleData);
+		BTreeTupleSetNAtts(state->lowkey, 0, false);
+	}
+
+	last_off = OffsetNumberNext(last_off);
+	lsm3_bulk_addtup(npage, itupsz, itup, last_off, !isleaf && last_off == P_FIRSTKEY);
+
+	state->page = npage;
+	state->blkno = nblkno;
+	state->lastoff = last_off;
+}
+
+static void
+lsm3_bulk_addleaf(Lsm3BulkLoader* loader, IndexTuple itup)
+{
+	if (loader->leaf == NULL)
+	{
+		loader->leaf = lsm3_bulk_pagestate(loader, 0);
+	}
+	lsm3_bulk_buildadd(loader, loader->leaf, itup);
+}
+
+/* Write pending group of equal keys as single tuple or posting list */
+static void
+lsm3_bulk_flushdups(Lsm3BulkLoader* loader)
+{
+	if (loader->dup_base == NULL)
+		return;
+
+	if (loader->dup_n_tids == 1)
+	{
+		lsm3_bulk_addleaf(loader, loader->dup_base);
+	}
+	else
+	{
+		IndexTuple posting = _bt_form_posting(loader->dup_base, loader->dup_tids, loader->dup_n_tids);
+		lsm3_bulk_addleaf(loader, posting);
+		pfree(posting);
+	}
+	pfree(loader->dup_base);
+	loader->dup_base = NULL;
+	loader->dup_n_tids = 0;
+}
+
+/* Add next leaf tuple. Tuples should be added in index order (including heap TID). */
+static void
+lsm3_bulk_add(Lsm3BulkLoader* loader, IndexTuple itup)
+{
+	if (!loader->deduplicate || BTreeTupleIsPosting(itup))
+	{
+		lsm3_bulk_flushdups(loader);
+		lsm3_bulk_addleaf(loader, itup);
+		return;
+	}
+	if (loader->dup_base != NULL
+		&& _bt_keep_natts_fast(loader->index, loader->dup_base, itup) > IndexRelationGetNumberOfAttributes(loader->index)
+		&& ItemPointerCompare(&loader->dup_tids[loader->dup_n_tids - 1], &itup->t_tid) < 0
+		&& MAXALIGN(IndexTupleSize(loader->dup_base) + (loader->dup_n_tids + 1) * sizeof(ItemPointerData)) <= loader->max_posting_size)
+	{
+		/* Append TID to the posting list of pending group */
+		loader->dup_tids[loader->dup_n_tids++] = itup->t_tid;
+	}
+	else
+	{
+		lsm3_bulk_flushdups(loader);
+		loader->dup_base = CopyIndexTuple(itup);
+		loader->dup_tids[0] = itup->t_tid;
+		loader->dup_n_tids = 1;
+	}
+}
+
+/* Rightmost page has no high key, so shift line pointers to the left */
+static void
+lsm3_bulk_slideleft(Page page)
+{
+	OffsetNumber maxoff = PageGetMaxOffsetNumber(page);
+	ItemId		 previi = PageGetItemId(page, P_HIKEY);
+
+	for (OffsetNumber off = P_FIRSTKEY; off <= maxoff; off = OffsetNumberNext(off))
+	{
+		ItemId thisii = PageGetItemId(page, off);
+		*previi = *thisii;
+		previi = thisii;
+	}
+	((PageHeader) page)->pd_lower -= sizeof(ItemIdData);
+}
+
+/* Write rightmost pages of all levels. Returns root page (P_NONE if nothing was loaded) and its level. */
+static BlockNumber
+lsm3_bulk_finish_levels(Lsm3BulkLoader* loader, uint32* level)
+{
+	BlockNumber rootblkno = P_NONE;
+	uint32		rootlevel = 0;
+
+	lsm3_bulk_flushdups(loader);
+
+	for (Lsm3PageState* s = loader->leaf; s != NULL; s = s->next)
+	{
+		BTPageOpaque opaque = (BTPageOpaque) PageGetSpecialPointer(s->page);
+
+		if (s->next == NULL)
+		{
+			/* Topmost level contains single page which is root */
+			opaque->btpo_flags |= BTP_ROOT;
+			rootblkno = s->blkno;
+			rootlevel = s->level;
+		}
+		else
+		{
+			BTreeTupleSetDownLink(s->lowkey, s->blkno);
+			lsm3_bulk_buildadd(loader, s->next, s->lowkey);
+			pfree(s->lowkey);
+			s->lowkey = NULL;
+		}
+		lsm3_bulk_slideleft(s->page);
+		lsm3_bulk_writepage(loader, s->page, s->blkno);
+	}
+	*level = rootlevel;
+	return rootblkno;
+}
+
+/* Write rightmost pages of all levels and metapage. Returns number of pages in the index. */
+static BlockNumber
+lsm3_bulk_finish(Lsm3BulkLoader* loader)
+{
+	uint32		rootlevel;
+	BlockNumber rootblkno = lsm3_bulk_finish_levels(loader, &rootlevel);
+	Page		metapage = (Page) palloc(BLCKSZ);
+
+	_bt_initmetapage(metapage, rootblkno, rootlevel, loader->inskey->allequalimage);
+	lsm3_bulk_writepage(loader, metapage, BTREE_METAPAGE);
+
+	/* Pages were written bypassing shared buffers, so we have to sync them */
+	smgrimmedsync(loader->smgr, MAIN_FORKNUM);
+
+	return loader->pages_written;
+}
+
+/* Get copy of current tuple of B-Tree scan. Posting list tuple is converted to ordinary index tuple. */
+static IndexTuple
+lsm3_copy_scan_tuple(IndexScanDesc scan)
+{
+	IndexTuple itup = scan->xs_itup;
+	IndexTuple copy;
+
+	if (BTreeTupleIsPosting(itup))
+	{
+		/*
+		 * Posting list is represented by index tuple with INDEX_ALT_TID_MASK bit set in t_info and
+		 * BT_IS_POSTING bit in TID offset, followed by array of TIDs.
+		 * We need to store right TID (taken from xs_heaptid) and correct index tuple length
+		 * (not including size of TIDs array), clearing INDEX_ALT_TID_MASK.
+		 */
+		Size size = BTreeTupleGetPostingOffset(itup);
+		copy = (IndexTuple) palloc(size);
+		memcpy(copy, itup, size);
+		copy->t_info = (itup->t_info & ~(INDEX_SIZE_MASK | INDEX_ALT_TID_MASK)) + size;
+	}
+	else
+	{
+		copy = CopyIndexTuple(itup);
+	}
+	copy->t_tid = scan->xs_heaptid;
+	return copy;
+}
+
+/*
+ * Obtain exclusive lock needed to switch index to new storage.
+ * Waiting for this lock would queue all new statements accessing the index behind the merge and can deadlock
+ * with statements waiting for locks held by merger, so lock is requested conditionally during LSM3_SWITCH_LOCK_TIMEOUT.
+ */
+static bool
+lsm3_lock_for_switch(Oid index_oid)
+{
+	int i;
+
+	for (i = 0; i < LSM3_SWITCH_LOCK_TIMEOUT / 10; i++)
+	{
+		if (ConditionalLockRelationOid(index_oid, AccessExclusiveLock))
+			return true;
+		(void) WaitLatch(MyLatch, WL_LATCH_SET | WL_TIMEOUT | WL_EXIT_ON_PM_DEATH, 10, PG_WAIT_EXTENSION);
+		ResetLatch(MyLatch);
+		CHECK_FOR_INTERRUPTS();
+	}
+	return false;
+}
+
+/* Merge top index by inserts if base index can not be rewritten. Packed base index is never updated in place. */
+static bool
+lsm3_rewrite_fallback(Lsm3DictEntry* entry, Oid src_oid, Lsm3MergeStat* stat, char const* reason)
+{
+	Relation base_index = index_open(entry->base, AccessShareLock);
+	bool     packed = base_index->rd_options && ((Lsm3Options*)base_index->rd_options)->packed_base;
+	char*    relname = pstrdup(RelationGetRelationName(base_index));
+
+	index_close(base_index, AccessShareLock);
+	if (packed)
+	{
+		elog(LOG, "Lsm3: base index %s %s: merge is postponed", relname, reason);
+		return false;
+	}
+	elog(LOG, "Lsm3: base index %s %s: insert tuples of top index instead of rewrite", relname, reason);
+	lsm3_merge_indexes(entry->base, src_oid, entry->heap, stat);
+	return true;
+}
+
+/*
+ * Merge top index into base index by rewriting base index.
+ * Base and top indexes are traversed in key order and their merged stream is loaded in new B-Tree,
+ * constructed in new relfilenode. Base index is switched to this relfilenode on commit of merge transaction.
+ * Concurrent readers and inserters are blocked only at this switch. Exclusive lock needed for the switch is checked
+ * before the build, so that new storage is not built when index is constantly used by concurrent statements.
+ * Heap is not locked during the build, so vacuum can delete entries of old base and top indexes and then reuse
+ * line pointers of their heap tuples: new storage is discarded if base index was vacuumed while it was built.
+ * If rewrite is not possible, tuples of top index are inserted in base index instead. Packed base index is never
+ * updated in place, so in this case merge is postponed and false is returned: top index is merged by the next attempt.
+ */
+static bool
+lsm3_rewrite_base(Lsm3DictEntry* entry, Oid src_oid, Lsm3MergeStat* stat)
+{
+	Oid      dst_oid = entry->base;
+	Relation heap;
+	Relation top_index;
+	Relation base_index;
+	Oid      save_am;
+	uint64   n_vacuums;
+	SortSupport sortKeys;
+	Lsm3MergeReader* top_reader;
+	IndexScanDesc base_scan;
+	IndexTuple top_tuple;
+	bool     base_eof;
+	Lsm3BulkLoader loader;
+	Lsm3RelFileLocator locator;
+	SMgrRelation srel;
+	BlockNumber n_pages;
+	uint64   n_tuples = 0;
+
+	/* Vacuum holds lock on the index, so it is not in progress while we hold exclusive lock */
+	if (!lsm3_lock_for_switch(dst_oid))
+		return lsm3_rewrite_fallback(entry, src_oid, stat, "is used by concurrent statements");
+	n_vacuums = pg_atomic_read_u64(&entry->n_vacuums);
+	UnlockRelationOid(dst_oid, AccessExclusiveLock);
+
+	heap = table_open(entry->heap, AccessShareLock);
+	top_index = index_open(src_oid, AccessShareLock);
+	base_index = index_open(dst_oid, RowExclusiveLock);
+	save_am = base_index->rd_rel->relam;
+
+	elog(LOG, "Lsm3: rewrite base index %s with %d blocks merging it with top index %s with %d blocks",
+		 RelationGetRelationName(base_index), RelationGetNumberOfBlocks(base_index),
+		 RelationGetRelationName(top_index), RelationGetNumberOfBlocks(top_index));
+
+	base_index->rd_rel->relam = BTREE_AM_OID;
+	sortKeys = lsm3_build_sortkeys(base_index, false);
+
+	srel = lsm3_create_storage(base_index, &locator);
+	lsm3_bulk_init(&loader, base_index, srel, &locator);
+
+	top_reader = lsm3_merge_reader_begin(top_index, heap, NULL, 0);
+
+	base_scan = btbeginscan(base_index, 0, 0);
+	base_scan->heapRelation = heap;
+	base_scan->xs_snapshot = SnapshotAny;
+	base_scan->xs_want_itup = true;
+	btrescan(base_scan, NULL, 0, 0, 0);
+
+	top_tuple = lsm3_merge_reader_next(top_reader);
+	base_eof = !_bt_first(base_scan, ForwardScanDirection);
+
+	while (top_tuple != NULL || !base_eof)
+	{
+		bool from_base;
+
+		CHECK_FOR_INTERRUPTS();
+
+		if (top_tuple == NULL)
+		{
+			from_base = true;
+		}
+		else if (base_eof)
+		{
+			from_base = false;
+		}
+		else
+		{
+			int result = lsm3_compare_index_tuples(base_scan, top_tuple, sortKeys);
+			if (result == 0)
+			{
+				/* Same entry in both indexes (can happen if previous merge was interrupted): skip one of them */
+				top_tuple = lsm3_merge_reader_next(top_reader);
+				continue;
+			}
+			from_base = result < 0;
+		}
+		if (from_base)
+		{
+			IndexTuple itup = lsm3_copy_scan_tuple(base_scan);
+			lsm3_bulk_add(&loader, itup);
+			stat->n_bytes += LSM3_STORED_TUPLE_SIZE(itup);
+			pfree(itup);
+			base_eof = !_bt_next(base_scan, ForwardScanDirection);
+		}
+		else
+		{
+			lsm3_bulk_add(&loader, top_tuple);
+			stat->n_bytes += LSM3_STORED_TUPLE_SIZE(top_tuple);
+			top_tuple = lsm3_merge_reader_next(top_reader);
+			stat->n_merged += 1;
+		}
+		n_tuples += 1;
+	}
+	stat->n_dropped += top_reader->n_dropped;
+	lsm3_merge_reader_end(top_reader);
+	btendscan(base_scan);
+
+	n_pages = lsm3_bulk_finish(&loader);
+	base_index->rd_rel->relam = save_am;
+	index_close(top_index, AccessShareLock);
+	table_close(heap, AccessShareLock);
+
+	if (lsm3_lock_for_switch(dst_oid))
+	{
+		if (pg_atomic_read_u64(&entry->n_vacuums) == n_vacuums)
+		{
+			RelationDropStorage(base_index);
+			lsm3_set_relfilenode(base_index, &locator, n_pages);
+			index_close(base_index, RowExclusiveLock);
+
+			elog(LOG, "Lsm3: base index %s is rewritten: %lld tuples, %d blocks, %lld dead tuples dropped",
+				 get_rel_name(dst_oid), (long long)n_tuples, n_pages, (long long)stat->n_dropped);
+			return true;
+		}
+		/* Exclusive lock is not needed any more: it is released to not block readers during insert merge */
+		UnlockRelationOid(dst_oid, AccessExclusiveLock);
+		lsm3_drop_storage(base_index, LSM3_LOCATOR_NUMBER(locator));
+		index_close(base_index, RowExclusiveLock);
+		memset(stat, 0, sizeof(*stat));
+		return lsm3_rewrite_fallback(entry, src_oid, stat, "was vacuumed during rewrite");
+	}
+	lsm3_drop_storage(base_index, LSM3_LOCATOR_NUMBER(locator));
+	index_close(base_index, RowExclusiveLock);
+	memset(stat, 0, sizeof(*stat));
+	return lsm3_rewrite_fallback(entry, src_oid, stat, "is used by concurrent statements");
+}
+
+/*
+ * Append merge.
+ * If all keys of the source index are greater than keys of the destination index (typical for sequence and timestamp keys),
+ * then tuples of the source index are loaded in new leaf pages appended to the destination B-Tree instead of inserting them
+ * one by one in its rightmost leaf page. Existing leaf pages are preserved (except the rightmost one, which tuples are reloaded
+ * in the first new page) and internal levels are rebuilt from downlinks of level 1 pages, so cost of merge is proportional
+ * to the size of source index and internal levels of destination index. New pages are written through shared buffers,
+ * then metapage and right link of the last preserved leaf page are atomically switched to the new tree and pages of old
+ * internal levels are marked as deleted to be recycled by vacuum.
+ * Destination index is modified only by merger, so append doesn't block readers: scans which have descended the old tree
+ * move right from deleted pages to the new ones (deleted rightmost leaf page is linked to the first new leaf page and deleted
+ * rightmost internal pages - to the new root). Switch is not transactional, so it is performed by lsm3_append_switch
+ * as the last step of merge transaction, after recycling of source index.
+ */
+
+/* Begin scan of B-Tree returning all physically present tuples (including dead and killed ones) */
+static IndexScanDesc
+lsm3_begin_probe(Relation index)
+{
+	IndexScanDesc scan = btbeginscan(index, 0, 0);
+	scan->xs_snapshot = SnapshotAny;
+	scan->xs_want_itup = true;
+	scan->ignore_killed_tuples = false;
+	btrescan(scan, NULL, 0, 0, 0);
+	return scan;
+}
+
+/* Check whether all keys of source index are greater than keys of destination index */
+static bool
+lsm3_use_append_merge(Oid dst_oid, Oid src_oid)
+{
+	Relation src_index;
+	Relation dst_index;
+	Oid      save_am;
+	IndexScanDesc src_scan;
+	bool     append = false;
+
+	if (!Lsm3AppendMerge)
+		return false;
+
+	src_index = index_open(src_oid, AccessShareLock);
+	dst_index = index_open(dst_oid, AccessShareLock);
+	save_am = dst_index->rd_rel->relam;
+	dst_index->rd_rel->relam = BTREE_AM_OID;
+
+	src_scan = lsm3_begin_probe(src_index);
+	if (_bt_first(src_scan, ForwardScanDirection))
+	{
+		IndexScanDesc dst_scan = lsm3_begin_probe(dst_index);
+		if (!_bt_first(dst_scan, BackwardScanDirection))
+		{
+			append = true; /* destination index is empty */
+		}
+		else
+		{
+			IndexTuple first = lsm3_copy_scan_tuple(src_scan);
+			append = lsm3_compare_index_tuples(dst_scan, first, lsm3_build_sortkeys(dst_index, false)) < 0;
+			pfree(first);
+		}
+		btendscan(dst_scan);
+	}
+	btendscan(src_scan);
+
+	dst_index->rd_rel->relam = save_am;
+	index_close(dst_index, AccessShareLock);
+	index_close(src_index, AccessShareLock);
+	return append;
+}
+
+/*
+ * Mark B-Tree page as deleted: it will be recycled by vacuum when no transaction can access it.
+ * Concurrent scans move right from deleted page, so the right link of deleted rightmost page is set to the specified page.
+ */
+static void
+lsm3_set_page_deleted(Page page, BlockNumber next)
+{
+	BTPageOpaque opaque = (BTPageOpaque) PageGetSpecialPointer(page);
+	if (P_RIGHTMOST(opaque))
+		opaque->btpo_next = next;
+#if PG_VERSION_NUM>=140000
+	BTPageSetDeleted(page, ReadNextFullTransactionId());
+#else
+	opaque->btpo_flags &= ~BTP_HALF_DEAD;
+	opaque->btpo_flags |= BTP_DELETED;
+	opaque->btpo.xact = ReadNewTransactionId();
+#endif
+}
+
+static void
+lsm3_delete_page(Relation index, BlockNumber blkno, BlockNumber next)
+{
+	Buffer buf = ReadBuffer(index, blkno);
+	GenericXLogState* state = GenericXLogStart(index);
+	Page   page;
+
+	LockBuffer(buf, BUFFER_LOCK_EXCLUSIVE);
+	page = GenericXLogRegisterBuffer(state, buf, 0);
+	if (!P_ISDELETED((BTPageOpaque) PageGetSpecialPointer(page)))
+		lsm3_set_page_deleted(page, next);
+	GenericXLogFinish(state);
+	UnlockReleaseBuffer(buf);
+}
+
+/* Appended tree which is not yet switched */
+typedef struct
+{
+	Relation     heap;
+	Relation     src_index;
+	Relation     dst_index;
+	BlockNumber  root;          /* root of the new tree */
+	uint32       level;         /* level of the new root */
+	bool         allequalimage;
+	BlockNumber  left;          /* last preserved leaf page */
+	BlockNumber  first_leaf;    /* first new leaf page */
+	BlockNumber* old_pages;     /* internal pages and rightmost leaf pages of destination index */
+	bool*        old_leaf;      /* whether old page is leaf */
+	int          n_old_pages;
+	uint64       n_tuples;
+} Lsm3AppendState;
+
+/*
+ * Load tuples of source index in new pages of destination index.
+ * Destination index is not changed until lsm3_append_switch is called.
+ */
+static Lsm3AppendState*
+lsm3_append_index(Oid dst_oid, Oid src_oid, Oid heap_oid, Lsm3MergeStat* stat)
+{
+	Lsm3AppendState* append = (Lsm3AppendState*) palloc(sizeof(Lsm3AppendState));
+	/* ShareUpdateExclusiveLock prevents vacuum from modifying pages of destination index */
+	Relation heap = table_open(heap_oid, ShareUpdateExclusiveLock);
+	Relation src_index = index_open(src_oid, AccessShareLock);
+	/* Readers and inserters are not blocked: destination index is modified only by merger */
+	Relation dst_index = index_open(dst_oid, ShareUpdateExclusiveLock);
+	Oid      save_am = dst_index->rd_rel->relam;
+	Lsm3BulkLoader loader;
+	Lsm3PageState* level1 = NULL;
+	Lsm3MergeReader* reader;
+	IndexTuple itup;
+	IndexTuple lowkey = NULL;   /* pivot of the rightmost leaf page */
+	BlockNumber* old_pages;     /* internal pages and rightmost leaf pages of destination index */
+	bool*    old_leaf;
+	int      n_old_pages = 0;
+	int      max_old_pages = 64;
+	BlockNumber left = P_NONE;  /* last preserved leaf page */
+	BlockNumber first_leaf;     /* first new leaf page */
+	BlockNumber blkno;
+	BlockNumber root;
+	uint32   level;
+	uint64   n_tuples = 0;
+	Page     page;
+	BTPageOpaque opaque;
+
+	elog(LOG, "Lsm3: append top index %s with %d blocks to index %s with %d blocks",
+		 RelationGetRelationName(src_index), RelationGetNumberOfBlocks(src_index),
+		 RelationGetRelationName(dst_index), RelationGetNumberOfBlocks(dst_index));
+
+	dst_index->rd_rel->relam = BTREE_AM_OID;
+	lsm3_bulk_init(&loader, dst_index, NULL, NULL);
+	old_pages = (BlockNumber*) palloc(max_old_pages * sizeof(BlockNumber));
+	old_leaf = (bool*) palloc(max_old_pages * sizeof(bool));
+
+	page = lsm3_read_page(dst_index, BTREE_METAPAGE);
+	root = BTPageGetMeta(page)->btm_root;
+	level = BTPageGetMeta(page)->btm_level;
+	pfree(page);
+
+	/* Descend to level 1 along leftmost downlinks and traverse each internal level */
+	if (level > 0)
+		level1 = lsm3_bulk_pagestate(&loader, 1);
+	blkno = root;
+	for (uint32 l = level; l > 0; l--)
+	{
+		BlockNumber child = P_NONE;
+		IndexTuple  hikey = NULL; /* high key of left sibling */
+
+		while (blkno != P_NONE)
+		{
+			page = lsm3_read_page(dst_index, blkno);
+			opaque = (BTPageOpaque) PageGetSpecialPointer(page);
+			if (!P_IGNORE(opaque))
+			{
+				OffsetNumber maxoff = PageGetMaxOffsetNumber(page);
+
+				if (n_old_pages == max_old_pages)
+				{
+					max_old_pages *= 2;
+					old_pages = (BlockNumber*) repalloc(old_pages, max_old_pages * sizeof(BlockNumber));
+					old_leaf = (bool*) repalloc(old_leaf, max_old_pages * sizeof(bool));
+				}
+				old_leaf[n_old_pages] = false;
+				old_pages[n_old_pages++] = blkno;
+
+				if (child == P_NONE)
+					child = BTreeTupleGetDownLink((IndexTuple) PageGetItem(page, PageGetItemId(page, P_FIRSTDATAKEY(opaque))));
+
+				/* Pivots of level 1 become downlinks of the new tree, except the last one which is pivot of the rightmost leaf */
+				for (OffsetNumber off = P_FIRSTDATAKEY(opaque); l == 1 && off <= maxoff; off++)
+				{
+					IndexTuple  pivot = (IndexTuple) PageGetItem(page, PageGetItemId(page, off));
+					BlockNumber downlink = BTreeTupleGetDownLink(pivot);
+
+					/* Lower bound of the first child is high key of left sibling ("minus infinity" for the leftmost page) */
+					if (off == P_FIRSTDATAKEY(opaque) && hikey != NULL)
+					{
+						pivot = hikey;
+						hikey = NULL;
+					}
+					else
+					{
+						pivot = CopyIndexTuple(pivot);
+					}
+					BTreeTupleSetDownLink(pivot, downlink);
+					if (lowkey != NULL)
+					{
+						lsm3_bulk_buildadd(&loader, level1, lowkey);
+						pfree(lowkey);
+					}
+					lowkey = pivot;
+				}
+				if (!P_RIGHTMOST(opaque))
+					hikey = CopyIndexTuple((IndexTuple) PageGetItem(page, PageGetItemId(page, P_HIKEY)));
+			}
+			blkno = opaque->btpo_next;
+			pfree(page);
+		}
+		blkno = l == 1 ? BTreeTupleGetDownLink(lowkey) : child;
+	}
+
+	/* New leaf pages follow the last preserved leaf page */
+	loader.leaf = lsm3_bulk_pagestate(&loader, 0);
+	loader.leaf->lowkey = lowkey;
+	loader.leaf->next = level1;
+	first_leaf = loader.leaf->blkno;
+
+	/* Reload tuples of the rightmost leaf page (and its right siblings if split of the rightmost page was not completed) */
+	for (bool first = true; blkno != P_NONE; first = false)
+	{
+		page = lsm3_read_page(dst_index, blkno);
+		opaque = (BTPageOpaque) PageGetSpecialPointer(page);
+		if (first)
+		{
+			left = opaque->btpo_prev;
+			((BTPageOpaque) PageGetSpecialPointer(loader.leaf->page))->btpo_prev = left;
+		}
+		if (!P_ISDELETED(opaque))
+		{
+			if (n_old_pages == max_old_pages)
+			{
+				max_old_pages *= 2;
+				old_pages = (BlockNumber*) repalloc(old_pages, max_old_pages * sizeof(BlockNumber));
+				old_leaf = (bool*) repalloc(old_leaf, max_old_pages * sizeof(bool));
+			}
+			old_leaf[n_old_pages] = true;
+			old_pages[n_old_pages++] = blkno;
+		}
+		if (!P_IGNORE(opaque))
+		{
+			OffsetNumber maxoff = PageGetMaxOffsetNumber(page);
+			for (OffsetNumber off = P_FIRSTDATAKEY(opaque); off <= maxoff; off++)
+			{
+				ItemId iid = PageGetItemId(page, off);
+				if (!ItemIdIsDead(iid))
+				{
+					lsm3_bulk_add(&loader, (IndexTuple) PageGetItem(page, iid));
+					n_tuples += 1;
+				}
+			}
+		}
+		blkno = opaque->btpo_next;
+		pfree(page);
+	}
+
+	/* Append tuples of source index */
+	reader = lsm3_merge_reader_begin(src_index, heap, NULL, 0);
+	while ((itup = lsm3_merge_reader_next(reader)) != NULL)
+	{
+		CHECK_FOR_INTERRUPTS();
+		lsm3_bulk_add(&loader, itup);
+		stat->n_merged += 1;
+		stat->n_bytes += LSM3_STORED_TUPLE_SIZE(itup);
+		n_tuples += 1;
+	}
+	stat->n_dropped += reader->n_dropped;
+	lsm3_merge_reader_end(reader);
+
+	root = lsm3_bulk_finish_levels(&loader, &level);
+	dst_index->rd_rel->relam = save_am;
+
+	append->heap = heap;
+	append->src_index = src_index;
+	append->dst_index = dst_index;
+	append->root = root;
+	append->level = level;
+	append->allequalimage = loader.inskey->allequalimage;
+	append->left = left;
+	append->first_leaf = first_leaf;
+	append->old_pages = old_pages;
+	append->old_leaf = old_leaf;
+	append->n_old_pages = n_old_pages;
+	append->n_tuples = n_tuples;
+	return append;
+}
+
+/*
+ * Switch destination index to the appended tree.
+ * Metapage, right link of the last preserved leaf page and the old rightmost leaf page are updated by one WAL record,
+ * which can not be rolled back: abort of merge transaction after the switch is detected by lsm3_is_merged.
+ */
+static void
+lsm3_append_switch(Lsm3AppendState* append, Lsm3MergeStat* stat)
+{
+	Relation dst_index = append->dst_index;
+	GenericXLogState* state;
+	Buffer   metabuf;
+	Buffer   leftbuf = InvalidBuffer;
+	Buffer   leafbuf = InvalidBuffer;
+	Page     page;
+
+	/* Pages are locked in the same order as by B-Tree page deletion: left sibling, target, metapage */
+	state = GenericXLogStart(dst_index);
+	if (append->left != P_NONE)
+	{
+		leftbuf = ReadBuffer(dst_index, append->left);
+		LockBuffer(leftbuf, BUFFER_LOCK_EXCLUSIVE);
+		page = GenericXLogRegisterBuffer(state, leftbuf, 0);
+		((BTPageOpaque) PageGetSpecialPointer(page))->btpo_next = append->first_leaf;
+	}
+	for (int i = 0; i < append->n_old_pages; i++)
+	{
+		if (append->old_leaf[i])
+		{
+			/* The old rightmost leaf page is linked to the first new leaf page, which contains its tuples */
+			leafbuf = ReadBuffer(dst_index, append->old_pages[i]);
+			LockBuffer(leafbuf, BUFFER_LOCK_EXCLUSIVE);
+			page = GenericXLogRegisterBuffer(state, leafbuf, 0);
+			((BTPageOpaque) PageGetSpecialPointer(page))->btpo_next = append->first_leaf;
+			lsm3_set_page_deleted(page, append->first_leaf);
+			break;
+		}
+	}
+	metabuf = ReadBuffer(dst_index, BTREE_METAPAGE);
+	LockBuffer(metabuf, BUFFER_LOCK_EXCLUSIVE);
+	page = GenericXLogRegisterBuffer(state, metabuf, GENERIC_XLOG_FULL_IMAGE);
+	_bt_initmetapage(page, append->root, append->level, append->allequalimage);
+	GenericXLogFinish(state);
+	UnlockReleaseBuffer(metabuf);
+	if (BufferIsValid(leafbuf))
+		UnlockReleaseBuffer(leafbuf);
+	if (BufferIsValid(leftbuf))
+		UnlockReleaseBuffer(leftbuf);
+
+	/* Old internal pages and right siblings of the old rightmost leaf page (incomplete split) are not reachable any more */
+	for (int i = 0; i < append->n_old_pages; i++)
+		lsm3_delete_page(dst_index, append->old_pages[i], append->old_leaf[i] ? append->first_leaf : append->root);
+
+	/* Make other backends discard cached metapage */
+	CacheInvalidateRelcache(dst_index);
+
+	elog(LOG, "Lsm3: %lld tuples appended to index %s, %d old pages deleted, %lld dead tuples dropped",
+		 (long long)append->n_tuples, RelationGetRelationName(dst_index), append->n_old_pages, (long long)stat->n_dropped);
+
+	pfree(append->old_pages);
+	pfree(append->old_leaf);
+	index_close(append->src_index, AccessShareLock);
+	index_close(dst_index, ShareUpdateExclusiveLock);
+	table_close(append->heap, ShareUpdateExclusiveLock);
+	pfree(append);
+}
+
+/* Choose method of merging top index with base index */
+static bool
+lsm3_use_rewrite_merge(Oid base_oid, Oid top_oid)
+{
+	Relation base_index = index_open(base_oid, AccessShareLock);
+	Lsm3Options* options = (Lsm3Options*)base_index->rd_options;
+	int      merge_mode = options ? options->merge_mode : LSM3_MERGE_AUTO;
+	bool     rewrite;
+
+	if (base_index->rd_rel->relpersistence != RELPERSISTENCE_PERMANENT)
+	{
+		rewrite = false; /* unlogged index needs init fork, which we do not create */
+	}
+	else if (options && options->packed_base)
+	{
+		rewrite = true; /* packed base is never updated in place */
+	}
+	else if (merge_mode == LSM3_MERGE_AUTO)
+	{
+		rewrite = Lsm3RewriteMergeRatio != 0
+			&& (uint64)lsm3_get_index_size(top_oid) * 100 >= (uint64)RelationGetNumberOfBlocks(base_index) * Lsm3RewriteMergeRatio;
+	}
+	else
+	{
+		rewrite = merge_mode == LSM3_MERGE_REWRITE;
+	}
+	index_close(base_index, AccessShareLock);
+	return rewrite;
+}
+
+/* Lsm3 index options.
+ */
+static bytea *
+lsm3_options(Datum reloptions, bool validate)
+{
+	static const relopt_parse_elt tab[] = {
+		{"fillfactor", RELOPT_TYPE_INT, offsetof(BTOptions, fillfactor)},
+		{"vacuum_cleanup_index_scale_factor", RELOPT_TYPE_REAL,
+		offsetof(BTOptions, vacuum_cleanup_index_scale_factor)},
+		{"deduplicate_items", RELOPT_TYPE_BOOL,
+		 offsetof(BTOptions, deduplicate_items)},
+		{"top_index_size", RELOPT_TYPE_INT, offsetof(Lsm3Options, top_index_size)},
+		{"merge_mode", RELOPT_TYPE_ENUM, offsetof(Lsm3Options, merge_mode)},
+		{"levels", RELOPT_TYPE_INT, offsetof(Lsm3Options, levels)},
+		{"level_ratio", RELOPT_TYPE_INT, offsetof(Lsm3Options, level_ratio)},
+		{"unique", RELOPT_TYPE_BOOL, offsetof(Lsm3Options, unique)},
+		{"packed_base", RELOPT_TYPE_BOOL, offsetof(Lsm3Options, packed_base)},
+		{"unlogged_tops", RELOPT_TYPE_BOOL, offsetof(Lsm3Options, unlogged_tops)}
+	};
+	return (bytea *) build_reloptions(reloptions, validate, Lsm3ReloptKind,
+									  sizeof(Lsm3Options), tab, lengthof(tab));
+}
+
+/* Get leftmost leaf page of the index (P_NONE if index is empty) */
+static BlockNumber
+lsm3_get_leftmost_leaf(Relation index)
+{
+	Page page = lsm3_read_page(index, BTREE_METAPAGE);
+	BlockNumber blkno = BTPageGetMeta(page)->btm_fastroot;
+	uint32 level = BTPageGetMeta(page)->btm_fastlevel;
+
+	pfree(page);
+	while (blkno != P_NONE && level != 0)
+	{
+		BTPageOpaque opaque;
+
+		page = lsm3_read_page(index, blkno);
+		opaque = (BTPageOpaque) PageGetSpecialPointer(page);
+		blkno = BTreeTupleGetDownLink((IndexTuple) PageGetItem(page, PageGetItemId(page, P_FIRSTDATAKEY(opaque))));
+		level -= 1;
+		pfree(page);
+	}
+	return blkno;
+}
+
+/*
+ * Chunked merge: leaf pages of merged index are inserted in destination index by chunks of at least
+ * lsm3.merge_chunk_size tuples and each chunk is committed in separate transaction, so that merge of large index
+ * doesn't hold back xmin horizon. Block number of the next leaf page is saved together with the chunk (see lsm3_set_merge_position),
+ * so merge interrupted by shutdown or crash is resumed from the last committed chunk. Inserts of interrupted chunk
+ * may be already flushed to destination index, so tuples of the first chunk after resume are inserted only if they are not found.
+ * If probe is true, then all tuples are inserted only if they are not found (source index was already merged by aborted merge).
+ * Merge is started and completed in transaction of the caller. Returns false if merge was interrupted: in this case
+ * there is no active transaction.
+ */
+static bool
+lsm3_merge_chunks(Lsm3DictEntry* entry, Oid dst_oid, Oid src_oid, BlockNumber position, bool probe, LOCKTAG* tag, Lsm3MergeStat* stat)
+{
+	uint64 chunk_size = Lsm3MergeChunkSize != 0 ? (uint64)Lsm3MergeChunkSize : PG_UINT64_MAX;
+	bool resumed = probe || position != P_NONE;
+
+	while (true)
+	{
+		Relation src = index_open(src_oid, AccessShareLock);
+		Relation heap = table_open(entry->heap, AccessShareLock);
+		Relation dst = index_open(dst_oid, RowExclusiveLock);
+		Oid save_am = dst->rd_rel->relam;
+		/* Unlogged top index is restored from heap after crash, so its position is not saved and merge is not paused */
+		bool logged = src->rd_rel->relpersistence == RELPERSISTENCE_PERMANENT;
+		Lsm3Prefetch prefetch = {dst, 0, NULL, InvalidBlockNumber};
+		Lsm3MergeReader* reader;
+		uint64 n_tuples = 0;
+		IndexTuple itup;
+
+		if (position == P_NONE)
+		{
+			position = lsm3_get_leftmost_leaf(src);
+			elog(LOG, "Lsm3: merge index %s with size %d blocks by chunks of %lld tuples",
+				 RelationGetRelationName(src), RelationGetNumberOfBlocks(src), (long long)Lsm3MergeChunkSize);
+		}
+		else if (resumed)
+			elog(LOG, "Lsm3: resume merge of index %s from block %u", RelationGetRelationName(src), position);
+
+		reader = lsm3_merge_reader_begin_pages(src, heap, position);
+		dst->rd_rel->relam = BTREE_AM_OID;
+		/* Chunk is completed at the boundary of leaf page */
+		while ((reader->pos != reader->n_batch || n_tuples < chunk_size)
+			   && (itup = lsm3_merge_reader_next(reader)) != NULL)
+		{
+			if (Lsm3MergePrefetchDistance != 0)
+				lsm3_merge_prefetch(&prefetch, reader);
+			if (!resumed || !lsm3_index_contains(dst, heap, itup))
+			{
+				_bt_doinsert(dst, itup, INSERT_FLAGS, heap);
+				stat->n_merged += 1;
+				stat->n_bytes += LSM3_STORED_TUPLE_SIZE(itup);
+			}
+			n_tuples += 1;
+		}
+		dst->rd_rel->relam = save_am;
+		position = reader->next_block;
+		stat->n_dropped += reader->n_dropped;
+		lsm3_merge_reader_end(reader);
+		if (prefetch.parent)
+			pfree(prefetch.parent);
+		if (position != P_NONE && logged)
+			lsm3_set_merge_position(src, position);
+		index_close(src, AccessShareLock);
+		index_close(dst, RowExclusiveLock);
+		table_close(heap, AccessShareLock);
+
+		if (position == P_NONE)
+			return true;
+
+		CommitTransactionCommand();
+		resumed = probe;
+
+		if ((Lsm3Cancel && logged) || !lsm3_entry_is_valid(entry, entry->base))
+		{
+			elog(LOG, "Lsm3: merge of index %u is interrupted at block %u", src_oid, position);
+			return false;
+		}
+		StartTransactionCommand();
+		(void) LockAcquire(tag, ExclusiveLock, false, false);
+	}
+}
+
+/*
+ * Check if tuples of source index are already present in destination index. It is possible if merge transaction
+ * was aborted after non-transactional switch of appended destination index (see lsm3_append_switch)
+ * or after commit of some chunks of unlogged top index. Tuples dead at the moment of previous merge are still dead,
+ * so it is enough to probe the first live tuple of source index.
+ */
+static bool
+lsm3_is_merged(Oid dst_oid, Oid src_oid, Oid heap_oid)
+{
+	Relation heap = table_open(heap_oid, AccessShareLock);
+	Relation src_index = index_open(src_oid, AccessShareLock);
+	Relation dst_index = index_open(dst_oid, AccessShareLock);
+	Oid      save_am = dst_index->rd_rel->relam;
+	Lsm3MergeReader* reader = lsm3_merge_reader_begin(src_index, heap, NULL, 0);
+	IndexTuple itup = lsm3_merge_reader_next(reader);
+	bool     merged = false;
+
+	if (itup != NULL)
+	{
+		dst_index->rd_rel->relam = BTREE_AM_OID;
+		merged = lsm3_index_contains(dst_index, heap, itup);
+		dst_index->rd_rel->relam = save_am;
+	}
+	lsm3_merge_reader_end(reader);
+	index_close(dst_index, AccessShareLock);
+	index_close(src_index, AccessShareLock);
+	table_close(heap, AccessShareLock);
+	return merged;
+}
+
+/*
+ * Merge source sub-index (top or intermediate level) into next level and recycle it.
+ * Returns false if chunked merge was interrupted or rewrite of packed base index was postponed.
+ */
+static bool
+lsm3_merge_level(Lsm3DictEntry* entry, int src, int dst)
+{
+	Oid src_oid = lsm3_get_sub_index(entry, src);
+	Oid dst_oid = lsm3_get_sub_index(entry, dst);
+	BlockNumber position;
+	Lsm3AppendState* append = NULL;
+	bool merged;
+	LOCKTAG tag;
+	Lsm3MergeStat stat = {0, 0, 0};
+	TimestampTz start = GetCurrentTimestamp();
+	long secs;
+	int usecs;
+	int bucket;
+
+	if (dst_oid != entry->base && entry->bloom_enabled)
+	{
+		/* Filter of destination should cover merged keys before them are inserted */
+		lsm3_bloom_merge(entry, dst, src);
+	}
+	StartTransactionCommand();
+	{
+		/* Lock is released at the end of merge transaction */
+		lsm3_set_merge_locktag(&tag, entry->base);
+		if (!lsm3_lock_for_merge(&tag))
+		{
+			/* Merge is repeated after completion of parallel scans */
+			elog(LOG, "Lsm3: merge of index %u is postponed because it is scanned in parallel", src_oid);
+			CommitTransactionCommand();
+			return false;
+		}
+
+		/* Interrupted merge has to be continued in the same way */
+		position = lsm3_get_merge_position(src_oid);
+		merged = position == P_NONE && lsm3_is_merged(dst_oid, src_oid, entry->heap);
+		if (merged)
+			elog(LOG, "Lsm3: index %u was partly merged by aborted merge", src_oid);
+		if (position == P_NONE && !merged && lsm3_use_append_merge(dst_oid, src_oid))
+		{
+			pgstat_report_activity(STATE_RUNNING, "appending");
+			append = lsm3_append_index(dst_oid, src_oid, entry->heap, &stat);
+		}
+		else if (position == P_NONE && !merged && dst_oid == entry->base && lsm3_use_rewrite_merge(entry->base, src_oid))
+		{
+			pgstat_report_activity(STATE_RUNNING, "rewriting");
+			if (!lsm3_rewrite_base(entry, src_oid, &stat))
+			{
+				/* Top index is kept until packed base index can be rewritten */
+				CommitTransactionCommand();
+				return false;
+			}
+		}
+		else if (position != P_NONE || merged || (Lsm3MergeChunkSize != 0 && Lsm3MaxParallelMergeWorkers == 0))
+		{
+			pgstat_report_activity(STATE_RUNNING, "merging");
+			if (!lsm3_merge_chunks(entry, dst_oid, src_oid, position, merged, &tag, &stat))
+			{
+				/* Merge is continued from the saved position by the next merge of this index */
+				if (src >= 2)
+					entry->resume_level = src;
+				pg_atomic_fetch_add_u64(&entry->merged_tuples, stat.n_merged);
+				pg_atomic_fetch_add_u64(&entry->dropped_tuples, stat.n_dropped);
+				pg_atomic_fetch_add_u64(&entry->merged_bytes, stat.n_bytes);
+				return false;
+			}
+			elog(LOG, "Lsm3: %lld tuples merged, %lld dead tuples dropped",
+				 (long long)stat.n_merged, (long long)stat.n_dropped);
+		}
+		else
+		{
+			pgstat_report_activity(STATE_RUNNING, "merging");
+			lsm3_merge_indexes(dst_oid, src_oid, entry->heap, &stat);
+			elog(LOG, "Lsm3: %lld tuples merged, %lld dead tuples dropped",
+				 (long long)stat.n_merged, (long long)stat.n_dropped);
+		}
+
+		pgstat_report_activity(STATE_RUNNING, "recycle");
+		lsm3_recycle_index(entry, src);
+		{
+			Relation src_index = index_open(src_oid, AccessShareLock);
+			lsm3_set_merge_position(src_index, P_NONE);
+			index_close(src_index, AccessShareLock);
+		}
+
+		/* Tuples of merged top index are now logged, so only tuples of active top index need recovery */
+		if (src < 2 && entry->unlogged_tops)
+			lsm3_set_recovery_horizon(entry->base, entry->top_horizon[1 - src]);
+
+		/* Switch of appended index can not be rolled back, so it is the last step before commit */
+		if (append != NULL)
+			lsm3_append_switch(append, &stat);
+	}
+	CommitTransactionCommand();
+
+	/* Should be incremented before recycled top index can become active again */
+	pg_atomic_fetch_add_u64(&entry->recycle_generation, 1);
+
+	/* Sizes of levels are cached for planner */
+	if (dst_oid != entry->base)
+	{
+		StartTransactionCommand();
+		pg_atomic_write_u32(&entry->level_pages[dst - 2], lsm3_get_index_size(dst_oid));
+		CommitTransactionCommand();
+	}
+	if (src >= 2)
+		pg_atomic_write_u32(&entry->level_pages[src - 2], 1);
+
+	TimestampDifference(start, GetCurrentTimestamp(), &secs, &usecs);
+	bucket = secs < 1 ? 0 : secs < 10 ? 1 : secs < 60 ? 2 : secs < 600 ? 3 : 4;
+	pg_atomic_fetch_add_u64(&entry->merged_tuples, stat.n_merged);
+	pg_atomic_fetch_add_u64(&entry->dropped_tuples, stat.n_dropped);
+	pg_atomic_fetch_add_u64(&entry->merged_bytes, stat.n_bytes);
+	pg_atomic_fetch_add_u64(&entry->merge_time, (uint64)secs*USECS_PER_SEC + usecs);
+	pg_atomic_fetch_add_u64(&entry->merge_durations[bucket], 1);
+
+	if (entry->bloom_enabled)
+	{
+		/* Sub-index is empty now */
+		lsm3_bloom_reset(entry, src);
+	}
+	if (src < 2)
+		pg_atomic_write_u64(&entry->top_bytes[src], 0);
+	SpinLockAcquire(&entry->spinlock);
+	if (src >= 2)
+		entry->nonempty_levels &= ~(1 << (src - 2));
+	if (dst_oid != entry->base)
+		entry->nonempty_levels |= 1 << (dst - 2);
+	SpinLockRelease(&entry->spinlock);
+	return true;
+}
+
+/*
+ * Recovery of unlogged top indexes.
+ * After crash top indexes are reset to their init forks, so tuples which were not yet merged to logged sub-indexes are lost.
+ * These are tuples inserted by transactions not preceding recovery horizon of active top index, which is saved in
+ * persistent state of base index when merge of previous top index is committed. The first backend accessing the index after restart
+ * scans heap and inserts such tuples in active top index, other backends wait for completion of recovery.
+ * Heap tuples inserted by in-progress transactions are skipped: these transactions insert them in index themselves
+ * after recovery is completed.
+ */
+#define LSM3_RECOVERY_LOCK 6
+
+/*
+ * Metapage of init fork of unlogged top index is marked with this cycle ID (not used for metapage by B-Tree),
+ * so that top index reset to its init fork by crash recovery can be distinguished from empty index.
+ */
+#define LSM3_INIT_FORK_MARK 0xFF7E
+
+static void
+lsm3_set_recovery_locktag(LOCKTAG* tag, Oid base)
+{
+	SET_LOCKTAG_ADVISORY(*tag, MyDatabaseId, base, 0, LSM3_RECOVERY_LOCK);
+}
+
+/* Check if top index was reset by crash recovery and optionally clear the mark of init fork */
+static bool
+lsm3_top_is_reset(Relation top, bool clear)
+{
+	Buffer buf = ReadBuffer(top, BTREE_METAPAGE);
+	BTPageOpaque opaque;
+	bool reset;
+
+	LockBuffer(buf, clear ? BUFFER_LOCK_EXCLUSIVE : BUFFER_LOCK_SHARE);
+	opaque = (BTPageOpaque) PageGetSpecialPointer(BufferGetPage(buf));
+	reset = opaque->btpo_cycleid == LSM3_INIT_FORK_MARK;
+	if (reset && clear)
+	{
+		opaque->btpo_cycleid = 0;
+		MarkBufferDirty(buf); /* index is unlogged */
+	}
+	UnlockReleaseBuffer(buf);
+	return reset;
+}
+
+/*
+ * Check if index contains entry with the same key and heap TID as the specified tuple.
+ * Heap TID is part of B-Tree key, so it is enough to inspect the leaf page located by the search.
+ */
+static bool
+lsm3_index_contains(Relation index, Relation heap, IndexTuple itup)
+{
+	BTScanInsert key = _bt_mkscankey(index, itup);
+	BTStack stack;
+	Buffer buf;
+	bool found = false;
+
+#if PG_VERSION_NUM>=160000
+	stack = _bt_search(index, heap, key, &buf, BT_READ);
+#else
+	stack = _bt_search(index, key, &buf, BT_READ, NULL);
+#endif
+	if (BufferIsValid(buf))
+	{
+		Page page = BufferGetPage(buf);
+		BTPageOpaque opaque = (BTPageOpaque) PageGetSpecialPointer(page);
+		OffsetNumber low = P_FIRSTDATAKEY(opaque);
+		OffsetNumber high = PageGetMaxOffsetNumber(page) + 1;
+
+		/* Locate first item greater or equal than key */
+		while (low < high)
+		{
+			OffsetNumber mid = low + (high - low) / 2;
+			if (_bt_compare(index, key, page, mid) > 0)
+				low = mid + 1;
+			else
+				high = mid;
+		}
+		if (low <= PageGetMaxOffsetNumber(page) && _bt_compare(index, key, page, low) == 0)
+		{
+			IndexTuple match = (IndexTuple) PageGetItem(page, PageGetItemId(page, low));
+			if (BTreeTupleIsPosting(match))
+			{
+				/* Key matches if TID is in the range of posting list */
+				for (int i = 0; i < BTreeTupleGetNPosting(match) && !found; i++)
+					found = ItemPointerEquals(BTreeTupleGetPostingN(match, i), &itup->t_tid);
+			}
+			else
+				found = true;
+		}
+		_bt_relbuf(index, buf);
+	}
+	_bt_freestack(stack);
+	pfree(key);
+	return found;
+}
+
+/* Insert in top index entries for heap tuples which may be not present in logged sub-indexes */
+static void
+lsm3_recover_heap(Lsm3DictEntry* entry, Relation index, Relation top)
+{
+	Relation heap = table_open(entry->heap, AccessShareLock);
+	TransactionId horizon = entry->top_horizon[entry->active_index];
+	/* Without valid horizon (for example after REINDEX) all heap tuples are checked */
+	bool check_all = !TransactionIdIsNormal(horizon) || TransactionIdPrecedes(horizon, heap->rd_rel->relfrozenxid);
+	TransactionId oldest_xmin = lsm3_get_oldest_xmin(heap);
+	IndexInfo* indexInfo = BuildIndexInfo(index);
+	EState* estate = CreateExecutorState();
+	ExprContext* econtext = GetPerTupleExprContext(estate);
+	ExprState* predicate = ExecPrepareQual(indexInfo->ii_Predicate, estate);
+	TupleTableSlot* slot = MakeSingleTupleTableSlot(RelationGetDescr(heap), &TTSOpsHeapTuple);
+	BufferAccessStrategy strategy = GetAccessStrategy(BAS_BULKREAD);
+	BlockNumber n_blocks = RelationGetNumberOfBlocks(heap);
+	Relation sub_indexes[LSM3_MAX_SUB_INDEXES];
+	int n_sub_indexes = 0;
+	OffsetNumber root_offsets[MaxHeapTuplesPerPage];
+	HeapTuple tuples[MaxHeapTuplesPerPage];
+	ItemPointerData tids[MaxHeapTuplesPerPage];
+	Datum values[INDEX_MAX_KEYS];
+	bool isnull[INDEX_MAX_KEYS];
+	Oid save_am = top->rd_rel->relam;
+	uint64 n_recovered = 0;
+	uint64 n_bytes = 0;
+
+	elog(LOG, "Lsm3: recover top index %s from table %s", RelationGetRelationName(top), RelationGetRelationName(heap));
+
+	/* Entry is searched in the order of propagation of tuples by merges */
+	sub_indexes[n_sub_indexes++] = top;
+	for (int i = 0; i < entry->n_levels; i++)
+		sub_indexes[n_sub_indexes++] = index_open(entry->level[i], AccessShareLock);
+	sub_indexes[n_sub_indexes++] = index;
+
+	econtext->ecxt_scantuple = slot;
+	for (BlockNumber blkno = 0; blkno < n_blocks; blkno++)
+	{
+		Buffer buf;
+		Page page;
+		OffsetNumber maxoff;
+		int n_tuples = 0;
+
+		CHECK_FOR_INTERRUPTS();
+		buf = ReadBufferExtended(heap, MAIN_FORKNUM, blkno, RBM_NORMAL, strategy);
+		LockBuffer(buf, BUFFER_LOCK_SHARE);
+		page = BufferGetPage(buf);
+		heap_get_root_tuples(page, root_offsets);
+		maxoff = PageGetMaxOffsetNumber(page);
+
+		for (OffsetNumber off = FirstOffsetNumber; off <= maxoff; off++)
+		{
+			ItemId lp = PageGetItemId(page, off);
+			HeapTupleData tuple;
+			OffsetNumber root;
+
+			if (!ItemIdIsNormal(lp))
+				continue;
+			tuple.t_data = (HeapTupleHeader) PageGetItem(page, lp);
+			tuple.t_len = ItemIdGetLength(lp);
+			tuple.t_tableOid = RelationGetRelid(heap);
+			ItemPointerSet(&tuple.t_self, blkno, off);
+
+			/* Select tuples which are indexed by CREATE INDEX: the last member of HOT chain referenced by its root TID */
+			switch (HeapTupleSatisfiesVacuum(&tuple, oldest_xmin, buf))
+			{
+				case HEAPTUPLE_LIVE:
+				case HEAPTUPLE_DELETE_IN_PROGRESS: /* HOT update may be in progress, so chain is indexed using this tuple */
+					break;
+				case HEAPTUPLE_RECENTLY_DEAD:
+					if (HeapTupleIsHotUpdated(&tuple))
+						continue;
+					break;
+				default:
+					continue; /* dead tuple or tuple which will be inserted in index by in-progress transaction */
+			}
+			root = HeapTupleIsHeapOnly(&tuple) ? root_offsets[off - 1] : off;
+			if (root == InvalidOffsetNumber)
+				continue;
+			if (!check_all)
+			{
+				/* Index entry was created by transaction which inserted root of HOT chain (it is unknown if root is redirected) */
+				ItemId root_lp = PageGetItemId(page, root);
+				if (ItemIdIsNormal(root_lp)
+					&& TransactionIdPrecedes(HeapTupleHeaderGetRawXmin((HeapTupleHeader) PageGetItem(page, root_lp)), horizon))
+					continue;
+			}
+			tuples[n_tuples] = heap_copytuple(&tuple);
+			ItemPointerSet(&tids[n_tuples], blkno, root);
+			n_tuples += 1;
+		}
+		UnlockReleaseBuffer(buf);
+
+		/* Index expressions and predicate are evaluated without buffer lock */
+		for (int i = 0; i < n_tuples; i++)
+		{
+			IndexTuple itup;
+			bool found = false;
+
+			ResetExprContext(econtext);
+			ExecStoreHeapTuple(tuples[i], slot, true);
+			if (!ExecQual(predicate, econtext))
+				continue;
+			FormIndexDatum(indexInfo, slot, estate, values, isnull);
+			itup = index_form_tuple(RelationGetDescr(index), values, isnull);
+			itup->t_tid = tids[i];
+			/* Tuples inserted by transactions which were active when top index was switched may be already merged */
+			for (int j = 0; j < n_sub_indexes && !found; j++)
+				found = lsm3_index_contains(sub_indexes[j], heap, itup);
+			if (!found)
+			{
+				top->rd_rel->relam = BTREE_AM_OID;
+				_bt_doinsert(top, itup, INSERT_FLAGS, heap);
+				top->rd_rel->relam = save_am;
+				n_recovered += 1;
+				n_bytes += LSM3_STORED_TUPLE_SIZE(itup);
+			}
+			pfree(itup);
+		}
+	}
+	pg_atomic_fetch_add_u64(&entry->top_bytes[entry->active_index], n_bytes);
+	entry->bloom_valid[entry->active_index] = false; /* keys of recovered tuples are not registered in Bloom filter */
+	elog(LOG, "Lsm3: %lld tuples recovered in top index %s", (long long)n_recovered, RelationGetRelationName(top));
+
+	for (int i = 1; i < n_sub_indexes - 1; i++)
+		index_close(sub_indexes[i], AccessShareLock);
+	ExecDropSingleTupleTableSlot(slot);
+	FreeExecutorState(estate);
+	FreeAccessStrategy(strategy);
+	table_close(heap, AccessShareLock);
+}
+
+/*
+ * Check if unlogged top indexes were reset by crash recovery and restore them.
+ * Hot standby can not access unlogged indexes, so recovery is postponed until promotion.
+ */
+static void
+lsm3_recover_tops(Lsm3DictEntry* entry, Relation index)
+{
+	LOCKTAG tag;
+
+	if (RecoveryInProgress() || entry->top[0] == InvalidOid)
+		return;
+
+	lsm3_set_recovery_locktag(&tag, entry->base);
+	(void) LockAcquire(&tag, ExclusiveLock, false, false);
+	if (entry->recovery_pending)
+	{
+		Relation top[2];
+		bool reset = false;
+
+		for (int i = 0; i < 2; i++)
+		{
+			top[i] = index_open(entry->top[i], RowExclusiveLock);
+			reset |= lsm3_top_is_reset(top[i], false);
+		}
+		if (reset)
+			lsm3_recover_heap(entry, index, top[entry->active_index]);
+		/* Marks are cleared only after successful recovery, so failed recovery is repeated */
+		for (int i = 0; i < 2; i++)
+		{
+			(void) lsm3_top_is_reset(top[i], true);
+			index_close(top[i], RowExclusiveLock);
+		}
+		entry->recovery_pending = false;
+	}
+	LockRelease(&tag, ExclusiveLock, false);
+}
+
+/* Check that entry was not removed by DROP INDEX */
+static bool
+lsm3_entry_is_valid(Lsm3DictEntry* entry, Oid base)
+{
+	bool valid;
+	LWLockAcquire(Lsm3DictLock, LW_SHARED);
+	valid = hash_search(Lsm3Dict, &base, HASH_FIND, NULL) == entry;
+	LWLockRelease(Lsm3DictLock);
+	return valid;
+}
+
+/* Get owner of relation (InvalidOid if relation is dropped) */
+static Oid
+lsm3_get_owner(Oid relid)
+{
+	HeapTuple tuple = SearchSysCache1(RELOID, ObjectIdGetDatum(relid));
+	Oid owner = InvalidOid;
+
+	if (HeapTupleIsValid(tuple))
+	{
+		owner = ((Form_pg_class) GETSTRUCT(tuple))->relowner;
+		ReleaseSysCache(tuple);
+	}
+	return owner;
+}
+
+/* Merge top index into first level and then propagate overflown levels down to base index */
+static void
+lsm3_merge_entry(Lsm3DictEntry* entry, int merge_index)
+{
+	Oid base = entry->base;
+	int top_index_size = entry->top_index_size ? entry->top_index_size : Lsm3TopIndexSize;
+	uint64 level_capacity = top_index_size;
+	uint64 generation = 0;
+	bool completed = true;
+	Oid owner;
+	Oid save_userid;
+	int save_sec_context;
+
+	/* Drop old storage of sub-indexes recycled by previous merges which is not used any more */
+	StartTransactionCommand();
+	owner = lsm3_get_owner(base);
+	for (int i = 0; i < entry->n_levels + 2; i++)
+		lsm3_drop_garbage(entry, i);
+	CommitTransactionCommand();
+
+	/*
+	 * Worker is connected as bootstrap superuser, but functions of operator classes (and parallel merge workers)
+	 * are executed on behalf of index owner, as in VACUUM and ANALYZE.
+	 */
+	GetUserIdAndSecContext(&save_userid, &save_sec_context);
+	if (OidIsValid(owner))
+		SetUserIdAndSecContext(owner, save_sec_context | SECURITY_RESTRICTED_OPERATION);
+
+	if (entry->resume_level != 0)
+	{
+		/* Interrupted merge of intermediate level has to be completed before this level receives new tuples */
+		int level = entry->resume_level;
+		entry->resume_level = 0;
+		completed = lsm3_merge_level(entry, level, level + 1);
+	}
+	completed = completed && lsm3_merge_level(entry, merge_index, 2);
+	for (int i = 0; i < entry->n_levels && completed && !Lsm3Cancel && lsm3_entry_is_valid(entry, base); i++)
+	{
+		bool overflow;
+		level_capacity *= entry->level_ratio;
+		StartTransactionCommand();
+		overflow = (uint64)lsm3_get_index_size(entry->level[i])*(BLCKSZ/1024) > level_capacity;
+		CommitTransactionCommand();
+		if (!overflow)
+			break;
+		completed = lsm3_merge_level(entry, i + 2, i + 3);
+	}
+	SetUserIdAndSecContext(save_userid, save_sec_context);
+
+	LWLockAcquire(Lsm3DictLock, LW_SHARED);
+	if (hash_search(Lsm3Dict, &base, HASH_FIND, NULL) == entry)
+	{
+		SpinLockAcquire(&entry->spinlock);
+		if (completed)
+			entry->merge_in_progress = false; /* mark merge as completed */
+		else
+		{
+			/* Request is repeated by inserts or, after restart, by lsm3_get_shared_entry */
+			entry->start_merge = true;
+			entry->merge_request_seq = pg_atomic_read_u64(&Lsm3Pool->n_merges);
+		}
+		SpinLockRelease(&entry->spinlock);
+		if (completed)
+			generation = pg_atomic_add_fetch_u64(&entry->merge_generation, 1);
+	}
+	LWLockRelease(Lsm3DictLock);
+	ConditionVariableBroadcast(&Lsm3Pool->merge_cv);
+
+	if (generation != 0)
+	{
+		/* Notify subscribers: payload is OID of index and generation of completed merge */
+		StartTransactionCommand();
+		Async_Notify(LSM3_MERGE_CHANNEL, psprintf("%u %llu", base, (unsigned long long)generation));
+		CommitTransactionCommand();
+#if PG_VERSION_NUM<150000
+		/* Before Postgres 15 listeners are signaled from the main loop of backend, which is not executed by background worker */
+		ProcessCompletedNotifies();
+#endif
+	}
+}
+
+/*
+ * Priority of merge request: overflow of top index multiplied by read amplification
+ * (number of sub-indexes probed by lookup) plus number of merges started after the request,
+ * so that requests with low priority are not starved.
+ */
+static double
+lsm3_merge_priority(Lsm3DictEntry* entry, uint64 n_merges)
+{
+	int top_index_size = entry->top_index_size ? entry->top_index_size : Lsm3TopIndexSize;
+	double overflow = (double)(entry->merge_request_size ? entry->merge_request_size : top_index_size) / top_index_size;
+	int read_amplification = 3 + pg_popcount32(entry->nonempty_levels); /* two top indexes and base index */
+	return overflow * read_amplification + (double)(n_merges - entry->merge_request_seq);
+}
+
+/* Choose merge request with the highest priority in the database. Returns NULL if there are no pending requests */
+static Lsm3DictEntry*
+lsm3_choose_merge(Oid db_id, int* merge_index)
+{
+	Lsm3DictEntry* chosen = NULL;
+
+	LWLockAcquire(Lsm3DictLock, LW_SHARED);
+	while (true)
+	{
+		HASH_SEQ_STATUS status;
+		Lsm3DictEntry* entry;
+		uint64 n_merges = pg_atomic_read_u64(&Lsm3Pool->n_merges);
+		double max_priority = 0;
+		Lsm3DictEntry* best = NULL;
+
+		hash_seq_init(&status, Lsm3Dict);
+		while ((entry = (Lsm3DictEntry*)hash_seq_search(&status)) != NULL)
+		{
+			if (entry->db_id == db_id && entry->start_merge)
+			{
+				double priority = lsm3_merge_priority(entry, n_merges);
+				if (best == NULL || priority > max_priority)
+				{
+					best = entry;
+					max_priority = priority;
+				}
+			}
+		}
+		if (best == NULL)
+			break;
+
+		/* Request can be concurrently taken by other worker */
+		SpinLockAcquire(&best->spinlock);
+		if (best->start_merge)
+		{
+			*merge_index = 1 - best->active_index; /* at this moment active index should already by swapped */
+			best->start_merge = false;
+			chosen = best;
+		}
+		SpinLockRelease(&best->spinlock);
+		if (chosen != NULL)
+			break;
+	}
+	LWLockRelease(Lsm3DictLock);
+	return chosen;
+}
+
+/*
+ * Pass slot of idle worker to the database which has pending merge requests but is not served by any worker.
+ * Returns true if slot is passed and worker should exit.
+ */
+static bool
+lsm3_pass_slot(int slot_no, Oid db_id)
+{
+	HASH_SEQ_STATUS status;
+	Lsm3DictEntry* entry;
+	Oid target_db = InvalidOid;
+	bool served = false;
+	uint32 generation = 0;
+	TimestampTz now = GetCurrentTimestamp();
+
+	LWLockAcquire(Lsm3DictLock, LW_SHARED);
+	hash_seq_init(&status, Lsm3Dict);
+	while ((entry = (Lsm3DictEntry*)hash_seq_search(&status)) != NULL)
+	{
+		if (entry->start_merge && entry->db_id != db_id && !OidIsValid(target_db))
+			target_db = entry->db_id;
+	}
+	LWLockRelease(Lsm3DictLock);
+
+	if (!OidIsValid(target_db))
+		return false;
+
+	SpinLockAcquire(&Lsm3Pool->spinlock);
+	for (int i = 0; i < Lsm3MaxMergeWorkers; i++)
+	{
+		if (Lsm3Pool->slots[i].in_use && Lsm3Pool->slots[i].db_id == target_db)
+			served = true;
+	}
+	if (!served)
+		generation = lsm3_assign_slot(&Lsm3Pool->slots[slot_no], target_db, now);
+	SpinLockRelease(&Lsm3Pool->spinlock);
+
+	if (served)
+		return false;
+
+	lsm3_launch_merger(slot_no, target_db, generation);
+	return true;
+}
+
+/*
+ * Merge was interrupted by error of merge worker. Top index is still being merged, so merge request
+ * is repeated by inserts (or by backends waiting for merge completion), and waiting backends are woken up.
+ */
+static void
+lsm3_merge_failed(Oid base)
+{
+	Lsm3DictEntry* entry;
+
+	LWLockAcquire(Lsm3DictLock, LW_SHARED);
+	entry = (Lsm3DictEntry*)hash_search(Lsm3Dict, &base, HASH_FIND, NULL);
+	if (entry != NULL)
+	{
+		SpinLockAcquire(&entry->spinlock);
+		if (entry->merge_in_progress)
+		{
+			entry->start_merge = true;
+			entry->merge_request_seq = pg_atomic_read_u64(&Lsm3Pool->n_merges);
+			entry->merge_failures += 1;
+		}
+		SpinLockRelease(&entry->spinlock);
+	}
+	LWLockRelease(Lsm3DictLock);
+	ConditionVariableBroadcast(&Lsm3Pool->merge_cv);
+}
+
+/*
+ * Release slot of merge pool on worker exit.
+ * Transaction of failed merge is already aborted by ShutdownPostgres callback registered after this one.
+ */
+static void
+lsm3_merger_exit(int code, Datum arg)
+{
+	Lsm3MergerSlot* slot = &Lsm3Pool->slots[DatumGetInt32(arg)];
+	Oid base = InvalidOid;
+
+	SpinLockAcquire(&Lsm3Pool->spinlock);
+	if (slot->proc == MyProc) /* slot was not passed to other database */
+	{
+		base = slot->base;
+		slot->in_use = false;
+		slot->proc = NULL;
+		slot->base = InvalidOid;
+	}
+	SpinLockRelease(&Lsm3Pool->spinlock);
+
+	if (OidIsValid(base))
+		lsm3_merge_failed(base);
+}
+
+/* Main function of merge worker */
+void
+lsm3_merger_main(Datum arg)
+{
+	int slot_no = DatumGetInt32(arg);
+	Lsm3MergerSlot* slot = &Lsm3Pool->slots[slot_no];
+	Oid db_id;
+	uint32 generation;
+	bool assigned;
+
+	pqsignal(SIGINT,  lsm3_merge_cancel);
+	pqsignal(SIGQUIT, lsm3_merge_cancel);
+	pqsignal(SIGTERM, lsm3_merge_cancel);
+	pqsignal(SIGHUP,  SignalHandlerForConfigReload);
+
+	memcpy(&generation, MyBgworkerEntry->bgw_extra, sizeof(generation));
+	SpinLockAcquire(&Lsm3Pool->spinlock);
+	/* Slot can be reused if worker was started too late */
+	assigned = slot->in_use && slot->proc == NULL && slot->generation == generation;
+	if (assigned)
+		slot->proc = MyProc;
+	db_id = slot->db_id;
+	SpinLockRelease(&Lsm3Pool->spinlock);
+	if (!assigned)
+		return;
+
+	before_shmem_exit(lsm3_merger_exit, arg);
+
+	/* We're now ready to receive signals */
+	BackgroundWorkerUnblockSignals();
+
+	/* Worker is shared by all indexes of the database: merge switches to the owner of the merged index */
+	BackgroundWorkerInitializeConnectionByOid(db_id, InvalidOid, 0);
+
+	pgstat_report_appname("lsm3 merger");
+
+	while (!Lsm3Cancel)
+	{
+		int merge_index;
+		int wr;
+		Lsm3DictEntry* entry;
+
+		/* Worker is long-lived, so it has to reload configuration (merge GUCs have PGC_SIGHUP context) */
+		if (ConfigReloadPending)
+		{
+			ConfigReloadPending = false;
+			ProcessConfigFile(PGC_SIGHUP);
+		}
+		entry = lsm3_choose_merge(db_id, &merge_index);
+
+		if (entry != NULL)
+		{
+			pg_atomic_fetch_add_u64(&Lsm3Pool->n_merges, 1);
+			SpinLockAcquire(&Lsm3Pool->spinlock);
+			slot->base = entry->base;
+			SpinLockRelease(&Lsm3Pool->spinlock);
+
+			lsm3_merge_entry(entry, merge_index);
+
+			SpinLockAcquire(&Lsm3Pool->spinlock);
+			slot->base = InvalidOid;
+			SpinLockRelease(&Lsm3Pool->spinlock);
+			continue;
+		}
+		/* No more work in this database: let other database use this slot */
+		if (lsm3_pass_slot(slot_no, db_id))
+			break;
+
+		pgstat_report_activity(STATE_IDLE, "waiting");
+		wr = WaitLatch(MyLatch, WL_LATCH_SET | WL_EXIT_ON_PM_DEATH, -1L, PG_WAIT_EXTENSION);
+
+		if ((wr & WL_POSTMASTER_DEATH) || Lsm3Cancel)
+		{
+			break;
+		}
+		ResetLatch(MyLatch);
+	}
+}
+
+/*
+ * Build sort support for comparison of index tuples.
+ * If abbreviate is true, then first key may use abbreviated keys (if supported by opclass) and
+ * should be compared using lsm3_compare_keys.
+ */
+static SortSupport
+lsm3_build_sortkeys(Relation index, bool abbreviate)
+{
+	int	keysz = IndexRelationGetNumberOfKeyAttributes(index);
+	SortSupport	sortKeys = (SortSupport) palloc0(keysz * sizeof(SortSupportData));
+	BTScanInsert inskey = _bt_mkscankey(index, NULL);
+	Oid          save_am = index->rd_rel->relam;
+
+	index->rd_rel->relam = BTREE_AM_OID;
+
+	for (int i = 0; i < keysz; i++)
+	{
+		SortSupport sortKey = &sortKeys[i];
+		ScanKey		scanKey = &inskey->scankeys[i];
+		int16		strategy;
+
+		sortKey->ssup_cxt = CurrentMemoryContext;
+		sortKey->ssup_collation = scanKey->sk_collation;
+		sortKey->ssup_nulls_first =
+			(scanKey->sk_flags & SK_BT_NULLS_FIRST) != 0;
+		sortKey->ssup_attno = scanKey->sk_attno;
+		sortKey->abbreviate = abbreviate && i == 0;
+
+		Assert(sortKey->ssup_attno != 0);
+
+		strategy = (scanKey->sk_flags & SK_BT_DESC) != 0 ?
+			BTGreaterStrategyNumber : BTLessStrategyNumber;
+
+		PrepareSortSupportFromIndexRel(index, strategy, sortKey);
+	}
+	index->rd_rel->relam = save_am;
+	return sortKeys;
+}
+
+/* Compare current tuple of index scan with index tuple */
+static int
+lsm3_compare_index_tuples(IndexScanDesc scan, IndexTuple itup, SortSupport sortKeys)
+{
+	int n_keys = IndexRelationGetNumberOfKeyAttributes(scan->indexRelation);
+
+	for (int i = 1; i <= n_keys; i++)
+	{
+		Datum	datum[2];
+		bool	isNull[2];
+		int 	result;
+
+		datum[0] = index_getattr(scan->xs_itup, i, scan->xs_itupdesc, &isNull[0]);
+		datum[1] = index_getattr(itup, i, scan->xs_itupdesc, &isNull[1]);
+		result = ApplySortComparator(datum[0], isNull[0],
+									 datum[1], isNull[1],
+									 &sortKeys[i - 1]);
+		if (result != 0)
+		{
+			return result;
+		}
+	}
+	return ItemPointerCompare(&scan->xs_heaptid, &itup->t_tid);
+}
+
+/*
+ * Lsm3 access methods implementation
+ */
+
+static IndexBuildResult *
+lsm3_build(Relation heap, Relation index, IndexInfo *indexInfo)
+{
+	bool found;
+	Lsm3DictEntry* entry;
+	bool equal_image = _bt_allequalimage(index, false);
+	LWLockAcquire(Lsm3DictLock, LW_EXCLUSIVE);
+	elog(LOG, "lsm3_build %s", index->rd_rel->relname.data);
+	entry = hash_search(Lsm3Dict, &RelationGetRelid(index), HASH_ENTER, &found); /* Setting Lsm3Entry indicates to utility hook that Lsm3 index was created */
+	if (!found)
+	{
+		lsm3_init_entry(entry, index, InvalidTransactionId, equal_image);
+		/* Top indexes will be created empty, so any tuple inserted in them will have XID not preceding this horizon */
+		entry->recovery_pending = false;
+		entry->top_horizon[0] = entry->top_horizon[1] = lsm3_get_oldest_xmin(NULL);
+	}
+	{
+		MemoryContext old_context = MemoryContextSwitchTo(TopMemoryContext);
+		Lsm3Entries = lappend(Lsm3Entries, entry);
+		MemoryContextSwitchTo(old_context);
+	}
+	entry->am_id = index->rd_rel->relam;
+	index->rd_rel->relam = BTREE_AM_OID;
+	LWLockRelease(Lsm3DictLock); /* Release lock set by lsm3_build */
+	return btbuild(heap, index, indexInfo);
+}
+
+/*
+ * Lock serializing uniqueness check and insertion of the same key by concurrent backends.
+ * Keys are identified by hash, so different keys can share the same lock: it is not a problem
+ * because the lock is held only for the time of check and insertion.
+ */
+#define LSM3_KEY_LOCK 4
+
+static void
+lsm3_set_key_locktag(LOCKTAG* tag, Oid base, uint64 hash)
+{
+	SET_LOCKTAG_ADVISORY(*tag, MyDatabaseId, base, (uint32)hash, LSM3_KEY_LOCK);
+}
+
+/* Uniqueness is not checked for keys containing NULLs unless index is declared with NULLS NOT DISTINCT */
+static bool
+lsm3_unique_check_needed(Relation index, bool* isnull)
+{
+	int nkeyatts = IndexRelationGetNumberOfKeyAttributes(index);
+#if PG_VERSION_NUM>=150000
+	if (index->rd_index->indnullsnotdistinct)
+		return true;
+#endif
+	for (int i = 0; i < nkeyatts; i++)
+	{
+		if (isnull[i])
+			return false;
+	}
+	return true;
+}
+
+/* Construct scan keys for equality lookup of inserted key */
+static void
+lsm3_build_unique_scankeys(Relation index, Datum* values, bool* isnull, ScanKey skey)
+{
+	int nkeyatts = IndexRelationGetNumberOfKeyAttributes(index);
+
+	for (int i = 0; i < nkeyatts; i++)
+	{
+		if (isnull[i])
+		{
+			ScanKeyEntryInitialize(&skey[i], SK_ISNULL | SK_SEARCHNULL, i + 1,
+								   InvalidStrategy, InvalidOid, index->rd_indcollation[i],
+								   InvalidOid, (Datum)0);
+		}
+		else
+		{
+			Oid eq_opr = get_opfamily_member(index->rd_opfamily[i],
+											 index->rd_opcintype[i],
+											 index->rd_opcintype[i],
+											 BTEqualStrategyNumber);
+			if (!OidIsValid(eq_opr))
+				elog(ERROR, "Lsm3: missing equality operator for column %d of index %s",
+					 i + 1, RelationGetRelationName(index));
+			ScanKeyEntryInitialize(&skey[i], 0, i + 1,
+								   BTEqualStrategyNumber, InvalidOid, index->rd_indcollation[i],
+								   get_opcode(eq_opr), values[i]);
+		}
+	}
+}
+
+/*
+ * Check that there is no live tuple with the same key in any of sub-indexes.
+ * All sub-indexes are locked before the check, so merger can not truncate merged index
+ * until the check is completed: tuple moved by merge is found either in source either in destination index.
+ * Returns XID of transaction we have to wait for before repeating the check or InvalidTransactionId.
+ * For UNIQUE_CHECK_PARTIAL *is_unique is set to false if potential conflict is found,
+ * otherwise conflict is reported as error.
+ */
+static TransactionId
+lsm3_check_unique(Relation rel, Lsm3DictEntry* entry, Datum* values, bool* isnull,
+				  ItemPointer ht_ctid, Relation heapRel, IndexUniqueCheck checkUnique,
+				  bool use_bloom, uint64 hash, bool* is_unique, uint32* speculative_token)
+{
+	int nkeyatts = IndexRelationGetNumberOfKeyAttributes(rel);
+	int n_indexes = entry->n_levels + 3;
+	int base = n_indexes - 1;
+	Relation indexes[LSM3_MAX_SUB_INDEXES];
+	ScanKeyData skey[INDEX_MAX_KEYS];
+	SnapshotData SnapshotDirty;
+	TransactionId xwait = InvalidTransactionId;
+	bool conflict = false;
+	bool done = false;
+
+	InitDirtySnapshot(SnapshotDirty);
+	lsm3_build_unique_scankeys(rel, values, isnull, skey);
+
+	for (int i = 0; i < base; i++)
+	{
+		Oid sub_index = lsm3_get_sub_index(entry, i);
+		indexes[i] = sub_index ? index_open(sub_index, AccessShareLock) : NULL;
+	}
+	indexes[base] = rel;
+
+	for (int i = 0; i < n_indexes && !done; i++)
+	{
+		IndexScanDesc scan;
+
+		if (indexes[i] == NULL)
+			continue;
+
+		if (use_bloom && i != base && entry->bloom_valid[i])
+		{
+			if (!lsm3_bloom_contains(entry, i, hash))
+			{
+				pg_atomic_fetch_add_u64(&entry->bloom_skips, 1);
+				continue;
+			}
+			pg_atomic_fetch_add_u64(&entry->bloom_hits, 1);
+		}
+		scan = btbeginscan(indexes[i], nkeyatts, 0);
+		scan->xs_snapshot = SnapshotAny; /* visibility is checked by fetching heap tuple */
+		btrescan(scan, skey, nkeyatts, NULL, 0);
+		while (btgettuple(scan, ForwardScanDirection))
+		{
+			ItemPointerData htid = scan->xs_heaptid;
+			bool all_dead = false;
+
+			/* Skip tuple which uniqueness is rechecked */
+			if (checkUnique == UNIQUE_CHECK_EXISTING && ItemPointerEquals(&htid, ht_ctid))
+				continue;
+
+			if (!table_index_fetch_tuple_check(heapRel, &htid, &SnapshotDirty, &all_dead))
+				continue;
+
+			done = true;
+			/* Deferred check: just report potential conflict */
+			if (checkUnique == UNIQUE_CHECK_PARTIAL)
+			{
+				*is_unique = false;
+				break;
+			}
+			/* Tuple is inserted or deleted by in-progress transaction: wait for its completion */
+			xwait = TransactionIdIsValid(SnapshotDirty.xmin) ? SnapshotDirty.xmin : SnapshotDirty.xmax;
+			if (TransactionIdIsValid(xwait))
+			{
+				*speculative_token = SnapshotDirty.speculativeToken;
+				break;
+			}
+			/* Definite conflict, unless inserted tuple is itself already dead */
+			htid = *ht_ctid;
+			conflict = table_index_fetch_tuple_check(heapRel, &htid, SnapshotSelf, NULL);
+			break;
+		}
+		btendscan(scan);
+	}
+
+	for (int i = 0; i < base; i++)
+	{
+		if (indexes[i])
+			index_close(indexes[i], AccessShareLock);
+	}
+
+	if (conflict)
+	{
+		char* key_desc = BuildIndexValueDescription(rel, values, isnull);
+		ereport(ERROR,
+				(errcode(ERRCODE_UNIQUE_VIOLATION),
+				 errmsg("duplicate key value violates unique constraint \"%s\"",
+						RelationGetRelationName(rel)),
+				 key_desc ? errdetail("Key %s already exists.", key_desc) : 0,
+				 errtableconstraint(heapRel, RelationGetRelationName(rel))));
+	}
+	return xwait;
+}
+
+/* Size of index tuple (including line pointer) which will be formed by B-Tree for inserted values */
+static Size
+lsm3_index_tuple_size(Relation index, Datum* values, bool* isnull)
+{
+	TupleDesc desc = RelationGetDescr(index);
+	bool hasnull = false;
+
+	for (int i = 0; i < desc->natts; i++)
+		hasnull |= isnull[i];
+
+	return MAXALIGN(IndexInfoFindDataOffset(hasnull ? INDEX_NULL_MASK : 0) + heap_compute_data_size(desc, values, isnull))
+		+ sizeof(ItemIdData);
+}
+
+/* Wait event reported while waiting merge completion */
+static uint32
+lsm3_merge_wait_event(void)
+{
+#if PG_VERSION_NUM>=170000
+	static uint32 wait_event = 0;
+	if (wait_event == 0)
+		wait_event = WaitEventExtensionNew("Lsm3MergeCompletion");
+	return wait_event;
+#else
+	return PG_WAIT_EXTENSION;
+#endif
+}
+
+/* Check whether some merge worker (maybe not started yet) serves database of the index */
+static bool
+lsm3_merge_is_served(Lsm3DictEntry* entry)
+{
+	bool served = false;
+	TimestampTz now = GetCurrentTimestamp();
+
+	SpinLockAcquire(&Lsm3Pool->spinlock);
+	for (int i = 0; i < Lsm3MaxMergeWorkers; i++)
+	{
+		Lsm3MergerSlot* slot = &Lsm3Pool->slots[i];
+		if (slot->in_use && slot->db_id == entry->db_id && !lsm3_slot_start_failed(slot, now))
+			served = true;
+	}
+	SpinLockRelease(&Lsm3Pool->spinlock);
+	return served;
+}
+
+/*
+ * Wait until merge of the index is completed.
+ * If database is not served by any merge worker, then pending request is rescheduled.
+ * Merge interrupted by error of merge worker (it is repeated later) or abandoned by terminated worker is not awaited.
+ */
+static void
+lsm3_wait_merge(Lsm3DictEntry* entry)
+{
+	uint32 failures = entry->merge_failures;
+
+	ConditionVariablePrepareToSleep(&Lsm3Pool->merge_cv);
+	while (entry->merge_in_progress)
+	{
+		if (entry->merge_failures != failures)
+		{
+			elog(WARNING, "Lsm3: merge of index %u was interrupted by error", entry->base);
+			break;
+		}
+		if (ConditionVariableTimedSleep(&Lsm3Pool->merge_cv, LSM3_MERGE_CHECK_INTERVAL, lsm3_merge_wait_event())
+			&& entry->merge_in_progress && !lsm3_merge_is_served(entry))
+		{
+			if (!entry->start_merge)
+			{
+				elog(WARNING, "Lsm3: merge of index %u is not served by merge worker", entry->base);
+				break;
+			}
+			lsm3_schedule_merge(entry->db_id);
+		}
+	}
+	ConditionVariableCancelSleep();
+}
+
+/*
+ * Inserter should not wait for merge completion if it holds locks which conflict with locks obtained by merger:
+ * merge lock held by participant of parallel scan and locks of table, levels and base index not weaker than
+ * ShareUpdateExclusiveLock (obtained by merger for appending and recycling). Locks obtained by DML, planner or COPY
+ * (AccessShareLock and RowExclusiveLock) do not block merge, and tops are not checked at all: they are locked by inserters.
+ */
+static bool
+lsm3_can_wait_merge(Lsm3DictEntry* entry)
+{
+	LOCKTAG tag;
+	Oid relids[LSM3_MAX_SUB_INDEXES];
+	int n_relids = 0;
+
+	lsm3_set_merge_locktag(&tag, entry->base);
+	if (Lsm3LockHeldByMe(&tag, ShareLock))
+		return false;
+	relids[n_relids++] = entry->heap;
+	for (int i = 2; i < entry->n_levels + 3; i++)
+		relids[n_relids++] = lsm3_get_sub_index(entry, i);
+	for (int i = 0; i < n_relids; i++)
+	{
+		SET_LOCKTAG_RELATION(tag, MyDatabaseId, relids[i]);
+		for (LOCKMODE mode = ShareUpdateExclusiveLock; mode <= AccessExclusiveLock; mode++)
+		{
+			if (Lsm3LockHeldByMe(&tag, mode))
+				return false;
+		}
+	}
+	return true;
+}
+
+/*
+ * Backpressure: if merger falls behind and active top index exceeds soft limit, then inserter is delayed
+ * (delay grows linearly up to lsm3.throttle_delay at hard limit). Inserter exceeded hard limit waits merge completion.
+ */
+static void
+lsm3_throttle(Lsm3DictEntry* entry, uint64 top_bytes)
+{
+	uint64 soft_limit = (uint64)Lsm3TopIndexSoftLimit*1024;
+	uint64 hard_limit = (uint64)Lsm3TopIndexHardLimit*1024;
+
+	if (hard_limit != 0 && top_bytes > hard_limit && lsm3_can_wait_merge(entry))
+	{
+		TimestampTz start = GetCurrentTimestamp();
+		long secs;
+		int usecs;
+
+		pg_atomic_fetch_add_u64(&entry->n_waits, 1);
+		lsm3_wait_merge(entry);
+		TimestampDifference(start, GetCurrentTimestamp(), &secs, &usecs);
+		pg_atomic_fetch_add_u64(&LSM3_BACKEND_STATS(entry)->wait_time, (uint64)secs*USECS_PER_SEC + usecs);
+	}
+	else if (soft_limit != 0 && top_bytes > soft_limit && Lsm3ThrottleDelay > 0)
+	{
+		double ratio = hard_limit > soft_limit ? Min((double)(top_bytes - soft_limit) / (hard_limit - soft_limit), 1.0) : 1.0;
+		long delay = (long)(Lsm3ThrottleDelay * ratio * 1000); /* microseconds */
+		if (delay > 0)
+		{
+			pg_atomic_fetch_add_u64(&entry->n_throttled, 1);
+			pg_atomic_fetch_add_u64(&LSM3_BACKEND_STATS(entry)->wait_time, delay);
+			/* Unlike pg_usleep, latch wait exits on postmaster death and is followed by processing of cancel and timeouts */
+			(void) WaitLatch(MyLatch, WL_TIMEOUT | WL_EXIT_ON_PM_DEATH, (delay + 999) / 1000, PG_WAIT_EXTENSION);
+			CHECK_FOR_INTERRUPTS();
+		}
+	}
+}
+
+/* Insert in active top index, on overflow swap active indexes and initiate merge to base index */
+static bool
+lsm3_insert_tuple(Relation rel, Datum *values, bool *isnull,
+			ItemPointer ht_ctid, Relation heapRel,
+			IndexUniqueCheck checkUnique,
+#if PG_VERSION_NUM>=140000
+			bool indexUnchanged,
+#endif
+			IndexInfo *indexInfo)
+{
+	Lsm3LocalEntry* local = lsm3_get_local_entry(rel);
+	Lsm3DictEntry* entry = local->entry;
+
+	int active_index;
+	uint64 n_merges; /* used to check if merge was initiated by somebody else */
+	Relation index;
+	Oid  save_am;
+	bool overflow;
+	bool schedule_merge = false;
+	int top_index_size = entry->top_index_size ? entry->top_index_size : Lsm3TopIndexSize;
+	uint64 top_bytes = 0;
+	TransactionId horizon = InvalidTransactionId;
+	bool is_initialized = true;
+	bool has_hash;
+	bool is_unique = true;
+	bool key_locked = false;
+	LOCKTAG key_lock;
+	uint64 hash = 0;
+	Size tuple_size = lsm3_index_tuple_size(rel, values, isnull);
+	Lsm3StatCounters* stats = LSM3_BACKEND_STATS(entry);
+
+	has_hash = entry->equal_image && lsm3_key_hash(rel, values, isnull, &hash);
+
+	if (checkUnique != UNIQUE_CHECK_NO && lsm3_unique_check_needed(rel, isnull))
 	{
-		MemoryContext old_context = MemoryContextSwitchTo(TopMemoryContext);
-		Lsm3Entries = lappend(Lsm3Entries, entry);
-		MemoryContextSwitchTo(old_context);
+		/* Keys which can not be hashed are serialized using single lock */
+		lsm3_set_key_locktag(&key_lock, RelationGetRelid(rel), has_hash ? hash : 0);
+		while (true)
+		{
+			TransactionId xwait;
+			uint32 speculative_token = 0;
+
+			LockAcquire(&key_lock, ExclusiveLock, false, false);
+			lsm3_accept_recycle(local);
+			xwait = lsm3_check_unique(rel, entry, values, isnull, ht_ctid, heapRel, checkUnique,
+									  has_hash && entry->bloom_enabled, hash, &is_unique, &speculative_token);
+			if (!TransactionIdIsValid(xwait))
+				break;
+			LockRelease(&key_lock, ExclusiveLock, false);
+			if (speculative_token)
+				SpeculativeInsertionWait(xwait, speculative_token);
+			else
+				XactLockTableWait(xwait, rel, ht_ctid, XLTW_InsertIndex);
+		}
+		if (checkUnique == UNIQUE_CHECK_EXISTING)
+		{
+			/* Tuple is already inserted: just recheck */
+			LockRelease(&key_lock, ExclusiveLock, false);
+			return is_unique;
+		}
+		/* Hold the lock until key is inserted: after it concurrent checks will find our tuple */
+		key_locked = true;
 	}
-	entry->am_id = index->rd_rel->relam;
+	else if (checkUnique == UNIQUE_CHECK_EXISTING)
+		return true;
+
+	/* Obtain current active index and increment access counter under spinlock */
+	SpinLockAcquire(&entry->spinlock);
+	active_index = entry->active_index;
+	if (entry->top[active_index])
+		entry->access_count[active_index] += 1;
+	else
+		is_initialized = false;
+	n_merges = entry->n_merges;
+	SpinLockRelease(&entry->spinlock);
+
+	pg_atomic_fetch_add_u64(&stats->inserts, 1);
+	pg_atomic_fetch_add_u64(&stats->inserted_bytes, tuple_size);
+
+	if (!is_initialized)
+	{
+		save_am = rel->rd_rel->relam;
+		rel->rd_rel->relam = BTREE_AM_OID;
+		btinsert(rel, values, isnull, ht_ctid, heapRel, UNIQUE_CHECK_NO,
+#if PG_VERSION_NUM>=140000
+			 indexUnchanged,
+#endif
+			 indexInfo);
+		rel->rd_rel->relam = save_am;
+		if (key_locked)
+			LockRelease(&key_lock, ExclusiveLock, false);
+		return is_unique;
+	}
+	if (entry->bloom_enabled && has_hash)
+	{
+		/* Register key in Bloom filter before it becomes visible in top index */
+		lsm3_bloom_add(entry, active_index, hash);
+	}
+	/* Do insert in top index (relation is cached till the end of transaction, so just lock it) */
+	LockRelationOid(entry->top[active_index], RowExclusiveLock);
+	index = lsm3_get_top(local, active_index);
+	save_am = index->rd_rel->relam;
 	index->rd_rel->relam = BTREE_AM_OID;
-	LWLockRelease(Lsm3DictLock); /* Release lock set by lsm3_build */
-	return btbuild(heap, index, indexInfo);
+	btinsert(index, values, isnull, ht_ctid, heapRel, UNIQUE_CHECK_NO, /* uniqueness is checked by lsm3_check_unique */
+#if PG_VERSION_NUM>=140000
+			 indexUnchanged,
+#endif
+			 indexInfo);
+	index->rd_rel->relam = save_am;
+	UnlockRelationOid(entry->top[active_index], RowExclusiveLock);
+	if (key_locked)
+		LockRelease(&key_lock, ExclusiveLock, false);
+
+	top_bytes = pg_atomic_add_fetch_u64(&entry->top_bytes[active_index], tuple_size);
+	overflow = !entry->merge_in_progress /* do not check for overflow if merge was already initiated */
+		&& top_bytes > (uint64)top_index_size*1024;
+	if (overflow && entry->unlogged_tops)
+		horizon = lsm3_get_oldest_xmin(NULL);
+
+	SpinLockAcquire(&entry->spinlock);
+	/* If merge was not initiated before by somebody else, then do it */
+	if (overflow && !entry->merge_in_progress && entry->n_merges == n_merges)
+	{
+		Assert(entry->active_index == active_index);
+		entry->merge_in_progress = true;
+		entry->active_index ^= 1; /* swap top indexes */
+		entry->top_horizon[entry->active_index] = horizon;
+		entry->n_merges += 1;
+		entry->merge_request_size = (int)Min(top_bytes/1024, INT_MAX);
+	}
+	Assert(entry->access_count[active_index] > 0);
+	entry->access_count[active_index] -= 1;
+	entry->n_inserts += 1;
+	if (entry->merge_in_progress)
+	{
+		/* If all inserts in previous active index are completed then we can start merge */
+		if (entry->active_index != active_index && entry->access_count[active_index] == 0)
+		{
+			entry->start_merge = true;
+			entry->merge_request_seq = pg_atomic_read_u64(&Lsm3Pool->n_merges);
+			schedule_merge = true;
+		}
+		/* Periodically repeat request if merge worker was not started */
+		else if (entry->start_merge && (entry->n_inserts % LSM3_CHECK_TOP_INDEX_SIZE_PERIOD) == 0)
+			schedule_merge = true;
+	}
+	SpinLockRelease(&entry->spinlock);
+
+	if (schedule_merge)
+		lsm3_schedule_merge(entry->db_id);
+
+	if (!overflow && (Lsm3TopIndexSoftLimit != 0 || Lsm3TopIndexHardLimit != 0))
+		lsm3_throttle(entry, top_bytes);
+	return is_unique;
+}
+
+/*
+ * Insert buffer.
+ * In this mode index tuples inserted by backend are accumulated in local buffer and inserted in top index
+ * in sorted order, so that subsequent inserts are likely to access the same leaf pages.
+ * Buffer is flushed when it is full, at the end of statement, before scan of the index, at start of subtransaction
+ * and at commit. Rollback of (sub)transaction discards the buffer.
+ * Buffered tuples belong to not yet committed transaction, so them are not visible to other backends anyway.
+ */
+typedef struct
+{
+	TupleDesc   desc;
+	SortSupport sortKeys;
+	int         nkeys;
+} Lsm3BufferSortContext;
+
+static int
+lsm3_compare_buffered_tuples(const void* a, const void* b, void* arg)
+{
+	Lsm3BufferSortContext* ctx = (Lsm3BufferSortContext*)arg;
+	IndexTuple t1 = *(IndexTuple*)a;
+	IndexTuple t2 = *(IndexTuple*)b;
+
+	for (int i = 0; i < ctx->nkeys; i++)
+	{
+		bool  null1, null2;
+		Datum d1 = index_getattr(t1, i + 1, ctx->desc, &null1);
+		Datum d2 = index_getattr(t2, i + 1, ctx->desc, &null2);
+		int   diff = ApplySortComparator(d1, null1, d2, null2, &ctx->sortKeys[i]);
+		if (diff != 0)
+			return diff;
+	}
+	return ItemPointerCompare(&t1->t_tid, &t2->t_tid);
+}
+
+/* Insert buffered tuples in top index */
+static void
+lsm3_flush_buffer(Lsm3LocalEntry* local)
+{
+	int n_tuples = local->buffer_used;
+	IndexTuple* tuples = local->buffer;
+	Relation index;
+	Relation heap;
+	TupleDesc desc;
+	Lsm3BufferSortContext ctx;
+	MemoryContext old_cxt;
+	Datum values[INDEX_MAX_KEYS];
+	bool  isnull[INDEX_MAX_KEYS];
+
+	if (n_tuples == 0)
+		return;
+
+	/* Reset buffer before insertion to make flush not reentrant */
+	local->buffer_used = 0;
+	local->buffer_size = 0;
+	Lsm3BufferedEntries = list_delete_ptr(Lsm3BufferedEntries, local);
+
+	index = index_open(local->base, RowExclusiveLock);
+	heap = table_open(index->rd_index->indrelid, RowExclusiveLock);
+	desc = RelationGetDescr(index);
+
+	old_cxt = MemoryContextSwitchTo(local->buffer_cxt);
+	ctx.desc = desc;
+	ctx.nkeys = IndexRelationGetNumberOfKeyAttributes(index);
+	ctx.sortKeys = lsm3_build_sortkeys(index, false);
+	qsort_arg(tuples, n_tuples, sizeof(IndexTuple), lsm3_compare_buffered_tuples, &ctx);
+	MemoryContextSwitchTo(old_cxt);
+
+	for (int i = 0; i < n_tuples; i++)
+	{
+		index_deform_tuple(tuples[i], desc, values, isnull);
+		lsm3_insert_tuple(index, values, isnull, &tuples[i]->t_tid, heap, UNIQUE_CHECK_NO,
+#if PG_VERSION_NUM>=140000
+						  false,
+#endif
+						  NULL);
+	}
+	MemoryContextReset(local->buffer_cxt);
+	local->buffer = NULL;
+	local->buffer_allocated = 0;
+
+	table_close(heap, RowExclusiveLock);
+	index_close(index, RowExclusiveLock);
+}
+
+/* Flush insert buffers of all indexes */
+static void
+lsm3_flush_buffers(void)
+{
+	while (Lsm3BufferedEntries != NIL)
+		lsm3_flush_buffer((Lsm3LocalEntry*)linitial(Lsm3BufferedEntries));
+}
+
+/* Flush insert buffer of the index before it is scanned */
+static void
+lsm3_flush_index_buffer(Oid base)
+{
+	if (Lsm3BufferedEntries != NIL)
+	{
+		Lsm3LocalEntry* local = (Lsm3LocalEntry*)hash_search(Lsm3LocalDict, &base, HASH_FIND, NULL);
+		if (local)
+			lsm3_flush_buffer(local);
+	}
+}
+
+/* Throw away buffered tuples of aborted transaction */
+static void
+lsm3_discard_buffers(void)
+{
+	ListCell* cell;
+	foreach (cell, Lsm3BufferedEntries)
+	{
+		Lsm3LocalEntry* local = (Lsm3LocalEntry*)lfirst(cell);
+		MemoryContextReset(local->buffer_cxt);
+		local->buffer = NULL;
+		local->buffer_used = 0;
+		local->buffer_allocated = 0;
+		local->buffer_size = 0;
+	}
+	list_free(Lsm3BufferedEntries);
+	Lsm3BufferedEntries = NIL;
+}
+
+/* Append index tuple to insert buffer */
+static void
+lsm3_buffer_insert(Lsm3LocalEntry* local, Relation index, Datum* values, bool* isnull, ItemPointer ht_ctid)
+{
+	MemoryContext old_cxt;
+	IndexTuple itup;
+
+	if (local->buffer_cxt == NULL)
+		local->buffer_cxt = AllocSetContextCreate(TopMemoryContext, "lsm3 insert buffer", ALLOCSET_DEFAULT_SIZES);
+
+	old_cxt = MemoryContextSwitchTo(local->buffer_cxt);
+	itup = index_form_tuple(RelationGetDescr(index), values, isnull);
+	itup->t_tid = *ht_ctid;
+	if (local->buffer_used == local->buffer_allocated)
+	{
+		local->buffer_allocated = local->buffer_allocated ? local->buffer_allocated*2 : 1024;
+		local->buffer = local->buffer
+			? (IndexTuple*)repalloc(local->buffer, local->buffer_allocated*sizeof(IndexTuple))
+			: (IndexTuple*)palloc(local->buffer_allocated*sizeof(IndexTuple));
+	}
+	local->buffer[local->buffer_used++] = itup;
+	local->buffer_size += IndexTupleSize(itup) + sizeof(IndexTuple);
+	MemoryContextSwitchTo(old_cxt);
+
+	if (local->buffer_used == 1)
+	{
+		old_cxt = MemoryContextSwitchTo(TopMemoryContext);
+		Lsm3BufferedEntries = lappend(Lsm3BufferedEntries, local);
+		MemoryContextSwitchTo(old_cxt);
+	}
+	if (local->buffer_size >= (Size)Lsm3InsertBufferSize*1024)
+		lsm3_flush_buffer(local);
+}
+
+static bool
+lsm3_insert(Relation rel, Datum *values, bool *isnull,
+			ItemPointer ht_ctid, Relation heapRel,
+			IndexUniqueCheck checkUnique,
+#if PG_VERSION_NUM>=140000
+			bool indexUnchanged,
+#endif
+			IndexInfo *indexInfo)
+{
+	/* Uniqueness check requires immediate insert */
+	if (Lsm3InsertBufferSize != 0 && checkUnique == UNIQUE_CHECK_NO)
+	{
+		Lsm3LocalEntry* local = lsm3_get_local_entry(rel);
+		if (local->entry->top[0] != InvalidOid) /* Lsm3 index is completely created */
+		{
+			lsm3_buffer_insert(local, rel, values, isnull, ht_ctid);
+			return false;
+		}
+	}
+	return lsm3_insert_tuple(rel, values, isnull, ht_ctid, heapRel, checkUnique,
+#if PG_VERSION_NUM>=140000
+							 indexUnchanged,
+#endif
+							 indexInfo);
+}
+
+static IndexScanDesc
+lsm3_beginscan(Relation rel, int nkeys, int norderbys)
+{
+	IndexScanDesc scan;
+	Lsm3ScanOpaque* so;
+	Lsm3LocalEntry* local;
+	int i;
+	int base;
+
+	/* no order by operators allowed */
+	Assert(norderbys == 0);
+
+	/* get the scan */
+	scan = RelationGetIndexScan(rel, nkeys, norderbys);
+	scan->xs_itupdesc = RelationGetDescr(rel);
+	so = (Lsm3ScanOpaque*)palloc(sizeof(Lsm3ScanOpaque));
+	local = lsm3_get_local_entry(rel);
+	if (local->entry->unlogged_tops && RecoveryInProgress())
+		ereport(ERROR,
+				(errcode(ERRCODE_FEATURE_NOT_SUPPORTED),
+				 errmsg("Lsm3 index \"%s\" with unlogged top indexes can not be scanned during recovery",
+						RelationGetRelationName(rel))));
+	lsm3_accept_recycle(local);
+	so->entry = local->entry;
+	so->sortKeys = lsm3_build_sortkeys(rel, true);
+	so->n_indexes = so->entry->n_levels + 3;
+	so->n_keys = IndexRelationGetNumberOfKeyAttributes(rel);
+	so->keys = (Datum*)palloc(so->n_indexes*so->n_keys*sizeof(Datum));
+	so->nulls = (bool*)palloc(so->n_indexes*so->n_keys*sizeof(bool));
+	so->dir = ForwardScanDirection;
+	ItemPointerSetInvalid(&so->last_tid);
+	base = so->n_indexes - 1;
+	for (i = 0; i < base; i++)
+	{
+		Oid sub_index = lsm3_get_sub_index(so->entry, i);
+		if (sub_index)
+		{
+			so->index[i] = index_open(sub_index, AccessShareLock);
+			so->relfilenode[i] = so->index[i]->rd_rel->relfilenode;
+			so->scan[i] = btbeginscan(so->index[i], nkeys, norderbys);
+		}
+		else
+		{
+			so->index[i] = NULL;
+			so->scan[i] = NULL;
+		}
+	}
+	so->index[base] = NULL; /* base index is opened by caller */
+	so->scan[base] = btbeginscan(rel, nkeys, norderbys);
+	for (i = 0; i < so->n_indexes; i++)
+	{
+		so->exhausted[i] = false;
+		if (so->scan[i])
+		{
+			so->eof[i] = false;
+			so->scan[i]->xs_want_itup = true;
+			so->scan[i]->parallel_scan = NULL;
+		}
+		else
+		{
+			so->eof[i] = true;
+		}
+	}
+	so->unique = rel->rd_options ? ((Lsm3Options*)rel->rd_options)->unique : false;
+	so->curr_index = -1;
+	so->use_bloom = false;
+	so->array_keys = false;
+	so->parallel_lock = false;
+	so->parallel_assigned = false;
+	scan->opaque = so;
+
+	return scan;
+}
+
+static void
+lsm3_rescan(IndexScanDesc scan, ScanKey scankey, int nscankeys,
+			ScanKey orderbys, int norderbys)
+{
+	Lsm3ScanOpaque* so = (Lsm3ScanOpaque*) scan->opaque;
+
+	/* Tuples inserted by this backend should be visible to the scan */
+	lsm3_flush_index_buffer(RelationGetRelid(scan->indexRelation));
+
+	so->curr_index = -1;
+	ItemPointerSetInvalid(&so->last_tid);
+	so->parallel_assigned = false;
+	so->array_keys = false;
+	for (int i = 0; i < nscankeys; i++)
+	{
+		if (scankey[i].sk_flags & SK_SEARCHARRAY)
+			so->array_keys = true;
+	}
+	so->use_bloom = so->entry->bloom_enabled
+		&& lsm3_bloom_scan_hash(scan->indexRelation, scankey, nscankeys, &so->bloom_hash);
+	for (int i = 0; i < so->n_indexes; i++)
+	{
+		if (so->scan[i])
+		{
+			btrescan(so->scan[i], scankey, nscankeys, orderbys, norderbys);
+			so->eof[i] = false;
+			so->exhausted[i] = false;
+		}
+	}
+}
+
+static void
+lsm3_endscan(IndexScanDesc scan)
+{
+	Lsm3ScanOpaque* so = (Lsm3ScanOpaque*) scan->opaque;
+
+	for (int i = 0; i < so->n_indexes; i++)
+	{
+		if (so->scan[i])
+		{
+			btendscan(so->scan[i]);
+			if (so->index[i])
+			{
+				index_close(so->index[i], AccessShareLock);
+			}
+		}
+	}
+	if (so->parallel_lock)
+	{
+		LOCKTAG tag;
+		lsm3_set_merge_locktag(&tag, RelationGetRelid(scan->indexRelation));
+		LockRelease(&tag, ShareLock, false);
+	}
+	pfree(so->keys);
+	pfree(so->nulls);
+	pfree(so);
+}
+
+
+static ParallelIndexScanDesc
+lsm3_base_parallel_scan(Lsm3ParallelScanDesc desc)
+{
+	return (ParallelIndexScanDesc)((char*)desc + MAXALIGN(sizeof(Lsm3ParallelScanDescData)));
+}
+
+static Size
+#if PG_VERSION_NUM>=170000
+lsm3_estimate_parallel_scan(int nkeys, int norderbys)
+#else
+lsm3_estimate_parallel_scan(void)
+#endif
+{
+	return MAXALIGN(sizeof(Lsm3ParallelScanDescData))
+		+ MAXALIGN(offsetof(ParallelIndexScanDescData, ps_snapshot_data))
+#if PG_VERSION_NUM>=170000
+		+ btestimateparallelscan(nkeys, norderbys);
+#else
+		+ btestimateparallelscan();
+#endif
+}
+
+static void
+lsm3_init_parallel_scan(void *target)
+{
+	Lsm3ParallelScanDesc desc = (Lsm3ParallelScanDesc)target;
+	ParallelIndexScanDesc base_scan = lsm3_base_parallel_scan(desc);
+
+	pg_atomic_init_u32(&desc->claimed, 0);
+	pg_atomic_init_u32(&desc->mode, LSM3_PARALLEL_UNDECIDED);
+
+	/* B-Tree locates its parallel scan state using offset from parallel scan descriptor */
+	memset(base_scan, 0, offsetof(ParallelIndexScanDescData, ps_snapshot_data));
+	base_scan->ps_offset = MAXALIGN(offsetof(ParallelIndexScanDescData, ps_snapshot_data));
+	btinitparallelscan(OffsetToPointer(base_scan, base_scan->ps_offset));
+}
+
+static void
+lsm3_parallel_rescan(IndexScanDesc scan)
+{
+	Lsm3ScanOpaque* so = (Lsm3ScanOpaque*) scan->opaque;
+	Lsm3ParallelScanDesc desc = (Lsm3ParallelScanDesc)OffsetToPointer(scan->parallel_scan, scan->parallel_scan->ps_offset);
+	IndexScanDesc base_scan = so->scan[so->n_indexes - 1];
+
+	pg_atomic_write_u32(&desc->claimed, 0);
+	pg_atomic_write_u32(&desc->mode, LSM3_PARALLEL_UNDECIDED);
+
+	base_scan->parallel_scan = lsm3_base_parallel_scan(desc);
+	btparallelrescan(base_scan);
+}
+
+/*
+ * Try to obtain lock preventing merge while base index is scanned in parallel.
+ * Lock is held by participant until the end of its scan.
+ */
+static bool
+lsm3_parallel_lock(IndexScanDesc scan)
+{
+	Lsm3ScanOpaque* so = (Lsm3ScanOpaque*) scan->opaque;
+
+	if (!so->parallel_lock)
+	{
+		LOCKTAG tag;
+		lsm3_set_merge_locktag(&tag, RelationGetRelid(scan->indexRelation));
+		so->parallel_lock = LockAcquire(&tag, ShareLock, false, true) != LOCKACQUIRE_NOT_AVAIL;
+	}
+	return so->parallel_lock;
 }
 
 /*
- * Grab previously release self locks (to let merger to proceed).
+ * Choose sub-indexes scanned by this participant of parallel scan:
+ * first participant scans top and level indexes and all participants scan base index in parallel.
+ * If merge is in progress, then all sub-indexes are scanned by first participant.
+ * Participant which has not obtained merge lock or starts before first participant has made its choice
+ * does not take part in the scan.
  */
 static void
-lsm3_reacquire_locks(void)
+lsm3_parallel_assign(IndexScanDesc scan)
 {
-	if (Lsm3ReleasedLocks)
+	Lsm3ScanOpaque* so = (Lsm3ScanOpaque*) scan->opaque;
+	Lsm3ParallelScanDesc desc = (Lsm3ParallelScanDesc)OffsetToPointer(scan->parallel_scan, scan->parallel_scan->ps_offset);
+	int base = so->n_indexes - 1;
+	uint32 expected = 0;
+	bool claimed = pg_atomic_compare_exchange_u32(&desc->claimed, &expected, 1);
+	uint32 mode;
+
+	if (claimed)
+	{
+		mode = lsm3_parallel_lock(scan) ? LSM3_PARALLEL_BASE : LSM3_PARALLEL_SERIAL;
+		pg_atomic_write_u32(&desc->mode, mode);
+	}
+	else
 	{
-		ListCell* cell;
-		foreach (cell, Lsm3ReleasedLocks)
+		for (int i = 0; i < base; i++)
 		{
-			Oid indexOid = lfirst_oid(cell);
-			LockRelationOid(indexOid, RowExclusiveLock);
+			so->eof[i] = true;
 		}
-		list_free(Lsm3ReleasedLocks);
-		Lsm3ReleasedLocks = NULL;
+		mode = pg_atomic_read_u32(&desc->mode);
+		if (mode == LSM3_PARALLEL_BASE && !lsm3_parallel_lock(scan))
+			mode = LSM3_PARALLEL_UNDECIDED;
 	}
+	if (mode != LSM3_PARALLEL_BASE)
+	{
+		so->scan[base]->parallel_scan = NULL;
+		if (!claimed)
+		{
+			so->eof[base] = true;
+		}
+	}
+	else
+	{
+		so->scan[base]->parallel_scan = lsm3_base_parallel_scan(desc);
+	}
+	so->parallel_assigned = true;
 }
 
-/* Insert in active top index, on overflow swap active indexes and initiate merge to base index */
-static bool
-lsm3_insert(Relation rel, Datum *values, bool *isnull,
-			ItemPointer ht_ctid, Relation heapRel,
-			IndexUniqueCheck checkUnique,
-#if PG_VERSION_NUM>=140000
-			bool indexUnchanged,
-#endif
-			IndexInfo *indexInfo)
+/* Extract key attributes of current tuple of sub-scan */
+static void
+lsm3_cache_keys(Lsm3ScanOpaque* so, int i)
 {
-	Lsm3DictEntry* entry = lsm3_get_entry(rel);
+	IndexScanDesc sub = so->scan[i];
+	Datum* keys = &so->keys[i*so->n_keys];
+	bool* nulls = &so->nulls[i*so->n_keys];
 
-	int active_index;
-	uint64 n_merges; /* used to check if merge was initiated by somebody else */
-	Relation index;
-	Oid  save_am;
-	bool overflow;
-	int top_index_size = entry->top_index_size ? entry->top_index_size : Lsm3TopIndexSize;
-	bool is_initialized = true;
+	for (int j = 0; j < so->n_keys; j++)
+	{
+		keys[j] = index_getattr(sub->xs_itup, j + 1, sub->xs_itupdesc, &nulls[j]);
+	}
+	if (so->sortKeys[0].abbrev_converter && !nulls[0])
+	{
+		so->abbrev[i] = so->sortKeys[0].abbrev_converter(keys[0], &so->sortKeys[0]);
+	}
+}
 
-	/* Obtain current active index and increment access counter under spinlock */
-	SpinLockAcquire(&entry->spinlock);
-	active_index = entry->active_index;
-	if (entry->top[active_index])
-		entry->access_count[active_index] += 1;
+/*
+ * Compare current tuples of two sub-scans in scan direction using cached keys.
+ * Sub-scan which reached end of index is greater than any other.
+ */
+static int
+lsm3_merge_compare(Lsm3ScanOpaque* so, int a, int b)
+{
+	Datum* keys_a = &so->keys[a*so->n_keys];
+	Datum* keys_b = &so->keys[b*so->n_keys];
+	bool* nulls_a = &so->nulls[a*so->n_keys];
+	bool* nulls_b = &so->nulls[b*so->n_keys];
+	SortSupport sortKey = &so->sortKeys[0];
+	int result;
+
+	if (so->eof[a] || so->eof[b])
+	{
+		return (int)so->eof[a] - (int)so->eof[b];
+	}
+	if (sortKey->abbrev_converter)
+	{
+		result = ApplySortComparator(so->abbrev[a], nulls_a[0], so->abbrev[b], nulls_b[0], sortKey);
+		if (result == 0)
+		{
+			result = ApplySortAbbrevFullComparator(keys_a[0], nulls_a[0], keys_b[0], nulls_b[0], sortKey);
+		}
+	}
 	else
-		is_initialized = false;
-	n_merges = entry->n_merges;
-	SpinLockRelease(&entry->spinlock);
+	{
+		result = ApplySortComparator(keys_a[0], nulls_a[0], keys_b[0], nulls_b[0], sortKey);
+	}
+	for (int j = 1; result == 0 && j < so->n_keys; j++)
+	{
+		result = ApplySortComparator(keys_a[j], nulls_a[j], keys_b[j], nulls_b[j], &so->sortKeys[j]);
+	}
+	if (result == 0)
+	{
+		result = ItemPointerCompare(&so->scan[a]->xs_heaptid, &so->scan[b]->xs_heaptid);
+	}
+	return ScanDirectionIsForward(so->dir) ? result : -result;
+}
 
-	if (!is_initialized)
+/* Build subtree of loser tree and return its winner */
+static int
+lsm3_build_tree(Lsm3ScanOpaque* so, int node)
+{
+	int left;
+	int right;
+
+	if (node >= so->n_indexes)
 	{
-		bool res;
-		save_am = rel->rd_rel->relam;
-		rel->rd_rel->relam = BTREE_AM_OID;
-		res = btinsert(rel, values, isnull, ht_ctid, heapRel, checkUnique,
-#if PG_VERSION_NUM>=140000
-			 indexUnchanged,
-#endif
-			 indexInfo);
-		rel->rd_rel->relam = save_am;
-		return res;
+		return node - so->n_indexes; /* leaf */
 	}
-	/* Do insert in top index */
-	index = index_open(entry->top[active_index], RowExclusiveLock);
-	index->rd_rel->relam = BTREE_AM_OID;
-	save_am = index->rd_rel->relam;
-	btinsert(index, values, isnull, ht_ctid, heapRel, checkUnique,
-#if PG_VERSION_NUM>=140000
-			 indexUnchanged,
-#endif
-			 indexInfo);
-	index_close(index, RowExclusiveLock);
-	index->rd_rel->relam = save_am;
+	left = lsm3_build_tree(so, node*2);
+	right = lsm3_build_tree(so, node*2 + 1);
+	if (lsm3_merge_compare(so, right, left) < 0)
+	{
+		so->tree[node] = left;
+		return right;
+	}
+	else
+	{
+		so->tree[node] = right;
+		return left;
+	}
+}
 
-	overflow = !entry->merge_in_progress /* do not check for overflow if merge was already initiated */
- 		&& (entry->n_inserts % LSM3_CHECK_TOP_INDEX_SIZE_PERIOD) == 0 /* perform check only each N-th insert  */
-		&& RelationGetNumberOfBlocks(index)*(BLCKSZ/1024) > top_index_size;
+/* Restore loser tree after advance of the winner: requires one comparison per tree level */
+static void
+lsm3_replay_tree(Lsm3ScanOpaque* so)
+{
+	int winner = so->tree[0];
 
-	SpinLockAcquire(&entry->spinlock);
-	/* If merge was not initiated before by somebody else, then do it */
-	if (overflow && !entry->merge_in_progress && entry->n_merges == n_merges)
+	for (int node = (winner + so->n_indexes) / 2; node > 0; node /= 2)
 	{
-		Assert(entry->active_index == active_index);
-		entry->merge_in_progress = true;
-		entry->active_index ^= 1; /* swap top indexes */
-		entry->n_merges += 1;
+		if (lsm3_merge_compare(so, so->tree[node], winner) < 0)
+		{
+			int loser = winner;
+			winner = so->tree[node];
+			so->tree[node] = loser;
+		}
 	}
-	Assert(entry->access_count[active_index] > 0);
-	entry->access_count[active_index] -= 1;
-	entry->n_inserts += 1;
-	if (entry->merge_in_progress)
+	so->tree[0] = winner;
+}
+
+/* Move sub-scan to the next tuple */
+static void
+lsm3_advance(Lsm3ScanOpaque* so, int i, ScanDirection dir)
+{
+	so->eof[i] = !btgettuple(so->scan[i], dir);
+	so->exhausted[i] = so->eof[i];
+	if (!so->eof[i])
 	{
-		LOCKTAG		tag;
-		SET_LOCKTAG_RELATION(tag,
-							 MyDatabaseId,
-							 entry->top[1-active_index]);
-		/* Holding lock on non-ative index prevent merger bgworker from truncation this index */
-		if (LockHeldByMe(&tag, RowExclusiveLock))
-		{
-			/* Copy locks all indexes and hold this locks until end of copy.
-			 * We can not just release lock, because otherwise CopyFrom produces
-			 * "you don't own a lock of type" warning.
-			 * So just try to periodically release this lock and let merger grab it.
-			 */
-			if (!Lsm3InsideCopy ||
-				(entry->n_inserts % LSM3_CHECK_TOP_INDEX_SIZE_PERIOD) == 0) /* release lock only each N-th insert  */
+		lsm3_cache_keys(so, i);
+	}
+}
 
+/* Start sub-scans and build loser tree */
+static void
+lsm3_start_scan(IndexScanDesc scan, ScanDirection dir)
+{
+	Lsm3ScanOpaque* so = (Lsm3ScanOpaque*) scan->opaque;
+	int n_indexes = so->n_indexes;
+	/* We start with active top index, then merging index, then intermediate levels and last of all: largest base index */
+	int try_index_order[LSM3_MAX_SUB_INDEXES];
+	Lsm3StatCounters* stats = LSM3_BACKEND_STATS(so->entry);
+
+	pg_atomic_fetch_add_u64(&stats->scans, 1);
+	try_index_order[0] = so->entry->active_index;
+	try_index_order[1] = 1 - so->entry->active_index;
+	for (int j = 2; j < n_indexes; j++)
+	{
+		try_index_order[j] = j;
+	}
+
+	for (int j = 0; j < n_indexes; j++)
+	{
+		int i = try_index_order[j];
+		bool bloom_hit = false;
+
+		if (so->scan[i] == NULL || so->eof[i])
+		{
+			continue;
+		}
+		so->scan[i]->xs_snapshot = scan->xs_snapshot;
+		if (so->use_bloom && i < n_indexes - 1 && so->entry->bloom_valid[i])
+		{
+			/* Equality lookup: skip sub-index which definitely doesn't contain searched key */
+			if (!lsm3_bloom_contains(so->entry, i, so->bloom_hash))
 			{
-				LockRelease(&tag, RowExclusiveLock, false);
-				Lsm3ReleasedLocks = lappend_oid(Lsm3ReleasedLocks, entry->top[1-active_index]);
+				pg_atomic_fetch_add_u64(&so->entry->bloom_skips, 1);
+				so->eof[i] = true;
+				continue;
 			}
+			pg_atomic_fetch_add_u64(&so->entry->bloom_hits, 1);
+			bloom_hit = true;
 		}
-
-		/* If all inserts in previous active index are completed then we can start merge */
-		if (entry->active_index != active_index && entry->access_count[active_index] == 0)
+		/*
+		 * B-Tree scan is started and advanced using btgettuple, which also iterates through elements of array keys.
+		 * All sub-indexes are traversed for array elements in the same order, so merged output remains ordered.
+		 */
+		pg_atomic_fetch_add_u64(&stats->probes[i], 1);
+		lsm3_advance(so, i, dir);
+		if (so->eof[i] && bloom_hit)
 		{
-			entry->start_merge = true;
-			if (entry->merger == NULL) /* lazy start of bgworker */
+			pg_atomic_fetch_add_u64(&so->entry->bloom_false_positives, 1);
+		}
+		if (!so->eof[i] && so->unique && scan->numberOfKeys == scan->indexRelation->rd_index->indnkeyatts
+			&& !so->array_keys /* we have to locate all keys of array */
+			&& !scan->parallel_scan) /* key may be located by other participant */
+		{
+			/* If index is marked as unique and we perform lookup using all index keys,
+			 * then we can stop after locating first occurrence.
+			 * If make it possible to avoid lookups of all remaining indexes.
+			 */
+			elog(DEBUG1, "Lsm3: lookup %d indexes", j+1);
+			pg_atomic_fetch_add_u64(&stats->early_exits, 1);
+			while (++j < n_indexes) /* prevent search of all remanining indexes */
 			{
-				lsm3_launch_bgworker(entry);
+				so->eof[try_index_order[j]] = true;
 			}
-			SetLatch(&entry->merger->procLatch);
+			break;
 		}
 	}
-	SpinLockRelease(&entry->spinlock);
+	so->dir = dir;
+	so->tree[0] = lsm3_build_tree(so, 1);
+}
 
-	/* We have to require released locks because othervise CopyFrom will produce warning */
-	if (Lsm3InsideCopy && Lsm3ReleasedLocks)
+/*
+ * Relcache entry of sub-index is switched to new storage if invalidation of recycled sub-index is accepted by this backend
+ * while scan is in progress (for example by cursor fetches interleaved with other statements). Positions of sub-scan
+ * are not valid for new storage, so scan can not be continued.
+ */
+static void
+lsm3_check_storage(Lsm3ScanOpaque* so)
+{
+	for (int i = 0; i < so->n_indexes - 1; i++)
 	{
-		pg_usleep(1); /* give merge thread a chance to grab the lock before we require it */
-		lsm3_reacquire_locks();
+		if (so->index[i] && so->index[i]->rd_rel->relfilenode != so->relfilenode[i])
+			ereport(ERROR,
+					(errcode(ERRCODE_T_R_SERIALIZATION_FAILURE),
+					 errmsg("could not continue scan of index \"%s\" because it was recycled by concurrent merge",
+							RelationGetRelationName(so->index[i]))));
 	}
-	return false;
 }
 
-static IndexScanDesc
-lsm3_beginscan(Relation rel, int nkeys, int norderbys)
+/*
+ * Merge ordered streams of sub-scans using loser tree.
+ * Keys of current tuples of sub-scans are extracted once, when sub-scan is advanced,
+ * and each advance requires just log2(n_indexes) comparisons.
+ */
+static bool
+lsm3_gettuple(IndexScanDesc scan, ScanDirection dir)
 {
-	IndexScanDesc scan;
-	Lsm3ScanOpaque* so;
-	int i;
+	Lsm3ScanOpaque* so = (Lsm3ScanOpaque*) scan->opaque;
+	int curr = so->curr_index;
+	int winner;
 
-	/* no order by operators allowed */
-	Assert(norderbys == 0);
+	/* btree indexes are never lossy */
+	scan->xs_recheck = false;
+	lsm3_check_storage(so);
 
-	/* get the scan */
-	scan = RelationGetIndexScan(rel, nkeys, norderbys);
-	scan->xs_itupdesc = RelationGetDescr(rel);
-	so = (Lsm3ScanOpaque*)palloc(sizeof(Lsm3ScanOpaque));
-	so->entry = lsm3_get_entry(rel);
-	so->sortKeys = lsm3_build_sortkeys(rel);
-	for (i = 0; i < 2; i++)
+	if (scan->parallel_scan && !so->parallel_assigned)
 	{
-		if (so->entry->top[i])
+		lsm3_parallel_assign(scan);
+	}
+
+	if (curr < 0)
+	{
+		lsm3_start_scan(scan, dir);
+	}
+	else
+	{
+		if (dir != so->dir)
 		{
-			so->top_index[i] = index_open(so->entry->top[i], AccessShareLock);
-			so->scan[i] = btbeginscan(so->top_index[i], nkeys, norderbys);
+			/*
+			 * Current tuples of sub-scans (except the lazily advanced current one) are not returned yet,
+			 * so all sub-scans are moved one step in the new direction. Exhausted B-Tree scan is restarted
+			 * by btgettuple from the opposite end of index.
+			 */
+			for (int i = 0; i < so->n_indexes; i++)
+			{
+				if (so->scan[i] && (!so->eof[i] || so->exhausted[i]))
+				{
+					so->scan[i]->xs_snapshot = scan->xs_snapshot;
+					lsm3_advance(so, i, dir);
+				}
+			}
+			so->dir = dir;
+			so->tree[0] = lsm3_build_tree(so, 1);
 		}
 		else
 		{
-			so->top_index[i] = NULL;
-			so->scan[i] = NULL;
+			if (!so->eof[curr]) /* lazy advance of current index */
+			{
+				so->scan[curr]->xs_snapshot = scan->xs_snapshot;
+				lsm3_advance(so, curr, dir);
+			}
+			lsm3_replay_tree(so);
+		}
+		/*
+		 * Duplicate: it can happen during merge when same tid is present in two adjacent levels.
+		 * Index entries referencing the same heap tuple have the same key, so them are adjacent in merged stream
+		 * and it is enough to compare TID with TID of the last returned tuple.
+		 */
+		while (!so->eof[so->tree[0]] && ItemPointerEquals(&so->scan[so->tree[0]]->xs_heaptid, &so->last_tid))
+		{
+			lsm3_advance(so, so->tree[0], dir);
+			lsm3_replay_tree(so);
 		}
 	}
-	so->scan[2] = btbeginscan(rel, nkeys, norderbys);
-	for (i = 0; i < 3; i++)
+	winner = so->tree[0];
+	so->curr_index = winner; /* will be advanced at next call of gettuple */
+
+	if (so->eof[winner]) /* all indexes are traversed */
+	{
+		return false;
+	}
+	scan->xs_heaptid = so->scan[winner]->xs_heaptid; /* copy TID */
+	if (scan->xs_want_itup)
+	{
+		scan->xs_itup = so->scan[winner]->xs_itup;
+	}
+	so->last_tid = scan->xs_heaptid;
+	return true;
+}
+
+static int64
+lsm3_getbitmap(IndexScanDesc scan, TIDBitmap *tbm)
+{
+	Lsm3ScanOpaque* so = (Lsm3ScanOpaque*)scan->opaque;
+	Lsm3StatCounters* stats = LSM3_BACKEND_STATS(so->entry);
+	int64 ntids = 0;
+
+	lsm3_check_storage(so);
+	pg_atomic_fetch_add_u64(&stats->scans, 1);
+	for (int i = 0; i < so->n_indexes; i++)
 	{
 		if (so->scan[i])
 		{
-			so->eof[i] = false;
-			so->scan[i]->xs_want_itup = true;
-			so->scan[i]->parallel_scan = NULL;
+			if (so->use_bloom && i != so->n_indexes - 1 && so->entry->bloom_valid[i])
+			{
+				if (!lsm3_bloom_contains(so->entry, i, so->bloom_hash))
+				{
+					pg_atomic_fetch_add_u64(&so->entry->bloom_skips, 1);
+					continue;
+				}
+				pg_atomic_fetch_add_u64(&so->entry->bloom_hits, 1);
+			}
+			so->scan[i]->xs_snapshot = scan->xs_snapshot;
+			pg_atomic_fetch_add_u64(&stats->probes[i], 1);
+			ntids += btgetbitmap(so->scan[i], tbm);
 		}
 	}
-	so->unique = rel->rd_options ? ((Lsm3Options*)rel->rd_options)->unique : false;
-	so->curr_index = -1;
-	scan->opaque = so;
-
-	return scan;
+	return ntids;
 }
 
+/*
+ * Mark current position of merge scan: position of each sub-scan and state of loser tree.
+ * Current sub-scan is advanced lazily, so it is marked at the last returned tuple, as B-Tree scan is.
+ */
 static void
-lsm3_rescan(IndexScanDesc scan, ScanKey scankey, int nscankeys,
-			ScanKey orderbys, int norderbys)
+lsm3_markpos(IndexScanDesc scan)
 {
 	Lsm3ScanOpaque* so = (Lsm3ScanOpaque*) scan->opaque;
 
-	so->curr_index = -1;
-	for (int i = 0; i < 3; i++)
+	for (int i = 0; i < so->n_indexes; i++)
 	{
 		if (so->scan[i])
 		{
-			btrescan(so->scan[i], scankey, nscankeys, orderbys, norderbys);
-			so->eof[i] = false;
+			btmarkpos(so->scan[i]);
 		}
 	}
+	memcpy(so->mark_eof, so->eof, so->n_indexes*sizeof(bool));
+	memcpy(so->mark_exhausted, so->exhausted, so->n_indexes*sizeof(bool));
+	memcpy(so->mark_tree, so->tree, so->n_indexes*sizeof(int));
+	so->mark_curr_index = so->curr_index;
+	so->mark_dir = so->dir;
+	so->mark_last_tid = so->last_tid;
 }
 
+/* Make item at restored position of B-Tree sub-scan its current tuple */
 static void
-lsm3_endscan(IndexScanDesc scan)
+lsm3_restore_current_tuple(IndexScanDesc sub)
+{
+	BTScanOpaque bso = (BTScanOpaque) sub->opaque;
+	BTScanPosItem* item;
+
+	if (!BTScanPosIsValid(bso->currPos))
+	{
+		return;
+	}
+	item = &bso->currPos.items[bso->currPos.itemIndex];
+	sub->xs_heaptid = item->heapTid;
+	sub->xs_itup = (IndexTuple) (bso->currTuples + item->tupleOffset);
+}
+
+static void
+lsm3_restrpos(IndexScanDesc scan)
 {
 	Lsm3ScanOpaque* so = (Lsm3ScanOpaque*) scan->opaque;
 
-	for (int i = 0; i < 3; i++)
+	memcpy(so->eof, so->mark_eof, so->n_indexes*sizeof(bool));
+	memcpy(so->exhausted, so->mark_exhausted, so->n_indexes*sizeof(bool));
+	memcpy(so->tree, so->mark_tree, so->n_indexes*sizeof(int));
+	so->curr_index = so->mark_curr_index;
+	so->dir = so->mark_dir;
+	so->last_tid = so->mark_last_tid;
+
+	for (int i = 0; i < so->n_indexes; i++)
 	{
 		if (so->scan[i])
 		{
-			btendscan(so->scan[i]);
-			if (i < 2)
+			btrestrpos(so->scan[i]);
+			if (so->curr_index >= 0 && !so->eof[i])
 			{
-				index_close(so->top_index[i], AccessShareLock);
+				lsm3_restore_current_tuple(so->scan[i]);
+				lsm3_cache_keys(so, i);
 			}
 		}
 	}
-	pfree(so);
 }
 
+/*
+ * Planner statistic of top and level indexes. Top indexes are invisible for planner (them are marked as invalid),
+ * so their sizes are taken from Lsm3 control structure without accessing sub-indexes: size of top index is estimated
+ * by total size of inserted tuples and sizes of levels are cached by merge. Number of tuples is estimated using tuple
+ * density of the whole Lsm3 index, and height of B-Tree - assuming that inner pages have the same fanout.
+ */
+typedef struct
+{
+	int         n_subs;                          /* Number of non-empty top and level indexes */
+	int         sub[LSM3_MAX_SUB_INDEXES];       /* Numbers of sub-indexes in lookup order */
+	BlockNumber pages[LSM3_MAX_SUB_INDEXES];     /* Sizes of sub-indexes (including metapage) */
+	int         height[LSM3_MAX_SUB_INDEXES];    /* Heights of B-Trees */
+	double      tuples[LSM3_MAX_SUB_INDEXES];    /* Estimated number of tuples */
+	BlockNumber total_pages;                     /* Total size of sub-indexes */
+	double      total_tuples;                    /* Estimated number of tuples in all sub-indexes */
+} Lsm3SubIndexStat;
+
+static void
+lsm3_get_sub_index_stat(Lsm3DictEntry* entry, double density, Lsm3SubIndexStat* stat)
+{
+	int order[LSM3_MAX_SUB_INDEXES];
+	int n = 0;
+
+	/* Lookup order: active top index, merging top index and intermediate levels */
+	order[n++] = entry->active_index;
+	order[n++] = 1 - entry->active_index;
+	for (int i = 0; i < entry->n_levels; i++)
+	{
+		if (entry->nonempty_levels & (1 << i))
+			order[n++] = i + 2;
+	}
+	stat->n_subs = 0;
+	stat->total_pages = 0;
+	stat->total_tuples = 0;
+	for (int j = 0; j < n; j++)
+	{
+		int i = order[j];
+		BlockNumber pages = i < 2
+			? (BlockNumber)((pg_atomic_read_u64(&entry->top_bytes[i]) + BLCKSZ - 1) / BLCKSZ) + 1
+			: pg_atomic_read_u32(&entry->level_pages[i - 2]);
+
+		if (pages > 1) /* metapage only: index is empty */
+		{
+			int k = stat->n_subs++;
+			int height = 0;
+			double fanout = Max(density, 2.0);
+			for (double n_pages = pages - 1; n_pages > 1; n_pages = ceil(n_pages / fanout))
+				height += 1;
+			stat->sub[k] = i;
+			stat->pages[k] = pages;
+			stat->height[k] = height;
+			stat->tuples[k] = (pages - 1) * density;
+			stat->total_pages += pages;
+			stat->total_tuples += stat->tuples[k];
+		}
+	}
+}
 
+/* Check if index path has equality conditions for all key columns */
 static bool
-lsm3_gettuple(IndexScanDesc scan, ScanDirection dir)
+lsm3_is_point_lookup(IndexPath* path)
 {
-	Lsm3ScanOpaque* so = (Lsm3ScanOpaque*) scan->opaque;
-	int min = -1;
-	int curr = so->curr_index;
-	/* We start with active top index, then merging index and last of all: largest base index */
-	int try_index_order[3] = {so->entry->active_index, 1-so->entry->active_index, 2};
+	IndexOptInfo* index = path->indexinfo;
+	bool eq[INDEX_MAX_KEYS];
+	ListCell* lc;
+
+	memset(eq, 0, sizeof(eq));
+	foreach(lc, path->indexclauses)
+	{
+		IndexClause* iclause = lfirst_node(IndexClause, lc);
+		ListCell* lc2;
+
+		foreach(lc2, iclause->indexquals)
+		{
+			RestrictInfo* rinfo = lfirst_node(RestrictInfo, lc2);
+			if (IsA(rinfo->clause, OpExpr)
+				&& get_op_opfamily_strategy(((OpExpr*)rinfo->clause)->opno, index->opfamily[iclause->indexcol]) == BTEqualStrategyNumber)
+			{
+				eq[iclause->indexcol] = true;
+			}
+		}
+	}
+	for (int i = 0; i < index->nkeycolumns; i++)
+	{
+		if (!eq[i])
+			return false;
+	}
+	return true;
+}
+
+/*
+ * Estimate cost of Lsm3 index scan.
+ * B-Tree estimation is applied to the whole Lsm3 index (planner sizes of Lsm3 index include top and level indexes,
+ * see lsm3_get_relation_info), and then descents in each non-empty top and level index are added.
+ * Top indexes are small and frequently accessed, so their pages are assumed to be cached.
+ * Point lookup doesn't probe sub-indexes filtered by Bloom filters, and lookup in index marked as unique
+ * stops at the first sub-index containing the key.
+ */
+static void
+lsm3_costestimate(PlannerInfo *root, IndexPath *path, double loop_count,
+				  Cost *indexStartupCost, Cost *indexTotalCost,
+				  Selectivity *indexSelectivity, double *indexCorrelation,
+				  double *indexPages)
+{
+	IndexOptInfo* index = path->indexinfo;
+	Relation rel = index_open(index->indexoid, AccessShareLock);
+	Lsm3DictEntry* entry = lsm3_get_entry(rel);
+	bool unique = rel->rd_options ? ((Lsm3Options*)rel->rd_options)->unique : false;
+	bool point_lookup = lsm3_is_point_lookup(path);
+	double density = index->pages > 0 ? index->tuples / index->pages : 0;
+	double reach = 1.0; /* Probability that lookup reaches next sub-index */
+	Cost sub_cost = 0;
+	Lsm3SubIndexStat stat;
 
-	/* btree indexes are never lossy */
-	scan->xs_recheck = false;
+	index_close(rel, AccessShareLock);
 
-	if (curr >= 0) /* lazy advance of current index */
-	{
-		so->eof[curr] = !_bt_next(so->scan[curr], dir); /* move forward current index */
-	}
+	btcostestimate(root, path, loop_count, indexStartupCost, indexTotalCost,
+				   indexSelectivity, indexCorrelation, indexPages);
 
-	for (int j = 0; j < 3; j++)
+	lsm3_get_sub_index_stat(entry, density, &stat);
+	for (int j = 0; j < stat.n_subs; j++)
 	{
-		int i = try_index_order[j];
-		BTScanOpaque bto = (BTScanOpaque)so->scan[i]->opaque;
-		so->scan[i]->xs_snapshot = scan->xs_snapshot;
-		if (!so->eof[i] && !BTScanPosIsValid(bto->currPos))
+		int i = stat.sub[j];
+		double present = Min(1.0, *indexSelectivity * stat.tuples[j]); /* Probability that sub-index contains searched key */
+		double probe = 1.0; /* Probability that sub-index is probed */
+		Cost descent;
+
+		if (point_lookup && entry->bloom_enabled && entry->bloom_valid[i])
 		{
-			so->eof[i] = !_bt_first(so->scan[i], dir);
-			if (!so->eof[i] && so->unique && scan->numberOfKeys == scan->indexRelation->rd_index->indnkeyatts)
-			{
-				/* If index is marked as unique and we perform lookup using all index keys,
-				 * then we can stop after locating first occurrence.
-				 * If make it possible to avoid lookups of all three indexes.
-				 */
-				elog(DEBUG1, "Lsm3: lookup %d indexes", j+1);
-				while (++j < 3) /* prevent search of all remanining indexes */
-				{
-					so->eof[try_index_order[j]] = true;
-				}
-				min = i;
-				break;
-			}
+			/* False positive rate of Bloom filter */
+			double bits = (double)LSM3_BLOOM_WORDS * 32;
+			double fpr = pow(1.0 - exp(-LSM3_BLOOM_HASHES * stat.tuples[j] / bits), LSM3_BLOOM_HASHES);
+			probe = Min(1.0, present + fpr);
 		}
-		if (!so->eof[i])
+		/* Same descent cost as charged by btcostestimate */
+		descent = (ceil(log(stat.tuples[j] + 1) / log(2.0)) + (stat.height[j] + 1) * 50.0) * cpu_operator_cost;
+		if (i >= 2)
 		{
-			if (min < 0)
-			{
-				min = i;
-			}
-			else
-			{
-				int result = lsm3_compare_index_tuples(so->scan[i], so->scan[min], so->sortKeys);
-				if (result == 0)
-				{
-					/* Duplicate: it can happen during merge when same tid is both in top and base index */
-					so->eof[i] = !_bt_next(so->scan[i], dir); /* just skip one of entries */
-				}
-				else if ((result < 0) == ScanDirectionIsForward(dir))
-				{
-					min = i;
-				}
-			}
+			/* Level indexes are not expected to be cached: account first leaf page */
+			descent += random_page_cost * index_pages_fetched(loop_count, stat.pages[j], stat.pages[j], root) / loop_count;
 		}
+		sub_cost += reach * probe * descent;
+		if (unique && point_lookup)
+			reach *= 1.0 - present;
 	}
-	if (min < 0) /* all indexes are traversed */
-	{
-		return false;
-	}
-	else
+	if (reach < 1.0)
 	{
-		scan->xs_heaptid = so->scan[min]->xs_heaptid; /* copy TID */
-		if (scan->xs_want_itup) {
-			scan->xs_itup = so->scan[min]->xs_itup;
-		}
-		so->curr_index = min; /*will be advance at next call of gettuple */
-		return true;
+		/* Lookup reaches base index only if key was not found in top and level indexes */
+		*indexStartupCost *= reach;
+		*indexTotalCost *= reach;
 	}
+	*indexStartupCost += sub_cost;
+	*indexTotalCost += sub_cost;
 }
 
-static int64
-lsm3_getbitmap(IndexScanDesc scan, TIDBitmap *tbm)
+/*
+ * Planner sees only base index. Include top and level indexes in its size,
+ * so that selectivity of Lsm3 index is applied to all its tuples.
+ */
+static void
+lsm3_get_relation_info(PlannerInfo *root, Oid relationObjectId, bool inhparent, RelOptInfo *rel)
 {
-	Lsm3ScanOpaque* so = (Lsm3ScanOpaque*)scan->opaque;
-	int64 ntids = 0;
-	for (int i = 0; i < 3; i++)
+	ListCell* lc;
+
+	if (PreviousGetRelationInfoHook)
+		PreviousGetRelationInfoHook(root, relationObjectId, inhparent, rel);
+
+	foreach(lc, rel->indexlist)
 	{
-		if (so->scan[i])
+		IndexOptInfo* info = lfirst_node(IndexOptInfo, lc);
+		if ((void*)info->amcostestimate == (void*)lsm3_costestimate)
 		{
-			so->scan[i]->xs_snapshot = scan->xs_snapshot;
-			ntids += btgetbitmap(so->scan[i], tbm);
+			Relation index = index_open(info->indexoid, AccessShareLock);
+			Lsm3DictEntry* entry = lsm3_get_entry(index);
+			Lsm3SubIndexStat stat;
+
+			if (entry->unlogged_tops && RecoveryInProgress())
+			{
+				/* Unlogged top indexes are empty at hot standby: do not use index in queries */
+				index_close(index, AccessShareLock);
+				rel->indexlist = foreach_delete_current(rel->indexlist, lc);
+				continue;
+			}
+			lsm3_get_sub_index_stat(entry, info->pages > 0 ? info->tuples / info->pages : 0, &stat);
+			index_close(index, AccessShareLock);
+
+			info->pages += stat.total_pages;
+			if (info->indpred != NIL)
+			{
+				/* Size of partial index is estimated by size of base index, for other indexes it is number of heap tuples */
+				info->tuples += stat.total_tuples;
+			}
 		}
 	}
-	return ntids;
+}
+
+/* Vacuums of base index are counted to detect entries deleted while base index is rewritten (see lsm3_rewrite_base) */
+static IndexBulkDeleteResult*
+lsm3_bulkdelete(IndexVacuumInfo* info, IndexBulkDeleteResult* stats,
+				IndexBulkDeleteCallback callback, void* callback_state)
+{
+	pg_atomic_fetch_add_u64(&lsm3_get_entry(info->index)->n_vacuums, 1);
+	return btbulkdelete(info, stats, callback, callback_state);
 }
 
 Datum
@@ -780,15 +5461,15 @@ lsm3_handler(PG_FUNCTION_ARGS)
 	amroutine->amcanorder = true;
 	amroutine->amcanorderbyop = false;
 	amroutine->amcanbackward = true;
-	amroutine->amcanunique = false;   /* We can't check that index is unique without accessing base index */
+	amroutine->amcanunique = true;    /* Uniqueness is checked by lookup in all sub-indexes */
 	amroutine->amcanmulticol = true;
 	amroutine->amoptionalkey = true;
-	amroutine->amsearcharray = false; /* TODO: not sure if it will work correctly with merge */
+	amroutine->amsearcharray = true;
 	amroutine->amsearchnulls = true;
 	amroutine->amstorage = false;
 	amroutine->amclusterable = true;
 	amroutine->ampredlocks = true;
-	amroutine->amcanparallel = false; /* TODO: parallel scac is not supported yet */
+	amroutine->amcanparallel = true;
 	amroutine->amcaninclude = true;
 	amroutine->amusemaintenanceworkmem = false;
 	amroutine->amparallelvacuumoptions = 0;
@@ -797,10 +5478,10 @@ lsm3_handler(PG_FUNCTION_ARGS)
 	amroutine->ambuild = lsm3_build;
 	amroutine->ambuildempty = btbuildempty;
 	amroutine->aminsert = lsm3_insert;
-	amroutine->ambulkdelete = btbulkdelete;
+	amroutine->ambulkdelete = lsm3_bulkdelete;
 	amroutine->amvacuumcleanup = btvacuumcleanup;
 	amroutine->amcanreturn = btcanreturn;
-	amroutine->amcostestimate = btcostestimate;
+	amroutine->amcostestimate = lsm3_costestimate;
 	amroutine->amoptions = lsm3_options;
 	amroutine->amproperty = btproperty;
 	amroutine->ambuildphasename = btbuildphasename;
@@ -810,11 +5491,11 @@ lsm3_handler(PG_FUNCTION_ARGS)
 	amroutine->amgettuple = lsm3_gettuple;
 	amroutine->amgetbitmap = lsm3_getbitmap;
 	amroutine->amendscan = lsm3_endscan;
-	amroutine->ammarkpos = NULL;  /*  When do we need index_markpos? Can we live without it? */
-	amroutine->amrestrpos = NULL;
-	amroutine->amestimateparallelscan = NULL;
-	amroutine->aminitparallelscan = NULL;
-	amroutine->amparallelrescan = NULL;
+	amroutine->ammarkpos = lsm3_markpos;
+	amroutine->amrestrpos = lsm3_restrpos;
+	amroutine->amestimateparallelscan = lsm3_estimate_parallel_scan;
+	amroutine->aminitparallelscan = lsm3_init_parallel_scan;
+	amroutine->amparallelrescan = lsm3_parallel_rescan;
 
 	PG_RETURN_POINTER(amroutine);
 }
@@ -823,15 +5504,17 @@ lsm3_handler(PG_FUNCTION_ARGS)
  * Access methods for B-Tree wrapper: actually we aonly want to disable inserts.
  */
 
-/* We do not need to load data in top top index: just initialize index metadata */
-static IndexBuildResult *
-lsm3_build_empty(Relation heap, Relation index, IndexInfo *indexInfo)
+/* Write metapage of empty B-Tree to the specified fork */
+static void
+lsm3_write_metapage(Relation index, ForkNumber forknum, BTCycleId cycleid)
 {
 	Page		metapage;
+	bool		use_wal = index->rd_rel->relpersistence == RELPERSISTENCE_PERMANENT || forknum == INIT_FORKNUM;
 
 	/* Construct metapage. */
 	metapage = (Page) palloc(BLCKSZ);
 	_bt_initmetapage(metapage, BTREE_METAPAGE, 0, _bt_allequalimage(index, false));
+	((BTPageOpaque) PageGetSpecialPointer(metapage))->btpo_cycleid = cycleid;
 
 #if PG_VERSION_NUM>=150000
 	RelationGetSmgr(index);
@@ -844,29 +5527,47 @@ lsm3_build_empty(Relation heap, Relation index, IndexInfo *indexInfo)
 	 * be sufficient to guarantee that the file exists on disk, but recovery
 	 * itself might remove it while replaying, for example, an
 	 * XLOG_DBASE_CREATE or XLOG_TBLSPC_CREATE record.  Therefore, we need
-	 * this even when wal_level=minimal.
+	 * this even when wal_level=minimal. Main fork of unlogged index is not logged:
+	 * it is reset to the init fork after crash.
 	 */
 	PageSetChecksumInplace(metapage, BTREE_METAPAGE);
-	smgrextend(index->rd_smgr, MAIN_FORKNUM, BTREE_METAPAGE,
+	smgrextend(index->rd_smgr, forknum, BTREE_METAPAGE,
 			   (char *) metapage, true);
+	if (use_wal)
+	{
 #if PG_VERSION_NUM>=160000
-	log_newpage(&index->rd_smgr->smgr_rlocator.locator, MAIN_FORKNUM,
-				BTREE_METAPAGE, metapage, true);
+		log_newpage(&index->rd_smgr->smgr_rlocator.locator, forknum,
+					BTREE_METAPAGE, metapage, true);
 #else
-	log_newpage(&index->rd_smgr->smgr_rnode.node, MAIN_FORKNUM,
-				BTREE_METAPAGE, metapage, true);
+		log_newpage(&index->rd_smgr->smgr_rnode.node, forknum,
+					BTREE_METAPAGE, metapage, true);
 #endif
+	}
 	/*
 	 * An immediate sync is required even if we xlog'd the page, because the
 	 * write did not go through shared_buffers and therefore a concurrent
 	 * checkpoint may have moved the redo pointer past our xlog record.
 	 */
-	smgrimmedsync(index->rd_smgr, MAIN_FORKNUM);
+	smgrimmedsync(index->rd_smgr, forknum);
 	RelationCloseSmgr(index);
+	pfree(metapage);
+}
 
+/* We do not need to load data in top top index: just initialize index metadata */
+static IndexBuildResult *
+lsm3_build_empty(Relation heap, Relation index, IndexInfo *indexInfo)
+{
+	lsm3_write_metapage(index, MAIN_FORKNUM, 0);
 	return (IndexBuildResult *) palloc0(sizeof(IndexBuildResult));
 }
 
+/* Init fork of unlogged top index: its metapage is marked to detect reset of index after crash */
+static void
+lsm3_build_init_fork(Relation index)
+{
+	lsm3_write_metapage(index, INIT_FORKNUM, LSM3_INIT_FORK_MARK);
+}
+
 static bool
 lsm3_dummy_insert(Relation rel, Datum *values, bool *isnull,
 				  ItemPointer ht_ctid, Relation heapRel,
@@ -905,7 +5606,7 @@ lsm3_btree_wrapper(PG_FUNCTION_ARGS)
 	amroutine->amkeytype = InvalidOid;
 
 	amroutine->ambuild = lsm3_build_empty;
-	amroutine->ambuildempty = btbuildempty;
+	amroutine->ambuildempty = lsm3_build_init_fork;
 	amroutine->aminsert = lsm3_dummy_insert;
 	amroutine->ambulkdelete = btbulkdelete;
 	amroutine->amvacuumcleanup = btvacuumcleanup;
@@ -920,8 +5621,8 @@ lsm3_btree_wrapper(PG_FUNCTION_ARGS)
 	amroutine->amgettuple = btgettuple;
 	amroutine->amgetbitmap = btgetbitmap;
 	amroutine->amendscan = btendscan;
-	amroutine->ammarkpos = NULL;
-	amroutine->amrestrpos = NULL;
+	amroutine->ammarkpos = btmarkpos;
+	amroutine->amrestrpos = btrestrpos;
 	amroutine->amestimateparallelscan = NULL;
 	amroutine->aminitparallelscan = NULL;
 	amroutine->amparallelrescan = NULL;
@@ -929,6 +5630,38 @@ lsm3_btree_wrapper(PG_FUNCTION_ARGS)
 	PG_RETURN_POINTER(amroutine);
 }
 
+/*
+ * Old storage of recycled sub-index (see lsm3_recycle_index) and persistent state of the index are not known to Postgres,
+ * so them are dropped together with sub-index (by DROP INDEX, DROP TABLE or cascade drop).
+ */
+static void
+lsm3_object_access(ObjectAccessType access, Oid classId, Oid objectId, int subId, void *arg)
+{
+	if (PreviousObjectAccessHook)
+		PreviousObjectAccessHook(access, classId, objectId, subId, arg);
+
+	if (access == OAT_DROP && classId == RelationRelationId && subId == 0 && get_rel_relkind(objectId) == RELKIND_INDEX)
+	{
+		Relation index = index_open(objectId, NoLock); /* already locked by caller */
+		if (index->rd_indam->ambuild == lsm3_build_empty)
+		{
+			/* Old storages of recycled sub-index are dropped together with it */
+			List* items = lsm3_state_get(index, LSM3_STATE_GARBAGE);
+			ListCell* cell;
+			foreach (cell, items)
+			{
+				Lsm3StateItem* item = (Lsm3StateItem*)lfirst(cell);
+				elog(LOG, "Lsm3: drop old storage %u of index %s", item->relfilenode, RelationGetRelationName(index));
+				lsm3_drop_storage(index, item->relfilenode);
+			}
+			list_free_deep(items);
+		}
+		if (index->rd_indam->ambuild == lsm3_build_empty || index->rd_indam->ambuild == lsm3_build)
+			lsm3_state_remove(index, 0, InvalidOid);
+		index_close(index, NoLock);
+	}
+}
+
 /*
  * Utulity hook handling creation of Lsm3 indexes
  */
@@ -956,7 +5689,8 @@ lsm3_process_utility(PlannedStmt *plannedStmt,
 	ListCell* cell;
 
 	Lsm3Entries = NULL; /* Reset entry to check it after utility statement execution */
-	Lsm3InsideCopy = false;
+	lsm3_flush_buffers();
+	lsm3_close_tops(true); /* cached references prevent DDL from altering top indexes */
 	if (IsA(parseTree, DropStmt))
 	{
 		drop = (DropStmt*)parseTree;
@@ -973,13 +5707,15 @@ lsm3_process_utility(PlannedStmt *plannedStmt,
 					{
 						drop_objects = new_object_addresses();
 					}
-					for (int i = 0; i < 2; i++)
+					/* Drop top and intermediate level indexes together with base index */
+					for (int i = 0; i < entry->n_levels + 2; i++)
 					{
-						if (entry->top[i])
+						Oid sub_index = lsm3_get_sub_index(entry, i);
+						if (sub_index)
 						{
 							ObjectAddress obj;
 							obj.classId = RelationRelationId;
-							obj.objectId = entry->top[i];
+							obj.objectId = sub_index;
 							obj.objectSubId = 0;
 							add_exact_object_address(&obj, drop_objects);
 						}
@@ -990,10 +5726,6 @@ lsm3_process_utility(PlannedStmt *plannedStmt,
 			}
 		}
 	}
-	else if (IsA(parseTree, CopyStmt))
-	{
-		Lsm3InsideCopy = true;
-	}
 
 	(PreviousProcessUtilityHook ? PreviousProcessUtilityHook : standard_ProcessUtility)
 		(plannedStmt,
@@ -1007,27 +5739,49 @@ lsm3_process_utility(PlannedStmt *plannedStmt,
 		 destReceiver,
 		 completionTag);
 
+	lsm3_flush_buffers(); /* flush tuples inserted by COPY */
+
 	if (Lsm3Entries)
 	{
 		foreach (cell, Lsm3Entries)
 		{
 			Lsm3DictEntry* entry = (Lsm3DictEntry*)lfirst(cell);
 			Oid top_index[2];
+			Oid level_index[LSM3_MAX_LEVELS];
+			int n_levels = 0;
 			if (IsA(parseTree, IndexStmt)) /* This is Lsm3 creation statement */
 			{
 				IndexStmt* stmt = (IndexStmt*)parseTree;
 				char* originIndexName = stmt->idxname;
 				char* originAccessMethod = stmt->accessMethod;
 
-				for (int i = 0; i < 2; i++)
+				bool originUnique = stmt->unique;
+				bool originPrimary = stmt->primary;
+				bool originIsConstraint = stmt->isconstraint;
+#if PG_VERSION_NUM>=150000
+				bool originNullsNotDistinct = stmt->nulls_not_distinct;
+#endif
+				n_levels = entry->n_levels;
+				/* Uniqueness of Lsm3 index is enforced by Lsm3 itself, sub-indexes are not unique */
+				stmt->unique = false;
+				stmt->primary = false;
+				stmt->isconstraint = false;
+#if PG_VERSION_NUM>=150000
+				stmt->nulls_not_distinct = false;
+#endif
+				/* Intermediate levels are created in the same way as top indexes */
+				for (int i = 0; i < n_levels + 2; i++)
 				{
+					Oid sub_index;
 					if (stmt->concurrent)
 					{
 						PushActiveSnapshot(GetTransactionSnapshot());
 					}
 					stmt->accessMethod = "lsm3_btree_wrapper";
-					stmt->idxname = psprintf("%s_top%d", get_rel_name(entry->base), i);
-					top_index[i] = DefineIndex(entry->heap,
+					stmt->idxname = i < 2
+						? psprintf("%s_top%d", get_rel_name(entry->base), i)
+						: psprintf("%s_level%d", get_rel_name(entry->base), i - 2);
+					sub_index = DefineIndex(entry->heap,
 											   stmt,
 											   InvalidOid,
 											   InvalidOid,
@@ -1037,9 +5791,19 @@ lsm3_process_utility(PlannedStmt *plannedStmt,
 											   false,
 											   false,
 											   true).objectId;
+					if (i < 2)
+						top_index[i] = sub_index;
+					else
+						level_index[i - 2] = sub_index;
 				}
 				stmt->accessMethod = originAccessMethod;
 				stmt->idxname = originIndexName;
+				stmt->unique = originUnique;
+				stmt->primary = originPrimary;
+				stmt->isconstraint = originIsConstraint;
+#if PG_VERSION_NUM>=150000
+				stmt->nulls_not_distinct = originNullsNotDistinct;
+#endif
 			}
 			else
 			{
@@ -1056,6 +5820,14 @@ lsm3_process_utility(PlannedStmt *plannedStmt,
 						}
 					}
 				}
+				while (n_levels < LSM3_MAX_LEVELS)
+				{
+					char* levelidxname = psprintf("%s_level%d", get_rel_name(entry->base), n_levels);
+					Oid level = get_relname_relid(levelidxname, get_rel_namespace(entry->base));
+					if (level == InvalidOid)
+						break;
+					level_index[n_levels++] = level;
+				}
 			}
 			if (ActiveSnapshotSet())
 			{
@@ -1063,16 +5835,41 @@ lsm3_process_utility(PlannedStmt *plannedStmt,
 			}
 			CommitTransactionCommand();
 			StartTransactionCommand();
+			if (IsA(parseTree, IndexStmt) && entry->unlogged_tops)
+			{
+				for (int i = 0; i < 2; i++)
+				{
+					lsm3_set_unlogged(top_index[i], entry->heap);
+				}
+				lsm3_set_recovery_horizon(entry->base, entry->top_horizon[0]);
+			}
 			/*  Mark top index as invalid to prevent planner from using it in queries */
 			for (int i = 0; i < 2; i++)
 			{
 				index_set_state_flags(top_index[i], INDEX_DROP_CLEAR_VALID);
 			}
+			for (int i = 0; i < n_levels; i++)
+			{
+				index_set_state_flags(level_index[i], INDEX_DROP_CLEAR_VALID);
+			}
 			SpinLockAcquire(&entry->spinlock);
 			for (int i = 0; i < 2; i++)
 			{
 				entry->top[i] = top_index[i];
 			}
+			for (int i = 0; i < n_levels; i++)
+			{
+				entry->level[i] = level_index[i];
+			}
+			entry->n_levels = n_levels;
+			if (IsA(parseTree, IndexStmt))
+			{
+				/* Just created top and level indexes are empty */
+				for (int i = 0; i < n_levels + 2; i++)
+				{
+					entry->bloom_valid[i] = true;
+				}
+			}
 			SpinLockRelease(&entry->spinlock);
 			{
 				Relation index = index_open(entry->base, AccessShareLock);
@@ -1096,19 +5893,17 @@ lsm3_process_utility(PlannedStmt *plannedStmt,
 }
 
 /*
- * Executor finish hook to reclaim released locks on non-active top indexes
- * to avoid "you don't own a lock of type RowExclusiveLock" warning
+ * Executor finish hook to flush insert buffers at the end of statement
  */
 static void
 lsm3_executor_finish(QueryDesc *queryDesc)
 {
-	lsm3_reacquire_locks();
-	Lsm3InsideCopy = false;
 	if (PreviousExecutorFinish)
 		PreviousExecutorFinish(queryDesc);
 	else
 		standard_ExecutorFinish(queryDesc);
 
+	lsm3_flush_buffers(); /* flush insert buffers at the end of statement */
 }
 
 
@@ -1132,6 +5927,158 @@ _PG_init(void)
 							NULL,
 							NULL);
 
+	DefineCustomIntVariable("lsm3.rewrite_merge_ratio",
+                            "Ratio (percent) of top and base index sizes starting from which base index is rewritten by merge.",
+							"Used for indexes with merge_mode=auto. Zero disables rewriting merge.",
+							&Lsm3RewriteMergeRatio,
+							0,
+							0,
+							INT_MAX,
+							PGC_SIGHUP,
+							0,
+							NULL,
+							NULL,
+							NULL);
+
+	DefineCustomIntVariable("lsm3.bloom_filter_size",
+                            "Size of Bloom filter of top and level indexes (kb).",
+							"Bloom filters allow to skip lookup of sub-indexes which do not contain searched key. Zero disables Bloom filters.",
+							&Lsm3BloomFilterSize,
+							0,
+							0,
+							1024*1024,
+							PGC_POSTMASTER,
+							GUC_UNIT_KB,
+							NULL,
+							NULL,
+							NULL);
+
+	DefineCustomIntVariable("lsm3.max_merge_workers",
+                            "Maximal number of merge workers.",
+							"Merge workers are shared by all Lsm3 indexes. Worker serves one database at a time.",
+							&Lsm3MaxMergeWorkers,
+							4,
+							1,
+							MAX_BACKENDS,
+							PGC_POSTMASTER,
+							0,
+							NULL,
+							NULL,
+							NULL);
+
+	DefineCustomIntVariable("lsm3.max_parallel_merge_workers",
+                            "Maximal number of parallel workers used by one merge.",
+							"Merged top index is split into key ranges which are read by parallel workers concurrently. Zero disables parallel merge.",
+							&Lsm3MaxParallelMergeWorkers,
+							0,
+							0,
+							MAX_PARALLEL_WORKER_LIMIT,
+							PGC_SIGHUP,
+							0,
+							NULL,
+							NULL,
+							NULL);
+
+	DefineCustomBoolVariable("lsm3.merge_gc",
+                             "Drop dead index entries while merging.",
+							 "Merge checks visibility of merged entries in heap and does not propagate entries which are dead for all transactions to the next level.",
+							 &Lsm3MergeGC,
+							 true,
+							 PGC_SIGHUP,
+							 0,
+							 NULL,
+							 NULL,
+							 NULL);
+
+	DefineCustomIntVariable("lsm3.merge_prefetch_distance",
+                            "Number of merged entries for which leaf pages of the next level are prefetched.",
+							"Merge looks ahead in the current batch of merged entries and prefetches leaf pages where they will be inserted. Zero disables prefetch.",
+							&Lsm3MergePrefetchDistance,
+							32,
+							0,
+							LSM3_MERGE_BATCH_SIZE,
+							PGC_SIGHUP,
+							0,
+							NULL,
+							NULL,
+							NULL);
+
+	DefineCustomIntVariable("lsm3.merge_chunk_size",
+                            "Number of merged entries inserted in the next level by one transaction.",
+							"Merge inserting entries is split into chunks committed in separate transactions, so that it doesn't hold back xmin horizon and can be resumed after restart. Zero performs merge in one transaction. Parallel merge is not split into chunks.",
+							&Lsm3MergeChunkSize,
+							65536,
+							0,
+							INT_MAX,
+							PGC_SIGHUP,
+							0,
+							NULL,
+							NULL,
+							NULL);
+
+	DefineCustomBoolVariable("lsm3.append_merge",
+                             "Append merged entries to the next level if their keys follow all its keys.",
+							 "Entries are loaded in new leaf pages appended to the next level instead of inserting them one by one.",
+							 &Lsm3AppendMerge,
+							 true,
+							 PGC_SIGHUP,
+							 0,
+							 NULL,
+							 NULL,
+							 NULL);
+
+	DefineCustomIntVariable("lsm3.top_index_soft_limit",
+                            "Size of active top index (kb) starting from which inserts are throttled.",
+							"Top index exceeds lsm3.top_index_size only if merger falls behind. Zero disables throttling.",
+							&Lsm3TopIndexSoftLimit,
+							0,
+							0,
+							INT_MAX,
+							PGC_SUSET,
+							GUC_UNIT_KB,
+							NULL,
+							NULL,
+							NULL);
+
+	DefineCustomIntVariable("lsm3.top_index_hard_limit",
+                            "Size of active top index (kb) starting from which inserts wait merge completion.",
+							"Zero means no limit.",
+							&Lsm3TopIndexHardLimit,
+							0,
+							0,
+							INT_MAX,
+							PGC_SUSET,
+							GUC_UNIT_KB,
+							NULL,
+							NULL,
+							NULL);
+
+	DefineCustomRealVariable("lsm3.throttle_delay",
+                            "Maximal delay of insert in throttled top index (ms).",
+							"Delay grows linearly from zero at soft limit to this value at hard limit.",
+							&Lsm3ThrottleDelay,
+							0.1,
+							0,
+							100,
+							PGC_SUSET,
+							GUC_UNIT_MS,
+							NULL,
+							NULL,
+							NULL);
+
+	DefineCustomIntVariable("lsm3.insert_buffer_size",
+                            "Size of backend-local buffer of inserted index tuples (kb).",
+							"Buffered tuples are inserted in top index in sorted order. Zero disables buffering.",
+							&Lsm3InsertBufferSize,
+							0,
+							0,
+							1024*1024,
+							PGC_USERSET,
+							GUC_UNIT_KB,
+							NULL,
+							NULL,
+							NULL);
+
 	DefineCustomIntVariable("lsm3.max_indexes",
                             "Maximal number of Lsm3 indexes.",
 							NULL,
@@ -1150,9 +6097,26 @@ _PG_init(void)
 	add_bool_reloption(Lsm3ReloptKind, "unique",
 					   "Index contains no duplicates",
 					   false, AccessExclusiveLock);
+	add_bool_reloption(Lsm3ReloptKind, "packed_base",
+					   "Base index is rebuilt by each merge as densely packed B-Tree with posting lists",
+					   false, AccessExclusiveLock);
+	add_bool_reloption(Lsm3ReloptKind, "unlogged_tops",
+					   "Top indexes are not WAL-logged and are restored from table after crash",
+					   false, AccessExclusiveLock);
 	add_int_reloption(Lsm3ReloptKind, "top_index_size",
 					  "Size of top index (kb)",
 					  0, 0, INT_MAX, AccessExclusiveLock);
+	add_enum_reloption(Lsm3ReloptKind, "merge_mode",
+					   "Method of merging top index with base index",
+					   Lsm3MergeModes, LSM3_MERGE_AUTO,
+					   "Valid values are \"auto\", \"insert\" and \"rewrite\".",
+					   AccessExclusiveLock);
+	add_int_reloption(Lsm3ReloptKind, "levels",
+					  "Number of intermediate levels between top and base indexes",
+					  0, 0, LSM3_MAX_LEVELS, AccessExclusiveLock);
+	add_int_reloption(Lsm3ReloptKind, "level_ratio",
+					  "Ratio of sizes of subsequent levels",
+					  LSM3_DEFAULT_LEVEL_RATIO, 2, 1024, AccessExclusiveLock);
 	add_int_reloption(Lsm3ReloptKind, "fillfactor",
 					  "Packs btree index pages only to this percentage",
 					  BTREE_DEFAULT_FILLFACTOR, BTREE_MIN_FILLFACTOR, 100, ShareUpdateExclusiveLock);
@@ -1178,6 +6142,12 @@ _PG_init(void)
 
 	PreviousExecutorFinish = ExecutorFinish_hook;
 	ExecutorFinish_hook = lsm3_executor_finish;
+
+	PreviousGetRelationInfoHook = get_relation_info_hook;
+	get_relation_info_hook = lsm3_get_relation_info;
+
+	PreviousObjectAccessHook = object_access_hook;
+	object_access_hook = lsm3_object_access;
 }
 
 Datum
@@ -1200,25 +6170,34 @@ lsm3_start_merge(PG_FUNCTION_ARGS)
 	Oid	relid = PG_GETARG_OID(0);
 	Relation index = index_open(relid, AccessShareLock);
 	Lsm3DictEntry* entry = lsm3_get_entry(index);
+	bool schedule_merge = false;
+	TransactionId horizon = entry->unlogged_tops ? lsm3_get_oldest_xmin(NULL) : InvalidTransactionId;
 	index_close(index, AccessShareLock);
 
 	SpinLockAcquire(&entry->spinlock);
-	if (!entry->merge_in_progress)
+	if (entry->merge_in_progress)
+	{
+		/* Repeat request which is not served (merge worker was terminated) */
+		schedule_merge = entry->start_merge;
+	}
+	else
 	{
 		entry->merge_in_progress = true;
 		entry->active_index ^= 1;
+		entry->top_horizon[entry->active_index] = horizon;
 		entry->n_merges += 1;
+		entry->merge_request_size = (int)Min(pg_atomic_read_u64(&entry->top_bytes[1-entry->active_index])/1024, INT_MAX);
 		if (entry->access_count[1-entry->active_index] == 0)
 		{
 			entry->start_merge = true;
-			if (entry->merger == NULL) /* lazy start of bgworker */
-			{
-				lsm3_launch_bgworker(entry);
-			}
-			SetLatch(&entry->merger->procLatch);
+			entry->merge_request_seq = pg_atomic_read_u64(&Lsm3Pool->n_merges);
+			schedule_merge = true;
 		}
 	}
 	SpinLockRelease(&entry->spinlock);
+
+	if (schedule_merge)
+		lsm3_schedule_merge(entry->db_id);
 	PG_RETURN_NULL();
 }
 
@@ -1230,13 +6209,29 @@ lsm3_wait_merge_completion(PG_FUNCTION_ARGS)
 	Lsm3DictEntry* entry = lsm3_get_entry(index);
 	index_close(index, AccessShareLock);
 
-	while (entry->merge_in_progress)
-	{
-		pg_usleep(1000000); /* one second */
-	}
+	lsm3_wait_merge(entry);
 	PG_RETURN_NULL();
 }
 
+Datum
+lsm3_merge_status(PG_FUNCTION_ARGS)
+{
+	Oid	relid = PG_GETARG_OID(0);
+	Relation index = index_open(relid, AccessShareLock);
+	Lsm3DictEntry* entry = lsm3_get_entry(index);
+	TupleDesc tupdesc;
+	Datum values[2];
+	bool nulls[2] = {false, false};
+
+	index_close(index, AccessShareLock);
+	if (get_call_result_type(fcinfo, NULL, &tupdesc) != TYPEFUNC_COMPOSITE)
+		elog(ERROR, "Lsm3: return type must be a row type");
+
+	values[0] = BoolGetDatum(entry->merge_in_progress);
+	values[1] = Int64GetDatum(pg_atomic_read_u64(&entry->merge_generation));
+	PG_RETURN_DATUM(HeapTupleGetDatum(heap_form_tuple(BlessTupleDesc(tupdesc), values, nulls)));
+}
+
 Datum
 lsm3_top_index_size(PG_FUNCTION_ARGS)
 {
@@ -1244,5 +6239,153 @@ lsm3_top_index_size(PG_FUNCTION_ARGS)
 	Relation index = index_open(relid, AccessShareLock);
 	Lsm3DictEntry* entry = lsm3_get_entry(index);
 	index_close(index, AccessShareLock);
-	PG_RETURN_INT64((uint64)lsm3_get_index_size(lsm3_get_index_size(entry->top[entry->active_index]))*BLCKSZ);
+	PG_RETURN_INT64((uint64)lsm3_get_index_size(entry->top[entry->active_index])*BLCKSZ);
+}
+
+Datum
+lsm3_get_bloom_stat(PG_FUNCTION_ARGS)
+{
+	Oid	relid = PG_GETARG_OID(0);
+	Relation index = index_open(relid, AccessShareLock);
+	Lsm3DictEntry* entry = lsm3_get_entry(index);
+	TupleDesc tupdesc;
+	Datum values[3];
+	bool nulls[3] = {false, false, false};
+
+	index_close(index, AccessShareLock);
+	if (get_call_result_type(fcinfo, NULL, &tupdesc) != TYPEFUNC_COMPOSITE)
+		elog(ERROR, "Lsm3: return type must be a row type");
+
+	values[0] = Int64GetDatum(pg_atomic_read_u64(&entry->bloom_hits));
+	values[1] = Int64GetDatum(pg_atomic_read_u64(&entry->bloom_skips));
+	values[2] = Int64GetDatum(pg_atomic_read_u64(&entry->bloom_false_positives));
+	PG_RETURN_DATUM(HeapTupleGetDatum(heap_form_tuple(BlessTupleDesc(tupdesc), values, nulls)));
+}
+
+Datum
+lsm3_get_merge_stat(PG_FUNCTION_ARGS)
+{
+	Oid	relid = PG_GETARG_OID(0);
+	Relation index = index_open(relid, AccessShareLock);
+	Lsm3DictEntry* entry = lsm3_get_entry(index);
+	TupleDesc tupdesc;
+	Datum values[3];
+	bool nulls[3] = {false, false, false};
+
+	index_close(index, AccessShareLock);
+	if (get_call_result_type(fcinfo, NULL, &tupdesc) != TYPEFUNC_COMPOSITE)
+		elog(ERROR, "Lsm3: return type must be a row type");
+
+	values[0] = Int64GetDatum(entry->n_merges);
+	values[1] = Int64GetDatum(pg_atomic_read_u64(&entry->merged_tuples));
+	values[2] = Int64GetDatum(pg_atomic_read_u64(&entry->dropped_tuples));
+	PG_RETURN_DATUM(HeapTupleGetDatum(heap_form_tuple(BlessTupleDesc(tupdesc), values, nulls)));
+}
+
+/* Construct bigint[] from array of counters */
+static Datum
+lsm3_counters_array(uint64* counters, int n)
+{
+	Datum elems[Max(LSM3_MAX_SUB_INDEXES, LSM3_MERGE_DURATION_BUCKETS)];
+	for (int i = 0; i < n; i++)
+		elems[i] = Int64GetDatum(counters[i]);
+	return PointerGetDatum(construct_array(elems, n, INT8OID, sizeof(int64), FLOAT8PASSBYVAL, TYPALIGN_DOUBLE));
+}
+
+/* Statistic of all Lsm3 indexes of current database accessed since server start */
+#define LSM3_INDEX_STATS_COLUMNS 19
+
+Datum
+lsm3_get_index_stats(PG_FUNCTION_ARGS)
+{
+	ReturnSetInfo *rsinfo = (ReturnSetInfo *) fcinfo->resultinfo;
+	TupleDesc tupdesc;
+	Tuplestorestate *tupstore;
+	MemoryContext old_cxt;
+	HASH_SEQ_STATUS status;
+	Lsm3DictEntry* entry;
+
+	if (rsinfo == NULL || !IsA(rsinfo, ReturnSetInfo) || !(rsinfo->allowedModes & SFRM_Materialize))
+		elog(ERROR, "Lsm3: set-valued function called in context that cannot accept a set");
+	if (get_call_result_type(fcinfo, NULL, &tupdesc) != TYPEFUNC_COMPOSITE)
+		elog(ERROR, "Lsm3: return type must be a row type");
+
+	old_cxt = MemoryContextSwitchTo(rsinfo->econtext->ecxt_per_query_memory);
+	tupstore = tuplestore_begin_heap(true, false, work_mem);
+	rsinfo->returnMode = SFRM_Materialize;
+	rsinfo->setResult = tupstore;
+	rsinfo->setDesc = tupdesc;
+	MemoryContextSwitchTo(old_cxt);
+
+	LWLockAcquire(Lsm3DictLock, LW_SHARED);
+	hash_seq_init(&status, Lsm3Dict);
+	while ((entry = (Lsm3DictEntry*)hash_seq_search(&status)) != NULL)
+	{
+		Datum values[LSM3_INDEX_STATS_COLUMNS];
+		bool nulls[LSM3_INDEX_STATS_COLUMNS];
+		uint64 probes[LSM3_MAX_SUB_INDEXES];
+		uint64 durations[LSM3_MERGE_DURATION_BUCKETS];
+		uint64 inserts = 0;
+		uint64 inserted_bytes = 0;
+		uint64 wait_time = 0;
+		uint64 scans = 0;
+		uint64 early_exits = 0;
+		uint64 total_probes = 0;
+		uint64 merged_bytes = pg_atomic_read_u64(&entry->merged_bytes);
+		int n_indexes = entry->n_levels + 3;
+		int active_index = entry->active_index;
+		int col = 0;
+
+		if (entry->db_id != MyDatabaseId)
+			continue;
+
+		/* Aggregate counters of all stripes */
+		memset(probes, 0, sizeof(probes));
+		for (int i = 0; i < LSM3_STAT_STRIPES; i++)
+		{
+			Lsm3StatCounters* stats = &entry->stats[i].counters;
+			inserts += pg_atomic_read_u64(&stats->inserts);
+			inserted_bytes += pg_atomic_read_u64(&stats->inserted_bytes);
+			wait_time += pg_atomic_read_u64(&stats->wait_time);
+			scans += pg_atomic_read_u64(&stats->scans);
+			early_exits += pg_atomic_read_u64(&stats->early_exits);
+			for (int j = 0; j < n_indexes; j++)
+				probes[j] += pg_atomic_read_u64(&stats->probes[j]);
+		}
+		for (int j = 0; j < n_indexes; j++)
+			total_probes += probes[j];
+		for (int j = 0; j < LSM3_MERGE_DURATION_BUCKETS; j++)
+			durations[j] = pg_atomic_read_u64(&entry->merge_durations[j]);
+
+		memset(nulls, 0, sizeof(nulls));
+		values[col++] = ObjectIdGetDatum(entry->base);
+		values[col++] = Int64GetDatum(inserts);
+		values[col++] = Int64GetDatum(inserted_bytes);
+		values[col++] = Int64GetDatum(entry->n_merges);
+		values[col++] = Int64GetDatum(pg_atomic_read_u64(&entry->merged_tuples));
+		values[col++] = Int64GetDatum(merged_bytes);
+		values[col++] = Int64GetDatum(pg_atomic_read_u64(&entry->dropped_tuples));
+		values[col++] = Float8GetDatum((double)pg_atomic_read_u64(&entry->merge_time) / 1000);
+		values[col++] = lsm3_counters_array(durations, LSM3_MERGE_DURATION_BUCKETS);
+		values[col++] = Int64GetDatum(pg_atomic_read_u64(&entry->top_bytes[active_index]));
+		values[col++] = Int64GetDatum(pg_atomic_read_u64(&entry->top_bytes[1 - active_index]));
+		values[col++] = Int64GetDatum(pg_atomic_read_u64(&entry->n_throttled));
+		values[col++] = Int64GetDatum(pg_atomic_read_u64(&entry->n_waits));
+		values[col++] = Float8GetDatum((double)wait_time / 1000);
+		values[col++] = Int64GetDatum(scans);
+		values[col++] = lsm3_counters_array(probes, n_indexes);
+		values[col++] = Int64GetDatum(early_exits);
+		/* Write amplification: bytes written to top indexes and by merges per inserted byte */
+		nulls[col] = inserted_bytes == 0;
+		values[col++] = Float8GetDatum(inserted_bytes == 0 ? 0 : (double)(inserted_bytes + merged_bytes) / inserted_bytes);
+		/* Read amplification: number of searched sub-indexes per scan */
+		nulls[col] = scans == 0;
+		values[col++] = Float8GetDatum(scans == 0 ? 0 : (double)total_probes / scans);
+		Assert(col == LSM3_INDEX_STATS_COLUMNS);
+
+		tuplestore_putvalues(tupstore, tupdesc, values, nulls);
+	}
+	LWLockRelease(Lsm3DictLock);
+
+	return (Datum) 0;
 }
@@ -1,10 +1,93 @@
 /*
- * It is too expensive to check index size at each insert because it requires traverse of all index file segments and calling lseek for each.
- * But we do not need precise size, so it is enough to do it at each n-th insert. The lagest B-Tree key size is abut 2kb,
- * so with N=64K in the worst case error will be less than 128Mb and for 32-bit key just 1Mb.
+ * Size of top index is accounted in shared memory as total size of inserted index tuples, so overflow is checked at each insert.
+ * Some actions (releasing locks inside COPY, repeating merge request) are performed only at each n-th insert.
  */
 #define LSM3_CHECK_TOP_INDEX_SIZE_PERIOD (64*1024) /* should be power of two */
 
+/* Channel used to notify listeners about completion of merge */
+#define LSM3_MERGE_CHANNEL "lsm3_merge"
+
+/*
+ * Maximal number of intermediate levels between top indexes and base index.
+ * Sub-indexes are numbered in the following way: two top indexes (0 and 1), intermediate levels (2..n_levels+1)
+ * and base index (n_levels+2).
+ */
+#define LSM3_MAX_LEVELS 4
+#define LSM3_MAX_SUB_INDEXES (LSM3_MAX_LEVELS + 3)
+#define LSM3_DEFAULT_LEVEL_RATIO 10
+
+/*
+ * Merge reads tuples of merged sub-index by batches of this size and checks their visibility in heap block order
+ * to drop entries which are dead for all transactions.
+ */
+#define LSM3_MERGE_BATCH_SIZE 4096
+
+/*
+ * Switch of rewritten base index to new storage needs exclusive lock. It is requested conditionally
+ * during this time (milliseconds); if index is still used by concurrent statements, merge falls back to inserts
+ * (or is postponed for packed base index).
+ */
+#define LSM3_SWITCH_LOCK_TIMEOUT 1000
+
+/*
+ * Backend waiting for merge completion checks with this interval (milliseconds) that merge is still served
+ * by merge worker, so that it does not wait forever for merge abandoned by terminated worker.
+ */
+#define LSM3_MERGE_CHECK_INTERVAL 1000
+
+/*
+ * Merge worker is launched without waiting for its startup. If it is not started during this time (milliseconds),
+ * then launch is considered to be failed and the slot of merge pool is reused.
+ */
+#define LSM3_MERGER_START_TIMEOUT 10000
+
+/*
+ * Persistent state of Lsm3 indexes is stored in lsm3_state table created by the extension.
+ * Row contains OID of (sub-)index, kind of state, relfilenode of the storage it refers to and value.
+ */
+#define LSM3_STATE_RECOVERY_HORIZON 1 /* Base index: recovery horizon of unlogged top indexes */
+#define LSM3_STATE_MERGE_POSITION   2 /* Merged sub-index: next leaf page of interrupted chunked merge of this storage */
+#define LSM3_STATE_GARBAGE          3 /* Recycled sub-index: old storage and transaction which has switched it to new storage */
+
+#define Natts_lsm3_state             4
+#define Anum_lsm3_state_relid        1
+#define Anum_lsm3_state_kind         2
+#define Anum_lsm3_state_relfilenode  3
+#define Anum_lsm3_state_value        4
+
+/*
+ * Top indexes and intermediate levels have Bloom filters (base index has not).
+ * Filters are located in shared memory after Lsm3DictEntry and have size specified by lsm3.bloom_filter_size GUC.
+ */
+#define LSM3_MAX_BLOOM_FILTERS (LSM3_MAX_SUB_INDEXES - 1)
+#define LSM3_BLOOM_HASHES 4 /* number of hash functions used by Bloom filter */
+
+/*
+ * Hot path counters (inserts and scans) are accumulated in stripes selected by backend number modulo number of stripes,
+ * so that backends with different numbers (up to LSM3_STAT_STRIPES) do not contend for the same cache line.
+ * Counters are not per-backend: stripe is shared by backends with the same remainder. Statistic functions sum all stripes.
+ */
+#define LSM3_STAT_STRIPES 16
+
+typedef struct
+{
+	pg_atomic_uint64 inserts;        /* Number of tuples inserted in top indexes */
+	pg_atomic_uint64 inserted_bytes; /* Total size of tuples inserted in top indexes */
+	pg_atomic_uint64 wait_time;      /* Time (microseconds) inserters were delayed or waited merge completion */
+	pg_atomic_uint64 scans;          /* Number of started index scans */
+	pg_atomic_uint64 early_exits;    /* Number of lookups in index marked as unique stopped at the first found sub-index */
+	pg_atomic_uint64 probes[LSM3_MAX_SUB_INDEXES]; /* Number of searches in each sub-index */
+} Lsm3StatCounters;
+
+typedef union
+{
+	Lsm3StatCounters counters;
+	char pad[2*PG_CACHE_LINE_SIZE];
+} Lsm3StatStripe;
+
+/* Histogram of merge durations: <1s, <10s, <1min, <10min, >=10min */
+#define LSM3_MERGE_DURATION_BUCKETS 5
+
 /*
  * Control structure for Lsm3 index located in shared memory
  */
@@ -13,41 +96,168 @@ typedef struct
 	Oid base;   /* Oid of base index */
 	Oid heap;   /* Oid of indexed relation */
 	Oid top[2]; /* Oids of two top indexes */
+	Oid level[LSM3_MAX_LEVELS]; /* Oids of intermediate level indexes */
+	int n_levels; /* Number of intermediate levels */
+	int level_ratio; /* Ratio of sizes of subsequent levels */
 	int access_count[2]; /* Access counter for top indexes */
 	int active_index; /* Index used for insert */
 	uint64 n_merges;  /* Number of performed merges since database open */
 	uint64 n_inserts; /* Number of performed inserts since database open  */
 	volatile bool start_merge; /* Start merging of top index with base index */
 	volatile bool merge_in_progress; /* Overflow of top index intiate merge process */
-	PGPROC* merger;   /* Merger background worker */
-	Oid     db_id;    /* user ID (for background worker) */
-	Oid     user_id;  /* database Id (for background worker) */
+	pg_atomic_uint64 merge_generation; /* Number of completed merges */
+	uint32  merge_failures;     /* Number of merges interrupted by error of merge worker */
+	int     merge_request_size; /* Size (kb) of merged top index, used to prioritize merges */
+	uint64  merge_request_seq;  /* Value of merge pool counter at the moment of merge request, used for aging */
+	uint32  nonempty_levels;    /* Bitmap of intermediate levels which may be not empty */
+	pg_atomic_uint32 level_pages[LSM3_MAX_LEVELS]; /* Sizes of level indexes (blocks) updated by merge, used by planner */
+	int     resume_level;       /* Number of intermediate level which merge was interrupted (0 if none) */
+	Oid     db_id;    /* database Id (for background worker) */
 	Oid     am_id;    /* Lsm3 AM Oid */
 	int     top_index_size; /* Size of top index */
+	pg_atomic_uint64 top_bytes[2]; /* Total size of index tuples inserted in top indexes */
+	pg_atomic_uint64 n_throttled;  /* Number of inserts delayed because of exceeding soft limit */
+	pg_atomic_uint64 n_waits;      /* Number of inserts waited merge completion because of exceeding hard limit */
+	pg_atomic_uint64 merged_tuples;  /* Number of tuples propagated to the next level by merges */
+	pg_atomic_uint64 dropped_tuples; /* Number of dead tuples removed by merges */
+	pg_atomic_uint64 merged_bytes;   /* Total size of tuples written to destination indexes by merges */
+	pg_atomic_uint64 merge_time;     /* Total duration of merges (microseconds) */
+	pg_atomic_uint64 merge_durations[LSM3_MERGE_DURATION_BUCKETS]; /* Histogram of durations of merges */
+	Lsm3StatStripe   stats[LSM3_STAT_STRIPES]; /* Striped counters of inserts and scans */
 	slock_t spinlock; /* Spinlock to synchronize access */
+	bool    unlogged_tops;          /* Top indexes are unlogged (unlogged_tops option for permanent table) */
+	volatile bool recovery_pending; /* Top indexes were not yet checked for reset by crash recovery */
+	TransactionId top_horizon[2];   /* Tuples inserted in top index have XID not preceding its horizon */
+	pg_atomic_uint64 recycle_generation;         /* Number of switches of sub-indexes to new storage by merges */
+	pg_atomic_uint64 n_vacuums;                  /* Number of vacuums of base index (started bulk deletes) */
+	bool    equal_image;   /* Key columns can be hashed: equal keys have the same binary representation */
+	bool    bloom_enabled; /* Bloom filters are maintained for top and level indexes */
+	volatile bool bloom_valid[LSM3_MAX_BLOOM_FILTERS]; /* Bloom filter covers all keys present in sub-index */
+	pg_atomic_uint64 bloom_hits;  /* Number of sub-index probes not filtered by Bloom filter */
+	pg_atomic_uint64 bloom_skips; /* Number of sub-index probes avoided thanks to Bloom filter */
+	pg_atomic_uint64 bloom_false_positives; /* Number of probes passed Bloom filter but found nothing */
+	pg_atomic_uint32 bloom[FLEXIBLE_ARRAY_MEMBER]; /* Bloom filters of top and level indexes */
 } Lsm3DictEntry;
 
+/*
+ * Backend-local cache of Lsm3 control entries, allowing to avoid lookup in shared hash table at each insert.
+ * Top indexes used by insert are kept opened until the end of transaction.
+ */
+typedef struct
+{
+	Oid            base;   /* Oid of base index (hash key) */
+	Lsm3DictEntry* entry;  /* Shared control entry (NULL if invalidated) */
+	Relation       top[2]; /* Top indexes opened in current transaction */
+	uint64         recycle_generation; /* Recycle generation of shared entry for which invalidations were accepted */
+	MemoryContext  buffer_cxt;       /* Memory context of insert buffer */
+	IndexTuple*    buffer;           /* Buffered index tuples (when lsm3.insert_buffer_size is set) */
+	int            buffer_used;      /* Number of buffered tuples */
+	int            buffer_allocated; /* Size of buffer array */
+	Size           buffer_size;      /* Total size of buffered tuples */
+} Lsm3LocalEntry;
+
+/*
+ * Pool of merge workers shared by all Lsm3 indexes. Size of the pool is specified by lsm3.max_merge_workers GUC.
+ * Background worker can access only one database, so each slot is bound to database while it is used.
+ */
+typedef struct
+{
+	bool    in_use;  /* Slot is assigned to database */
+	Oid     db_id;   /* Database served by the worker */
+	PGPROC* proc;    /* Worker process (NULL until worker is started) */
+	Oid     base;    /* Base index currently merged by the worker or InvalidOid if worker is idle */
+	uint32  generation;    /* Incremented on each launch of worker for the slot (passed to worker in bgw_extra) */
+	TimestampTz launched;  /* Time of the last launch of worker */
+} Lsm3MergerSlot;
+
+typedef struct
+{
+	slock_t          spinlock;   /* Spinlock to synchronize access to slots */
+	pg_atomic_uint64 n_merges;   /* Number of merges started by pool workers */
+	ConditionVariable merge_cv;  /* Signaled on completion of merge of any index (control entries can be removed by DROP INDEX,
+								  * so waiters do not sleep on variables located in them) */
+	Lsm3MergerSlot   slots[FLEXIBLE_ARRAY_MEMBER];
+} Lsm3MergerPool;
+
 /*
  * Opaque part of index scan descriptor
  */
 typedef struct
 {
 	Lsm3DictEntry* entry;      /* Lsm3 control structure */
-	Relation 	   top_index[2]; /* Opened top index relations */
+	int            n_indexes;  /* Number of sub-indexes: top indexes, intermediate levels and base index */
+	Relation 	   index[LSM3_MAX_SUB_INDEXES]; /* Opened top and level index relations */
+	Oid            relfilenode[LSM3_MAX_SUB_INDEXES]; /* Storage of top and level indexes at the beginning of scan */
 	SortSupport    sortKeys;   /* Context for comparing index tuples */
-	IndexScanDesc  scan[3];    /* Scan descriptors for two top indexes and base index */
-	bool           eof[3];     /* Indicators that end of index was reached */
+	IndexScanDesc  scan[LSM3_MAX_SUB_INDEXES]; /* Scan descriptors for sub-indexes */
+	bool           eof[LSM3_MAX_SUB_INDEXES];  /* Indicators that end of index was reached */
+	bool           exhausted[LSM3_MAX_SUB_INDEXES]; /* Sub-scan reached end of index in scan direction (not skipped) */
 	bool           unique;     /* Whether index is "unique" and we can stop scan after locating first occurrence */
 	int            curr_index; /* Index from which last tuple was selected (or -1 if none) */
+	int            n_keys;     /* Number of key attributes */
+	Datum*         keys;       /* Deformed key attributes of current tuples of sub-scans (n_indexes*n_keys) */
+	bool*          nulls;      /* Null flags of key attributes of current tuples of sub-scans */
+	Datum          abbrev[LSM3_MAX_SUB_INDEXES]; /* Abbreviated first key attribute (if supported by opclass) */
+	int            tree[LSM3_MAX_SUB_INDEXES];   /* Loser tree: tree[0] is the winner, tree[1..n_indexes-1] - losers of internal nodes */
+	ScanDirection  dir;        /* Direction used to build loser tree */
+	ItemPointerData last_tid;  /* TID of last returned tuple */
+	bool           use_bloom;  /* Equality lookup for all key columns: sub-indexes can be filtered using Bloom filters */
+	uint64         bloom_hash; /* Hash of searched key */
+	bool           array_keys; /* Scan has ScalarArrayOp keys */
+	bool           parallel_lock;     /* Participant of parallel scan holds lock preventing merge */
+	bool           parallel_assigned; /* Participant of parallel scan has determined sub-indexes it has to scan */
+	/* State of merge saved by lsm3_markpos (positions of B-Tree sub-scans are saved by btmarkpos) */
+	int            mark_curr_index;
+	ScanDirection  mark_dir;
+	ItemPointerData mark_last_tid;
+	bool           mark_eof[LSM3_MAX_SUB_INDEXES];
+	bool           mark_exhausted[LSM3_MAX_SUB_INDEXES];
+	int            mark_tree[LSM3_MAX_SUB_INDEXES];
 } Lsm3ScanOpaque;
 
+/*
+ * Shared state of parallel scan. Top and level indexes are small, so them are scanned by one participant
+ * which first claims them, and leaf pages of base index are distributed between all participants.
+ * This structure is followed by header of parallel scan descriptor of base index and B-Tree parallel scan state.
+ */
+typedef struct
+{
+	pg_atomic_uint32 claimed; /* Top and level indexes are claimed by one of participants */
+	pg_atomic_uint32 mode;    /* Lsm3ParallelMode chosen by participant claimed top indexes */
+} Lsm3ParallelScanDescData;
+
+typedef Lsm3ParallelScanDescData* Lsm3ParallelScanDesc;
+
+typedef enum
+{
+	LSM3_PARALLEL_UNDECIDED, /* Sub-indexes are not claimed yet */
+	LSM3_PARALLEL_BASE,      /* Base index is scanned by all participants holding merge lock */
+	LSM3_PARALLEL_SERIAL     /* Merge is in progress, so the whole scan is performed by participant claimed top indexes */
+} Lsm3ParallelMode;
+
+/*
+ * Methods of merging top index with base index
+ */
+typedef enum
+{
+	LSM3_MERGE_AUTO,    /* choose method based on top/base size ratio (lsm3.rewrite_merge_ratio GUC) */
+	LSM3_MERGE_INSERT,  /* insert tuples of top index in base index */
+	LSM3_MERGE_REWRITE  /* build new base index from sorted merge of base and top indexes */
+} Lsm3MergeMode;
+
 /* Lsm3 index options */
 typedef struct
 {
 	BTOptions   nbt_opts;       /* Standard B-Tree options */
 	int         top_index_size; /* Size of top index (overrode lsm3.top_index_size GUC */
-	bool        unique;			/* Index may not contain duplicates. We prohibit unique constraint for Lsm3 index
-                                 * because it can not be enforced. But presence of this index option allows to optimize
-								 * index lookup: if key is found in active top index, do not search other two indexes.
+	int         merge_mode;     /* Lsm3MergeMode */
+	int         levels;         /* Number of intermediate levels */
+	int         level_ratio;    /* Ratio of sizes of subsequent levels */
+	bool        unique;			/* Index may not contain duplicates. This option does not enforce uniqueness
+                                 * (use unique index for it), but allows to optimize index lookup:
+								 * if key is found in active top index, do not search other indexes.
                                  */
+	bool        packed_base;    /* Base index is only rewritten by merge (never updated in place),
+								 * pages are filled completely and equal keys are stored in posting lists */
+	bool        unlogged_tops;  /* Top indexes are not WAL-logged and are restored from heap after crash */
 } Lsm3Options;
@@ -57,3 +57,377 @@ select * from lsm where k = 1;
 
 drop table lsm;
 
+
+create table r(k bigint, val bigint);
+create index rewrite_index on r using lsm3(k) with (merge_mode=rewrite);
+insert into r values (generate_series(1,10000), 1);
+select lsm3_start_merge('rewrite_index');
+select lsm3_wait_merge_completion('rewrite_index');
+insert into r values (generate_series(5001,15000), 2);
+select lsm3_start_merge('rewrite_index');
+select lsm3_wait_merge_completion('rewrite_index');
+select count(*), sum(k) from r where k between 4990 and 5010;
+select * from r where k = 5005 order by val;
+
+drop table r;
+
+create table l(k bigint, val bigint);
+create index level_index on l using lsm3(k) with (levels=1, level_ratio=2, top_index_size=8);
+insert into l values (generate_series(1,10000), 1);
+select lsm3_start_merge('level_index');
+select lsm3_wait_merge_completion('level_index');
+insert into l values (generate_series(5001,15000), 2);
+select count(*), sum(k) from l where k between 4990 and 5010;
+select lsm3_start_merge('level_index');
+select lsm3_wait_merge_completion('level_index');
+select count(*), sum(k) from l where k between 4990 and 5010;
+select * from l where k = 5005 order by val;
+
+drop table l;
+
+create table b(k bigint, val bigint);
+create index bloom_index on b using lsm3(k);
+set enable_bitmapscan=off;
+insert into b values (generate_series(1,1000), 1);
+select lsm3_start_merge('bloom_index');
+select lsm3_wait_merge_completion('bloom_index');
+insert into b values (generate_series(1001,2000), 2);
+select * from b where k = 500;
+select * from b where k = 1500;
+select * from b where k = 5000;
+select * from lsm3_get_bloom_stat('bloom_index');
+reset enable_bitmapscan;
+
+drop table b;
+
+create table p(k bigint, val bigint);
+create index parallel_index on p using lsm3(k);
+insert into p values (generate_series(1,100000), 1);
+select lsm3_start_merge('parallel_index');
+select lsm3_wait_merge_completion('parallel_index');
+insert into p values (generate_series(50001,60000), 2);
+analyze p;
+set max_parallel_workers_per_gather = 2;
+set parallel_setup_cost = 0;
+set parallel_tuple_cost = 0;
+set min_parallel_index_scan_size = 0;
+set enable_bitmapscan = off;
+select count(*), sum(k) from p where k between 40000 and 70000;
+select count(*) from p where k > 0;
+reset max_parallel_workers_per_gather;
+reset parallel_setup_cost;
+reset parallel_tuple_cost;
+reset min_parallel_index_scan_size;
+reset enable_bitmapscan;
+
+drop table p;
+
+create table a(k bigint, val bigint);
+create index array_index on a using lsm3(k);
+insert into a values (generate_series(1,1000), 1);
+select lsm3_start_merge('array_index');
+select lsm3_wait_merge_completion('array_index');
+insert into a values (generate_series(500,1500), 2);
+set enable_bitmapscan=off;
+select * from a where k = any(array[1200, 1, 5000, 700, 1]) order by k, val;
+select count(*) from a where k in (499, 500, 1000, 1001);
+reset enable_bitmapscan;
+
+drop table a;
+
+create table s(k text);
+create index text_index on s using lsm3(k);
+insert into s select 'key' || lpad(i::text, 5, '0') from generate_series(2,2000,2) i;
+select lsm3_start_merge('text_index');
+select lsm3_wait_merge_completion('text_index');
+insert into s select 'key' || lpad(i::text, 5, '0') from generate_series(1,2000,2) i;
+set enable_bitmapscan=off;
+select * from s where k between 'key00995' and 'key01001' order by k;
+select * from s where k between 'key00995' and 'key01001' order by k desc;
+reset enable_bitmapscan;
+
+drop table s;
+
+create table u(k bigint, val bigint);
+create unique index unique_index on u using lsm3(k);
+insert into u values (generate_series(1,1000), 1);
+select lsm3_start_merge('unique_index');
+select lsm3_wait_merge_completion('unique_index');
+insert into u values (1001, 2);
+insert into u values (500, 2);
+insert into u values (1001, 3);
+insert into u values (2000, 3), (2000, 4);
+insert into u values (null, 1), (null, 2);
+select count(*) from u;
+delete from u where k = 500;
+insert into u values (500, 3);
+insert into u values (1001, 4) on conflict (k) do update set val = excluded.val;
+insert into u values (10, 4) on conflict do nothing;
+select * from u where k in (10, 500, 1001) order by k;
+
+drop table u;
+
+create table b(k bigint, val bigint);
+create index buffered_index on b using lsm3(k);
+set lsm3.insert_buffer_size=64;
+begin;
+insert into b values (generate_series(1000,1,-1), 1);
+select count(*) from b where k between 100 and 199;
+insert into b values (5000, 2);
+select * from b where k >= 999 order by k;
+commit;
+select count(*) from b;
+begin;
+insert into b values (generate_series(2001,2100), 3);
+savepoint s;
+insert into b values (generate_series(2101,2200), 4);
+rollback to savepoint s;
+insert into b values (2300, 5);
+commit;
+select count(*), sum(val) from b where k > 2000;
+set enable_seqscan=off;
+set enable_bitmapscan=off;
+begin;
+insert into b values (generate_series(3001,3100), 6);
+select count(*) from generate_series(3001,3100) s, lateral (select * from b where b.k = s offset 0) x;
+commit;
+reset enable_seqscan;
+reset enable_bitmapscan;
+select inserts from lsm3_stat_indexes where index = 'buffered_index'::regclass;
+reset lsm3.insert_buffer_size;
+
+drop table b;
+
+create table g(k bigint, val bigint);
+create index gc_index on g using lsm3(k);
+insert into g values (generate_series(1,1000), 1);
+delete from g where k % 2 = 0;
+select lsm3_start_merge('gc_index');
+select lsm3_wait_merge_completion('gc_index');
+select merges, merged_tuples + dropped_tuples as total, dropped_tuples > 0 as gc from lsm3_get_merge_stat('gc_index');
+set enable_bitmapscan=off;
+select count(*), sum(k) from g where k between 1 and 100;
+reset enable_bitmapscan;
+
+drop table g;
+
+create table m1(k bigint, val bigint);
+create table m2(k bigint, val bigint);
+create index m1_index on m1 using lsm3(k);
+create index m2_index on m2 using lsm3(k);
+insert into m1 values (generate_series(1,500) % 100, 1);
+select lsm3_start_merge('m1_index');
+select lsm3_wait_merge_completion('m1_index');
+insert into m1 values (generate_series(501,1000) % 100, 2);
+insert into m2 values (generate_series(1,200), 1);
+insert into m2 values (generate_series(1,200), 2);
+set enable_hashjoin=off;
+set enable_nestloop=off;
+set enable_seqscan=off;
+set enable_bitmapscan=off;
+set enable_sort=off;
+set enable_material=off;
+select count(*), sum(m1.k), sum(m1.val*m2.val) from m1 join m2 on m1.k = m2.k;
+reset enable_hashjoin;
+reset enable_nestloop;
+reset enable_seqscan;
+reset enable_bitmapscan;
+reset enable_sort;
+reset enable_material;
+
+drop table m1;
+drop table m2;
+
+create table c(k bigint, val bigint);
+create index cursor_index on c using lsm3(k);
+insert into c values (generate_series(1,9,2), 1);
+select lsm3_start_merge('cursor_index');
+select lsm3_wait_merge_completion('cursor_index');
+insert into c values (generate_series(2,10,2), 2);
+set enable_seqscan=off;
+set enable_bitmapscan=off;
+set enable_sort=off;
+begin;
+declare cur scroll cursor for select k, val from c order by k;
+fetch 4 from cur;
+fetch backward 2 from cur;
+fetch 3 from cur;
+fetch all from cur;
+fetch backward 3 from cur;
+fetch backward all from cur;
+fetch 2 from cur;
+commit;
+reset enable_seqscan;
+reset enable_bitmapscan;
+reset enable_sort;
+
+drop table c;
+
+create table st(k bigint, val bigint);
+create index stat_index on st using lsm3(k);
+insert into st values (generate_series(1,1000), 1);
+select lsm3_start_merge('stat_index');
+select lsm3_wait_merge_completion('stat_index');
+select count(*) from st where k between 100 and 199;
+select inserts, merges, merged_tuples, dropped_tuples, merged_bytes = inserted_bytes as all_merged, write_amplification, scans > 0 as scanned, probes[3] > 0 as base_probed from lsm3_stat_indexes where index = 'stat_index'::regclass;
+
+drop table st;
+
+create table n(k bigint, val bigint);
+create index notify_index on n using lsm3(k);
+select * from lsm3_merge_status('notify_index');
+insert into n values (generate_series(1,1000), 1);
+select lsm3_start_merge('notify_index');
+select lsm3_wait_merge_completion('notify_index');
+select * from lsm3_merge_status('notify_index');
+
+drop table n;
+
+create table p(k bigint, val bigint);
+create index packed_index on p using lsm3(k) with (packed_base=true);
+create index unpacked_index on p using lsm3(k) with (merge_mode=rewrite);
+insert into p values (generate_series(1,10000) % 100, 1);
+select lsm3_start_merge('packed_index');
+select lsm3_wait_merge_completion('packed_index');
+select lsm3_start_merge('unpacked_index');
+select lsm3_wait_merge_completion('unpacked_index');
+select pg_relation_size('packed_index') * 2 < pg_relation_size('unpacked_index') as packed;
+insert into p values (generate_series(1,1000), 2);
+select lsm3_start_merge('packed_index');
+select lsm3_wait_merge_completion('packed_index');
+set enable_seqscan=off;
+set enable_bitmapscan=off;
+select count(*), sum(val) from p where k = 50;
+select count(*), sum(k) from p where k between 90 and 110;
+reset enable_seqscan;
+reset enable_bitmapscan;
+
+drop table p;
+
+create table a(k bigint, val bigint);
+create index append_index on a using lsm3(k);
+insert into a values (generate_series(1,10000), 1);
+select lsm3_start_merge('append_index');
+select lsm3_wait_merge_completion('append_index');
+insert into a values (generate_series(10001,20000), 2);
+select lsm3_start_merge('append_index');
+select lsm3_wait_merge_completion('append_index');
+insert into a values (generate_series(9995,10005), 3);
+select lsm3_start_merge('append_index');
+select lsm3_wait_merge_completion('append_index');
+set enable_seqscan=off;
+set enable_bitmapscan=off;
+select count(*), sum(k), sum(val) from a where k between 9990 and 10010;
+select * from a where k = 10001 order by val;
+select k from a where k > 19995 order by k desc;
+insert into a values (generate_series(20001,30000), 4);
+-- append merge doesn't wait for transactions which have accessed the index
+begin;
+select count(*), sum(val) from a where k > 19990;
+select lsm3_start_merge('append_index');
+select lsm3_wait_merge_completion('append_index');
+select count(*), sum(val) from a where k > 19990;
+commit;
+select count(*), max(k) from a where k > 29995;
+reset enable_seqscan;
+reset enable_bitmapscan;
+drop table a;
+
+create table u(k bigint, val bigint);
+create index unlogged_index on u using lsm3(k) with (unlogged_tops=true);
+select relname, relpersistence from pg_class where relname like 'unlogged_index%' order by relname;
+select kind, value <> 0 as horizon from lsm3_state where relid = 'unlogged_index'::regclass;
+insert into u values (generate_series(1,1000), 1);
+select lsm3_start_merge('unlogged_index');
+select lsm3_wait_merge_completion('unlogged_index');
+insert into u values (generate_series(1001,2000), 2);
+set enable_seqscan=off;
+set enable_bitmapscan=off;
+select count(*), sum(val) from u where k between 900 and 1100;
+reset enable_seqscan;
+reset enable_bitmapscan;
+drop table u;
+
+alter system set lsm3.max_parallel_merge_workers = 0;
+alter system set lsm3.merge_chunk_size = 100;
+select pg_reload_conf();
+create table c(k bigint, val bigint);
+create index chunk_index on c using lsm3(k) with (merge_mode=insert);
+insert into c values (generate_series(1,40000,2), 1);
+select lsm3_start_merge('chunk_index');
+select lsm3_wait_merge_completion('chunk_index');
+insert into c values (generate_series(2,40000,2), 2);
+select lsm3_start_merge('chunk_index');
+-- interrupt chunked merge: it is resumed from the saved position by the next merge request
+select count(pg_terminate_backend(pid)) >= 0 as terminated from pg_stat_activity where backend_type = 'lsm3-merger' and datname = current_database();
+do $$
+begin
+	while exists (select 1 from pg_stat_activity where backend_type = 'lsm3-merger' and datname = current_database()) loop
+		perform pg_sleep(0.01);
+		perform pg_stat_clear_snapshot();
+	end loop;
+end $$;
+select lsm3_start_merge('chunk_index');
+select lsm3_wait_merge_completion('chunk_index');
+set enable_seqscan=off;
+set enable_bitmapscan=off;
+select count(*), count(distinct k), sum(k), sum(val) from c where k between 1 and 40000;
+reset enable_seqscan;
+reset enable_bitmapscan;
+select merged_tuples from lsm3_get_merge_stat('chunk_index');
+select count(*) from lsm3_state where relid in (select indexrelid from pg_index where indrelid = 'c'::regclass) and kind = 2;
+drop table c;
+alter system reset lsm3.max_parallel_merge_workers;
+alter system reset lsm3.merge_chunk_size;
+select pg_reload_conf();
+create table h(k bigint, val bigint);
+create index hard_index on h using lsm3(k);
+-- inserts exceeding hard limit wait for merge completion
+set lsm3.top_index_hard_limit = 64;
+insert into h values (generate_series(1,60000), 1);
+reset lsm3.top_index_hard_limit;
+select waits > 0 as waited from lsm3_stat_indexes where index = 'hard_index'::regclass;
+select lsm3_wait_merge_completion('hard_index');
+set enable_seqscan=off;
+set enable_bitmapscan=off;
+select count(*), sum(k) from h where k between 1 and 60000;
+reset enable_seqscan;
+reset enable_bitmapscan;
+drop table h;
+create table g(k bigint, val bigint);
+create index recycle_index on g using lsm3(k);
+create table gl(k bigint);
+insert into g values (generate_series(1,1000), 1);
+set enable_seqscan=off;
+set enable_bitmapscan=off;
+-- cursor continues to read old storage of top index recycled by merge
+begin;
+declare gc cursor for select k from g where k between 1 and 1000 order by k;
+fetch 3 from gc;
+select lsm3_start_merge('recycle_index');
+select lsm3_wait_merge_completion('recycle_index');
+fetch 3 from gc;
+commit;
+insert into g values (generate_series(1001,2000), 2);
+-- cursor which has accepted switch of top index can not continue its scan
+begin;
+declare gc cursor for select k from g where k between 1 and 2000 order by k;
+fetch 3 from gc;
+select lsm3_start_merge('recycle_index');
+select lsm3_wait_merge_completion('recycle_index');
+lock table gl;
+fetch 3 from gc;
+rollback;
+select count(*), sum(val) from g where k between 1 and 2000;
+reset enable_seqscan;
+reset enable_bitmapscan;
+-- old storage of recycled top index is dropped together with the index
+create temp table garbage as select relfilenode from lsm3_state where kind = 3 and relid in (select indexrelid from pg_index where indrelid = 'g'::regclass);
+select count(*) > 0 as recycled from garbage;
+select count(*) as missed from garbage where pg_stat_file('base/' || (select oid from pg_database where datname = current_database()) || '/' || relfilenode, true) is null;
+drop table g;
+checkpoint;
+select count(*) as left from garbage where pg_stat_file('base/' || (select oid from pg_database where datname = current_database()) || '/' || relfilenode, true) is not null;
+select count(*) from lsm3_state where relid not in (select oid from pg_class);
+drop table garbage;
+drop table gl;